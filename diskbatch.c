@@ -0,0 +1,471 @@
+// DiskBatch 1.0
+// Runs many diskdump jobs at once, scheduled per bus so no hub or controller is overloaded
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include <stdarg.h>
+
+#include "diskdev.h"
+
+#define JOBS 1                  // default jobs at once per group
+#define TOTAL 32                // default jobs at once overall
+#define GROUPS 64
+
+#define WIDEN2(x) L ## x
+#define WIDEN(x) WIDEN2(x)
+#define __WDATE__ WIDEN(__DATE__)
+#define __WTIME__ WIDEN(__TIME__)
+
+#define USAGE L"Usage: diskbatch [options] <jobfile>\n\n"\
+              L"Runs the diskdump jobs listed in <jobfile> concurrently, one per line:\n\n"\
+              L"  <disk#> <filename> [group] [diskdump options]\n\n"\
+              L"Jobs are grouped by the bus of the disk (USB, SATA, SD, ...) unless a group\n"\
+              L"is given. Each group runs a limited number of jobs at once and can be given a\n"\
+              L"bandwidth cap, shared evenly by its jobs. Output of every job goes to\n"\
+              L"<filename>.log, progress of all of them is shown together.\n\n"\
+              L"Options:\n"\
+              L"  --jobs=N      jobs at once in every group (default 1)\n"\
+              L"  --total=N     jobs at once overall (default 32, at most 63)\n"\
+              L"  --group=G:N[:M]\n"\
+              L"                group G runs N jobs at once reading M MB/s at most in total\n"\
+              L"  --dump=F      diskdump executable (default the one next to diskbatch)\n\n"\
+              L"Lines starting with # are ignored, names with spaces go in double quotes.\n\n"
+
+enum { JOB_WAITING, JOB_RUNNING, JOB_DONE, JOB_FAILED };
+
+typedef struct {
+    WCHAR       Name[32];
+    DWORD       Jobs;       // at most this many at once
+    DWORD       Rate;       // MB/s for the whole group, 0 for no cap
+    DWORD       Running;
+    DWORD       Count;      // jobs in the group
+} GROUP;
+
+typedef struct {
+    WCHAR       DiskNo[MAX_PATH];
+    WCHAR       FileName[MAX_PATH];
+    WCHAR       Options[1024];  // passed on to diskdump
+    GROUP*      Group;
+    int         State;
+    DWORD       Rate;       // MB/s given to the job, 0 for no cap
+    HANDLE      hProcess;
+    HANDLE      hPipe;      // read end of its output
+    HANDLE      hThread;    // follows the output
+    FILE*       Log;
+    volatile float Mb;      // from the last progress line
+    volatile float Percent;
+    volatile float Speed;
+    ULONGLONG   Start;
+    ULONGLONG   End;
+    DWORD       Exit;
+} JOB;
+
+void error(int exit, WCHAR* msg, ...) {
+    va_list valist;
+    WCHAR vaBuff[1024] = { L'\0' };
+    WCHAR errBuff[1024] = { L'\0' };
+    DWORD err;
+
+    err = GetLastError();
+
+    va_start(valist, msg);
+    vswprintf(vaBuff, ARRAYSIZE(vaBuff), msg, valist);
+    va_end(valist);
+
+    wprintf(L"\n\n%s: %s\n", (exit) ? L"ERROR" : L"WARNING", vaBuff);
+
+    if (err) {
+        FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS | FORMAT_MESSAGE_MAX_WIDTH_MASK, NULL, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), errBuff, ARRAYSIZE(errBuff), NULL);
+        wprintf(L"[0x%08X] %s\n\n", err, errBuff);
+    }
+    else {
+        putchar(L'\n');
+    }
+
+    FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
+
+    if (exit)
+        ExitProcess(1);
+}
+
+// Returns value of --name=value, empty string for --name, NULL if arg is not --name
+WCHAR* option(WCHAR* arg, WCHAR* name) {
+    size_t len = wcslen(name);
+
+    if (wcsncmp(arg, name, len) != 0)
+        return NULL;
+    if (arg[len] == L'=')
+        return arg + len + 1;
+    if (arg[len] == L'\0')
+        return arg + len;
+    return NULL;
+}
+
+// Next blank separated token of a job line, double quotes keep blanks. FALSE at the end of the line.
+BOOL token(WCHAR** p, WCHAR* out, size_t len) {
+    WCHAR* s = *p;
+    size_t n = 0;
+    BOOL quoted = FALSE;
+
+    while (iswspace(*s))
+        s++;
+    if (!*s)
+        return FALSE;
+
+    for (; *s && (quoted || !iswspace(*s)); s++) {
+        if (*s == L'"')
+            quoted = !quoted;
+        else if (n < len - 1)
+            out[n++] = *s;
+    }
+    out[n] = L'\0';
+
+    *p = s;
+    return TRUE;
+}
+
+// Group by name, created with the defaults the first time
+GROUP* group(GROUP* g, DWORD* n, WCHAR* name, DWORD jobs) {
+    DWORD i;
+
+    for (i = 0; i < *n; i++)
+        if (_wcsicmp(g[i].Name, name) == 0)
+            return &g[i];
+
+    if (*n == GROUPS)
+        error(1, L"Too many groups, at most %u", GROUPS);
+
+    wcsncpy(g[*n].Name, name, ARRAYSIZE(g[*n].Name) - 1);
+    g[*n].Jobs = jobs;
+    return &g[(*n)++];
+}
+
+// Bus of a disk from its storage device descriptor, FILE for an image file
+WCHAR* bus_of(WCHAR* disk) {
+    PSTORAGE_DEVICE_DESCRIPTOR d;
+    WCHAR name[MAX_PATH];
+    WCHAR* bus;
+    HANDLE h;
+
+    if (disk_name(disk, name))
+        return L"FILE";
+
+    // No access needed for the query, so it works while another job reads the disk
+    if ((h = CreateFileW(name, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE)
+        return disk_bus(NULL);
+
+    d = disk_desc(h);
+    bus = disk_bus(d);
+    CloseHandle(h);
+
+    if (d)
+        HeapFree(GetProcessHeap(), 0, d);
+    return bus;
+}
+
+// Thread following the output of a job. Progress lines end in \r and are only kept as numbers,
+// everything else goes to the log.
+DWORD WINAPI follow(LPVOID ctx) {
+    JOB* j = ctx;
+    char buff[4096], line[512];
+    DWORD got, len = 0, i;
+    float mb, percent, speed;
+
+    while (ReadFile(j->hPipe, buff, sizeof(buff), &got, NULL) && got) {
+        for (i = 0; i < got; i++) {
+            if (buff[i] != '\r' && buff[i] != '\n') {
+                if (len < sizeof(line) - 1)
+                    line[len++] = buff[i];
+                continue;
+            }
+
+            line[len] = '\0';
+            if (sscanf(line, "R [%*d] [%f MB] [%f%%] [%f MB/s]", &mb, &percent, &speed) == 3) {
+                j->Mb = mb;
+                j->Percent = percent;
+                j->Speed = speed;
+            }
+            else if (len && j->Log) {
+                fprintf(j->Log, "%s\n", line);
+                fflush(j->Log);
+            }
+            len = 0;
+        }
+    }
+
+    return 0;
+}
+
+// Starts diskdump for a job with its output piped back
+BOOL start(JOB* j, WCHAR* dump) {
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+    STARTUPINFOW si = { sizeof(si) };
+    PROCESS_INFORMATION pi;
+    WCHAR cmd[4096], log[MAX_PATH], rate[32] = { L'\0' };
+    HANDLE out;
+    BOOL ok;
+
+    if (!CreatePipe(&j->hPipe, &out, &sa, 0))
+        return FALSE;
+    SetHandleInformation(j->hPipe, HANDLE_FLAG_INHERIT, 0);
+
+    if (j->Rate)
+        swprintf(rate, ARRAYSIZE(rate), L"--rate=%u ", j->Rate);
+
+    swprintf(cmd, ARRAYSIZE(cmd), L"\"%s\" %s%s \"%s\" \"%s\"", dump, rate, j->Options, j->DiskNo, j->FileName);
+    swprintf(log, ARRAYSIZE(log), L"%s.log", j->FileName);
+
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    si.hStdOutput = out;
+    si.hStdError = out;
+
+    // Jobs are started one at a time, so the write end is inherited by this child only
+    ok = CreateProcessW(NULL, cmd, NULL, NULL, TRUE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi);
+    CloseHandle(out);
+
+    if (!ok) {
+        CloseHandle(j->hPipe);
+        return FALSE;
+    }
+
+    CloseHandle(pi.hThread);
+    j->hProcess = pi.hProcess;
+    j->Log = _wfopen(log, L"w");
+    j->Start = GetTickCount64();
+
+    if ((j->hThread = CreateThread(NULL, 0, follow, j, 0, NULL)) == NULL)
+        error(1, L"Unable to create thread");
+
+    return TRUE;
+}
+
+int wmain(int argc, WCHAR* argv[]) {
+    FILE*                   List;
+    WCHAR                   Line[2048];
+    WCHAR                   Word[MAX_PATH];
+    WCHAR                   Dump[MAX_PATH];
+    WCHAR                   Name[32];
+    WCHAR*                  p;
+    WCHAR*                  Val;
+    JOB*                    Job = NULL;
+    JOB*                    j;
+    GROUP                   Group[GROUPS];
+    GROUP*                  g;
+    HANDLE                  Wait[MAXIMUM_WAIT_OBJECTS];
+    DWORD                   Groups = 0, Jobs = 0, Max = 0;
+    DWORD                   PerGroup = JOBS, Total = TOTAL;
+    DWORD                   Running = 0, Done = 0, Failed = 0;
+    DWORD                   Size, Rate;
+    DWORD                   i, n;
+    float                   Mb, Speed;
+    ULONGLONG               Begin;
+
+    wprintf(L"DiskBatch v1.0, Build %s %s\n\n", __WDATE__, __WTIME__);
+
+    ZeroMemory(Group, sizeof(Group));
+    Dump[0] = L'\0';
+
+    // Options, shifted out so the positional arguments stay where they were
+    while (argc > 1 && wcsncmp(argv[1], L"--", 2) == 0) {
+        if ((Val = option(argv[1], L"--jobs")) != NULL)
+            PerGroup = _wtoi(Val);
+        else if ((Val = option(argv[1], L"--total")) != NULL)
+            Total = _wtoi(Val);
+        else if ((Val = option(argv[1], L"--dump")) != NULL)
+            wcsncpy(Dump, Val, ARRAYSIZE(Dump));
+        else if ((Val = option(argv[1], L"--group")) != NULL && swscanf(Val, L"%31[^:]:%u", Name, &Size) == 2) {
+            g = group(Group, &Groups, Name, Size);
+            g->Jobs = Size;
+            if (swscanf(Val, L"%*[^:]:%*u:%u", &Rate) == 1)
+                g->Rate = Rate;
+        }
+        else
+            error(1, L"Unknown option %s\n\n%s\n", argv[1], USAGE);
+
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    if (argc != 2)
+        error(1, L"Wrong number of parameters [argc=%d]\n\n%s\n", argc, USAGE);
+
+    if (PerGroup < 1 || Total < 1 || Total > MAXIMUM_WAIT_OBJECTS - 1)
+        error(1, L"Invalid options: jobs=%u total=%u\n\n%s\n", PerGroup, Total, USAGE);
+
+    for (i = 0; i < Groups; i++)
+        if (Group[i].Jobs < 1)
+            error(1, L"Invalid options: group %s runs no jobs\n\n%s\n", Group[i].Name, USAGE);
+
+    // diskdump built next to diskbatch carries the same suffix, diskbatch-x64.exe runs diskdump-x64.exe
+    if (!Dump[0]) {
+        GetModuleFileNameW(NULL, Dump, ARRAYSIZE(Dump));
+        p = wcsrchr(Dump, L'\\');
+        p = (p) ? p + 1 : Dump;
+
+        if (_wcsnicmp(p, L"diskbatch", 9) == 0) {
+            wcsncpy(Line, p + 9, ARRAYSIZE(Line));
+            swprintf(p, ARRAYSIZE(Dump) - (p - Dump), L"diskdump%s", Line);
+        }
+        else {
+            wcscpy(p, L"diskdump.exe");
+        }
+    }
+
+    if (GetFileAttributesW(Dump) == INVALID_FILE_ATTRIBUTES)
+        error(1, L"diskdump not found at %s, use --dump", Dump);
+
+    if ((List = _wfopen(argv[1], L"r")) == NULL)
+        error(1, L"Unable to open job file %s", argv[1]);
+
+    while (fgetws(Line, ARRAYSIZE(Line), List)) {
+        p = Line;
+        if (!token(&p, Word, ARRAYSIZE(Word)) || Word[0] == L'#')
+            continue;
+
+        if (Jobs == Max) {
+            Max = (Max) ? Max * 2 : 64;
+            Job = (Job) ? HeapReAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, Job, Max * sizeof(JOB)) : HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, Max * sizeof(JOB));
+            if (Job == NULL)
+                error(1, L"Unable to allocate memory");
+        }
+
+        j = &Job[Jobs];
+        wcsncpy(j->DiskNo, Word, ARRAYSIZE(j->DiskNo));
+
+        if (!token(&p, j->FileName, ARRAYSIZE(j->FileName)))
+            error(1, L"Job %u for disk %s has no file name", Jobs + 1, j->DiskNo);
+
+        Name[0] = L'\0';
+        while (token(&p, Word, ARRAYSIZE(Word))) {
+            if (wcsncmp(Word, L"--", 2) == 0) {
+                wcsncat(j->Options, Word, ARRAYSIZE(j->Options) - wcslen(j->Options) - 2);
+                wcscat(j->Options, L" ");
+            }
+            else {
+                wcsncpy(Name, Word, ARRAYSIZE(Name) - 1);
+                Name[ARRAYSIZE(Name) - 1] = L'\0';
+            }
+        }
+
+        j->Group = group(Group, &Groups, (Name[0]) ? Name : bus_of(j->DiskNo), PerGroup);
+        j->Group->Count++;
+        Jobs++;
+    }
+    fclose(List);
+
+    if (!Jobs)
+        error(1, L"No jobs in %s", argv[1]);
+
+    // A capped group shares its bandwidth between the jobs it runs at once
+    for (i = 0; i < Jobs; i++) {
+        g = Job[i].Group;
+        if (g->Rate)
+            Job[i].Rate = max(1, g->Rate / min(g->Jobs, g->Count));
+    }
+
+    for (i = 0; i < Groups; i++)
+        if (Group[i].Count)
+            wprintf(L"Group %s: %u jobs, %u at once, %s%u%s\n",
+                Group[i].Name,
+                Group[i].Count,
+                Group[i].Jobs,
+                (Group[i].Rate) ? L"" : L"no cap",
+                Group[i].Rate,
+                (Group[i].Rate) ? L" MB/s cap" : L""
+            );
+    wprintf(L"\n");
+
+    Begin = GetTickCount64();
+
+    // Jobs start in the order listed as soon as their group and the total allow
+    for (;;) {
+        for (i = 0; i < Jobs && Running < Total; i++) {
+            j = &Job[i];
+            if (j->State != JOB_WAITING || j->Group->Running >= j->Group->Jobs)
+                continue;
+
+            if (!start(j, Dump)) {
+                error(0, L"Unable to start job for disk %s", j->DiskNo);
+                j->State = JOB_FAILED;
+                Failed++;
+                continue;
+            }
+
+            j->State = JOB_RUNNING;
+            j->Group->Running++;
+            Running++;
+        }
+
+        if (!Running)
+            break;
+
+        for (i = 0, n = 0; i < Jobs; i++)
+            if (Job[i].State == JOB_RUNNING)
+                Wait[n++] = Job[i].hProcess;
+
+        WaitForMultipleObjects(n, Wait, FALSE, 500);
+
+        // Finished jobs, their output is drained before the pipe is closed
+        for (i = 0; i < Jobs; i++) {
+            j = &Job[i];
+            if (j->State != JOB_RUNNING || WaitForSingleObject(j->hProcess, 0) != WAIT_OBJECT_0)
+                continue;
+
+            WaitForSingleObject(j->hThread, INFINITE);
+            GetExitCodeProcess(j->hProcess, &j->Exit);
+            CloseHandle(j->hThread);
+            CloseHandle(j->hPipe);
+            CloseHandle(j->hProcess);
+            if (j->Log)
+                fclose(j->Log);
+
+            j->End = GetTickCount64();
+            j->State = (j->Exit == 0) ? JOB_DONE : JOB_FAILED;
+            (j->Exit == 0) ? Done++ : Failed++;
+            j->Group->Running--;
+            Running--;
+
+            wprintf(L"\r%s %s to %s, %.1f MB in %.1f s                                        \n",
+                (j->Exit == 0) ? L"Done" : L"FAILED",
+                j->DiskNo,
+                j->FileName,
+                j->Mb,
+                (float)(j->End - j->Start) / 1000.0
+            );
+        }
+
+        for (i = 0, Mb = 0, Speed = 0; i < Jobs; i++) {
+            Mb += Job[i].Mb;
+            if (Job[i].State == JOB_RUNNING)
+                Speed += Job[i].Speed;
+        }
+
+        wprintf(L"[%u running] [%u of %u done] [%u failed] [%.1f MB] [%.1f MB/s]          \r", Running, Done, Jobs, Failed, Mb, Speed);
+        FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
+    }
+
+    wprintf(L"\n\n%-20s %-10s %12s %10s %10s  %-7s %s\n", L"Disk", L"Group", L"MB", L"Seconds", L"MB/s", L"Status", L"File");
+    for (i = 0; i < Jobs; i++) {
+        j = &Job[i];
+        wprintf(L"%-20s %-10s %12.1f %10.1f %10.1f  %-7s %s\n",
+            j->DiskNo,
+            j->Group->Name,
+            j->Mb,
+            (float)(j->End - j->Start) / 1000.0,
+            (j->End > j->Start) ? j->Mb / ((float)(j->End - j->Start) / 1000.0) : 0.0,
+            (j->State == JOB_DONE) ? L"ok" : L"FAILED",
+            j->FileName
+        );
+    }
+
+    wprintf(L"\nDone! %u of %u jobs in %.1f s, %u failed\n", Done, Jobs, (float)(GetTickCount64() - Begin) / 1000.0, Failed);
+
+    HeapFree(GetProcessHeap(), 0, Job);
+    return (Failed) ? 1 : 0;
+}
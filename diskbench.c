@@ -0,0 +1,448 @@
+// DiskBench 1.0
+// Measures sequential and random throughput, IOPS and latency of a disk or image file
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include <stdarg.h>
+
+#include "diskdev.h"
+#include "diskstat.h"
+
+#define SECONDS 3               // per test
+
+#define WIDEN2(x) L ## x
+#define WIDEN(x) WIDEN2(x)
+#define __WDATE__ WIDEN(__DATE__)
+#define __WTIME__ WIDEN(__TIME__)
+
+#define USAGE L"Usage: diskbench [options] <disk#>\n\n"\
+              L"Measures read throughput, IOPS and latency of <disk#> for every block size and\n"\
+              L"number of requests in flight, sequential and random. Nothing is written unless\n"\
+              L"--write is given.\n\n"\
+              L"Options:\n"\
+              L"  --block=N[,N...]  block sizes in bytes, multiples of 512 (default 4096,65536,1048576)\n"\
+              L"  --depth=N[,N...]  requests in flight, up to 64 (default 1,4,32)\n"\
+              L"  --seq         sequential tests only\n"\
+              L"  --rand        random tests only\n"\
+              L"  --time=S      seconds per test (default 3)\n"\
+              L"  --max=N       test only the first N bytes of the disk\n"\
+              L"  --write       also test writes, DESTROYS the data on the disk\n"\
+              L"  --json=F      write the results to F as JSON\n\n"\
+              L"Disk# is a number as listed by diskpart, \\\\.\\PhysicalDriveXX, A or B for floppy\n"\
+              L"drives, or a path to an image file. Files are opened without caching.\n\n"
+
+typedef struct {
+    BOOL        Random;
+    BOOL        Write;
+    DWORD       Block;
+    DWORD       Depth;
+    SIDE        Io;         // requests done in the test and their latency
+    double      Seconds;
+    BOOL        Failed;
+} TEST;
+
+void error(int exit, WCHAR* msg, ...) {
+    va_list valist;
+    WCHAR vaBuff[1024] = { L'\0' };
+    WCHAR errBuff[1024] = { L'\0' };
+    DWORD err;
+
+    err = GetLastError();
+
+    va_start(valist, msg);
+    vswprintf(vaBuff, ARRAYSIZE(vaBuff), msg, valist);
+    va_end(valist);
+
+    wprintf(L"\n\n%s: %s\n", (exit) ? L"ERROR" : L"WARNING", vaBuff);
+
+    if (err) {
+        FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS | FORMAT_MESSAGE_MAX_WIDTH_MASK, NULL, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), errBuff, ARRAYSIZE(errBuff), NULL);
+        wprintf(L"[0x%08X] %s\n\n", err, errBuff);
+    }
+    else {
+        putchar(L'\n');
+    }
+
+    FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
+
+    if (exit)
+        ExitProcess(1);
+}
+
+// Returns value of --name=value, empty string for --name, NULL if arg is not --name
+WCHAR* option(WCHAR* arg, WCHAR* name) {
+    size_t len = wcslen(name);
+
+    if (wcsncmp(arg, name, len) != 0)
+        return NULL;
+    if (arg[len] == L'=')
+        return arg + len + 1;
+    if (arg[len] == L'\0')
+        return arg + len;
+    return NULL;
+}
+
+// Comma separated numbers, FALSE if there are none or too many
+BOOL numbers(WCHAR* val, DWORD* out, DWORD* n, DWORD max) {
+    WCHAR* end;
+
+    for (*n = 0; *val; val = (*end == L',') ? end + 1 : end) {
+        if (*n == max)
+            return FALSE;
+        out[(*n)++] = wcstoul(val, &end, 10);
+        if (end == val)
+            return FALSE;
+    }
+
+    return *n > 0;
+}
+
+// xorshift64, random block numbers only need to be spread evenly
+ULONGLONG next_random(ULONGLONG* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+// Queue an overlapped read or write at given device/file offset
+BOOL submit(HANDLE h, OVERLAPPED* o, BYTE* buff, DWORD len, LONGLONG offset, BOOL write) {
+    BOOL ok;
+
+    o->Internal = 0;
+    o->InternalHigh = 0;
+    o->Offset = (DWORD)offset;
+    o->OffsetHigh = (DWORD)(offset >> 32);
+
+    if (write)
+        ok = WriteFile(h, buff, len, NULL, o);
+    else
+        ok = ReadFile(h, buff, len, NULL, o);
+
+    return ok || GetLastError() == ERROR_IO_PENDING;
+}
+
+// Runs one test for a number of seconds keeping Depth requests in flight. Sequential tests carry
+// on from where the last one stopped so the device cache does not help. Every completion is
+// timed from its own submission.
+void run(HANDLE h, TEST* t, BYTE* buff, LONGLONG length, DWORD seconds, LONGLONG* cursor, ULONGLONG* seed) {
+    OVERLAPPED ovl[MAXIMUM_WAIT_OBJECTS];
+    HANDLE wait[MAXIMUM_WAIT_OBJECTS];
+    LARGE_INTEGER sent[MAXIMUM_WAIT_OBJECTS];
+    BOOL busy[MAXIMUM_WAIT_OBJECTS];
+    LARGE_INTEGER freq, begin, now, last;
+    LONGLONG blocks = length / t->Block, pos;
+    DWORD pending = 0, ret, i;
+    BOOL more = TRUE, ok;
+
+    ZeroMemory(ovl, sizeof(ovl));
+    ZeroMemory(busy, sizeof(busy));
+
+    for (i = 0; i < t->Depth; i++)
+        if ((wait[i] = ovl[i].hEvent = CreateEventW(NULL, TRUE, FALSE, NULL)) == NULL)
+            error(1, L"Unable to create event");
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&begin);
+    last = begin;
+
+    for (;;) {
+        // Idle slots get the next block
+        for (i = 0; more && i < t->Depth; i++) {
+            if (busy[i])
+                continue;
+
+            if (t->Random) {
+                pos = (LONGLONG)(next_random(seed) % blocks) * t->Block;
+            }
+            else {
+                if (*cursor + t->Block > blocks * t->Block)
+                    *cursor = 0;
+                pos = *cursor;
+                *cursor += t->Block;
+            }
+
+            QueryPerformanceCounter(&sent[i]);
+            if (!submit(h, &ovl[i], buff + (SIZE_T)i * t->Block, t->Block, pos, t->Write)) {
+                error(0, L"Unable to queue %s at %llu", (t->Write) ? L"write" : L"read", pos);
+                t->Failed = TRUE;
+                more = FALSE;
+                break;
+            }
+
+            busy[i] = TRUE;
+            pending++;
+        }
+
+        if (!pending)
+            break;
+
+        WaitForMultipleObjects(t->Depth, wait, FALSE, INFINITE);
+        QueryPerformanceCounter(&now);
+
+        // Every request that is done, not only the one that woke us up
+        for (i = 0; i < t->Depth; i++) {
+            if (!busy[i] || !HasOverlappedIoCompleted(&ovl[i]))
+                continue;
+
+            ok = GetOverlappedResult(h, &ovl[i], &ret, FALSE);
+            ResetEvent(ovl[i].hEvent);
+            busy[i] = FALSE;
+            pending--;
+
+            if (!ok || ret != t->Block) {
+                if (more)
+                    error(0, L"%s failed at %llu", (t->Write) ? L"Write" : L"Read", ((LONGLONG)ovl[i].OffsetHigh << 32) | ovl[i].Offset);
+                t->Failed = TRUE;
+                more = FALSE;
+                continue;
+            }
+
+            report_io(&t->Io, sent[i].QuadPart, ret, freq);
+            last = now;
+        }
+
+        if (more && now.QuadPart - begin.QuadPart >= (LONGLONG)seconds * freq.QuadPart)
+            more = FALSE;
+    }
+
+    t->Seconds = (double)(last.QuadPart - begin.QuadPart) / (double)freq.QuadPart;
+
+    for (i = 0; i < t->Depth; i++)
+        CloseHandle(ovl[i].hEvent);
+}
+
+int wmain(int argc, WCHAR* argv[]) {
+    HANDLE                  hDisk;
+    WCHAR                   DevName[MAX_PATH];
+    WCHAR                   Model[256];
+    WCHAR*                  DiskNo;
+    WCHAR*                  JsonName = NULL;
+    WCHAR*                  Val;
+    FILE*                   Json;
+    PSTORAGE_DEVICE_DESCRIPTOR desc_d = NULL;
+    LARGE_INTEGER           Length;
+    LONGLONG                Max = 0;
+    LONGLONG                Cursor = 0;
+    ULONGLONG               Seed = 0x9E3779B97F4A7C15ULL;
+    TEST*                   Test;
+    TEST*                   t;
+    BYTE*                   Buff;
+    DWORD                   Block[16] = { 4096, 65536, 1 << 20 };
+    DWORD                   Depth[16] = { 1, 4, 32 };
+    DWORD                   Blocks = 3, Depths = 3, Tests = 0;
+    DWORD                   Seconds = SECONDS;
+    DWORD                   MaxBlock = 0, MaxDepth = 0;
+    DWORD                   BytesRet;
+    DWORD                   i, b, d, r, w;
+    BOOL                    Seq = TRUE, Rand = TRUE, Write = FALSE;
+    BOOL                    IsFile, Failed = FALSE;
+
+    wprintf(L"DiskBench v1.0, Build %s %s\n\n", __WDATE__, __WTIME__);
+
+    // Options, shifted out so the positional arguments stay where they were
+    while (argc > 1 && wcsncmp(argv[1], L"--", 2) == 0) {
+        if ((Val = option(argv[1], L"--block")) != NULL && *Val) {
+            if (!numbers(Val, Block, &Blocks, ARRAYSIZE(Block)))
+                error(1, L"Invalid block sizes %s\n\n%s\n", Val, USAGE);
+        }
+        else if ((Val = option(argv[1], L"--depth")) != NULL && *Val) {
+            if (!numbers(Val, Depth, &Depths, ARRAYSIZE(Depth)))
+                error(1, L"Invalid depths %s\n\n%s\n", Val, USAGE);
+        }
+        else if ((Val = option(argv[1], L"--seq")) != NULL && !*Val)
+            Rand = FALSE;
+        else if ((Val = option(argv[1], L"--rand")) != NULL && !*Val)
+            Seq = FALSE;
+        else if ((Val = option(argv[1], L"--time")) != NULL)
+            Seconds = _wtoi(Val);
+        else if ((Val = option(argv[1], L"--max")) != NULL)
+            Max = _wtoi64(Val);
+        else if ((Val = option(argv[1], L"--write")) != NULL && !*Val)
+            Write = TRUE;
+        else if ((Val = option(argv[1], L"--json")) != NULL && *Val)
+            JsonName = Val;
+        else
+            error(1, L"Unknown option %s\n\n%s\n", argv[1], USAGE);
+
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    if (argc != 2)
+        error(1, L"Wrong number of parameters [argc=%d]\n\n%s\n", argc, USAGE);
+
+    if (!Seq && !Rand)
+        Seq = Rand = TRUE;
+
+    for (b = 0; b < Blocks; b++) {
+        if (Block[b] < 512 || Block[b] % 512 || Block[b] > (64 << 20))
+            error(1, L"Invalid options: block=%u must be a multiple of 512 up to 64 MB\n\n%s\n", Block[b], USAGE);
+        MaxBlock = max(MaxBlock, Block[b]);
+    }
+
+    for (d = 0; d < Depths; d++) {
+        if (Depth[d] < 1 || Depth[d] > MAXIMUM_WAIT_OBJECTS)
+            error(1, L"Invalid options: depth=%u must be 1 to %u\n\n%s\n", Depth[d], MAXIMUM_WAIT_OBJECTS, USAGE);
+        MaxDepth = max(MaxDepth, Depth[d]);
+    }
+
+    if (Seconds < 1 || Max < 0)
+        error(1, L"Invalid options: time=%u max=%lld\n\n%s\n", Seconds, Max, USAGE);
+
+    DiskNo = argv[1];
+    if ((IsFile = disk_name(DiskNo, DevName)) < 0)
+        error(1, L"Invalid options: %s is not a disk number, A:, B: or \\\\.\\PhysicalDriveN\n\n%s\n", DiskNo, USAGE);
+
+    // Files are read past the cache, otherwise memory would be measured
+    if ((hDisk = CreateFileW(DevName, GENERIC_READ | ((Write) ? GENERIC_WRITE : 0), FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+        FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING | ((Write) ? FILE_FLAG_WRITE_THROUGH : 0), NULL)) == INVALID_HANDLE_VALUE)
+        error(1, L"Cannot open %s", DevName);
+
+    if (!disk_length(hDisk, IsFile, &Length) || !Length.QuadPart)
+        error(1, L"Unable to obtain length of %s", DevName);
+
+    if (IsFile) {
+        wcscpy(Model, L"FILE");
+    }
+    else {
+        if ((desc_d = disk_desc(hDisk)) == NULL)
+            error(0, L"Error on DeviceIoControl IOCTL_STORAGE_QUERY_PROPERTY");
+
+        swprintf(Model, ARRAYSIZE(Model), L"%S %S", desc_str(desc_d, (desc_d) ? desc_d->VendorIdOffset : 0), desc_str(desc_d, (desc_d) ? desc_d->ProductIdOffset : 0));
+    }
+
+    wprintf(L"%s %s %s %s %.1f MB  (%llu bytes)\n",
+        (IsFile) ? L"Image" : L"Disk",
+        DevName,
+        (IsFile) ? L"FILE" : disk_bus(desc_d),
+        Model,
+        (float)Length.QuadPart / (float)(1 << 20),
+        Length.QuadPart
+    );
+
+    if (Max && Max < Length.QuadPart)
+        Length.QuadPart = Max;
+
+    if (Length.QuadPart < MaxBlock)
+        error(1, L"Tested range of %llu bytes is smaller than block %u", Length.QuadPart, MaxBlock);
+
+    if (Write) {
+        wprintf(L"\nWARNING: write tests overwrite %s%s with random data?!\nThere is no going back after this, continue? (y/N) ?",
+            (Max) ? L"the start of " : L"",
+            DevName
+        );
+        if (getwchar() != L'y')
+            error(1, L"\rAborting...\n");
+
+        if (!IsFile && !ioctl(hDisk, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &BytesRet))
+            error(1, L"Error on DeviceIoControl FSCTL_LOCK_VOLUME [%d] ", BytesRet);
+    }
+
+    // One buffer per request in flight, page aligned as unbuffered I/O needs
+    if ((Buff = VirtualAlloc(NULL, (SIZE_T)MaxBlock * MaxDepth, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        error(1, L"Unable to allocate memory");
+
+    Test = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, 4 * Blocks * Depths * sizeof(TEST));
+    if (Test == NULL)
+        error(1, L"Unable to allocate memory");
+
+    wprintf(L"\n%-5s %-5s %8s %5s %10s %10s %9s %9s %9s %9s\n", L"", L"", L"Block", L"Depth", L"MB/s", L"IOPS", L"p50 us", L"p99 us", L"p999 us", L"max us");
+
+    // Reads first, so a write test never comes before the reads it would disturb
+    for (w = 0; w <= (DWORD)Write; w++) {
+        // Writes send random data so drives that compress or deduplicate do not look faster than
+        // they are. Filled after the reads, which leave whatever the disk held in the buffer.
+        if (w)
+            for (i = 0; i < (SIZE_T)MaxBlock * MaxDepth / sizeof(ULONGLONG); i++)
+                ((ULONGLONG*)Buff)[i] = next_random(&Seed);
+
+        for (r = 0; r < 2; r++) {
+            if ((r && !Rand) || (!r && !Seq))
+                continue;
+
+            for (b = 0; b < Blocks; b++) {
+                for (d = 0; d < Depths; d++) {
+                    t = &Test[Tests++];
+                    t->Random = r;
+                    t->Write = w;
+                    t->Block = Block[b];
+                    t->Depth = Depth[d];
+
+                    wprintf(L"%-5s %-5s %8u %5u   running...\r", (r) ? L"rand" : L"seq", (w) ? L"write" : L"read", t->Block, t->Depth);
+                    FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
+
+                    run(hDisk, t, Buff, Length.QuadPart, Seconds, &Cursor, &Seed);
+                    Failed = Failed || t->Failed;
+
+                    wprintf(L"%-5s %-5s %8u %5u %10.1f %10.0f %9llu %9llu %9llu %9llu%s\n",
+                        (r) ? L"rand" : L"seq",
+                        (w) ? L"write" : L"read",
+                        t->Block,
+                        t->Depth,
+                        (t->Seconds > 0) ? (double)t->Io.Bytes / (double)(1 << 20) / t->Seconds : 0.0,
+                        (t->Seconds > 0) ? (double)t->Io.Ops / t->Seconds : 0.0,
+                        side_percentile(&t->Io, 0.5),
+                        side_percentile(&t->Io, 0.99),
+                        side_percentile(&t->Io, 0.999),
+                        t->Io.MaxUs,
+                        (t->Failed) ? L"  FAILED" : L""
+                    );
+                }
+            }
+        }
+    }
+
+    if (JsonName) {
+        if ((Json = _wfopen(JsonName, L"w")) == NULL)
+            error(1, L"Unable to open %s", JsonName);
+
+        fprintf(Json, "{\n  \"device\": ");
+        json_str(Json, DevName);
+        fprintf(Json, ",\n  \"model\": ");
+        json_str(Json, Model);
+        fprintf(Json, ",\n  \"bus\": \"%S\",\n  \"length\": %llu,\n  \"seconds\": %u,\n  \"tests\": [\n",
+            (IsFile) ? L"FILE" : disk_bus(desc_d), Length.QuadPart, Seconds);
+
+        for (i = 0; i < Tests; i++) {
+            t = &Test[i];
+            fprintf(Json, "    { \"pattern\": \"%s\", \"op\": \"%s\", \"block\": %u, \"depth\": %u, \"seconds\": %.3f, \"bytes\": %lld, \"ops\": %lld, "
+                "\"mbps\": %.1f, \"iops\": %.0f, \"p50_us\": %llu, \"p99_us\": %llu, \"p999_us\": %llu, \"max_us\": %llu, \"failed\": %s }%s\n",
+                (t->Random) ? "rand" : "seq",
+                (t->Write) ? "write" : "read",
+                t->Block,
+                t->Depth,
+                t->Seconds,
+                t->Io.Bytes,
+                t->Io.Ops,
+                (t->Seconds > 0) ? (double)t->Io.Bytes / (double)(1 << 20) / t->Seconds : 0.0,
+                (t->Seconds > 0) ? (double)t->Io.Ops / t->Seconds : 0.0,
+                side_percentile(&t->Io, 0.5),
+                side_percentile(&t->Io, 0.99),
+                side_percentile(&t->Io, 0.999),
+                t->Io.MaxUs,
+                (t->Failed) ? "true" : "false",
+                (i + 1 < Tests) ? "," : ""
+            );
+        }
+
+        fprintf(Json, "  ]\n}\n");
+        if (fclose(Json) != 0)
+            error(1, L"Error writing %s", JsonName);
+
+        wprintf(L"\nResults written to %s\n", JsonName);
+    }
+
+    CloseHandle(hDisk);
+    VirtualFree(Buff, 0, MEM_RELEASE);
+    HeapFree(GetProcessHeap(), 0, Test);
+    if (desc_d)
+        HeapFree(GetProcessHeap(), 0, desc_d);
+
+    return (Failed) ? 1 : 0;
+}
@@ -0,0 +1,109 @@
+// Differential images shared by diskdump, diskrestore and diskmerge
+//
+// A delta holds only the chunks of an image that changed since a previous dump.
+// Changes are found by comparing chunk digests with the manifest of that dump,
+// so the previous image itself is never read. Layout:
+//
+//   DELTA_HEADER
+//   data                    changed chunks back to back
+//   DELTA_EXTENT            one per run of changed chunks
+//   ...
+//
+// Every delta names the image digest of its base and of the image it produces,
+// so a chain of deltas can be checked before it is replayed. Include after diskhash.h.
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#define DELTA_MAGIC "DISKDLTA"
+#define DELTA_VERSION 1
+
+#pragma pack(push, 1)
+typedef struct {
+    BYTE        Magic[8];       // DELTA_MAGIC
+    DWORD       Version;        // DELTA_VERSION
+    DWORD       ChunkSize;      // bytes per chunk compared
+    ULONGLONG   Length;         // image length once the delta is applied
+    ULONGLONG   Map;            // file offset of the first DELTA_EXTENT, 0 while being written
+    DWORD       Count;          // number of extents
+    DWORD       Hash;           // HASH_* of the digests below
+    BYTE        Base[HASH_MAX]; // image digest of the base
+    BYTE        Tree[HASH_MAX]; // image digest once the delta is applied
+} DELTA_HEADER;
+
+typedef struct {
+    ULONGLONG   Offset;         // image offset
+    ULONGLONG   Data;           // file offset of the data
+    ULONGLONG   Length;
+} DELTA_EXTENT;
+#pragma pack(pop)
+
+// Chunk digests of a previous dump, from the manifest written by diskdump --hash
+typedef struct {
+    int         Algorithm;
+    DWORD       Size;           // digest bytes
+    DWORD       ChunkSize;
+    DWORD       Count;
+    ULONGLONG   Length;
+    BYTE        Tree[HASH_MAX];
+    BYTE*       Digest;         // Count * Size
+} MANIFEST;
+
+// Load a manifest, the name of an image is taken to mean the manifest next to it
+BOOL load_manifest(WCHAR* name, MANIFEST* m) {
+    WCHAR path[MAX_PATH];
+    WCHAR alg[16];
+    char line[512], key[32], hex[2 * HASH_MAX + 1];
+    ULONGLONG value, offset, length;
+    DWORD chunk, tree = 0, chunks = 0;
+    FILE* f;
+
+    ZeroMemory(m, sizeof(*m));
+
+    if (wcslen(name) > 9 && _wcsicmp(name + wcslen(name) - 9, L".manifest") == 0)
+        wcsncpy(path, name, ARRAYSIZE(path));
+    else
+        swprintf(path, ARRAYSIZE(path), L"%s.manifest", name);
+
+    if ((f = _wfopen(path, L"r")) == NULL)
+        return FALSE;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%31s", key) != 1 || key[0] == '#')
+            continue;
+
+        if (strcmp(key, "hash") == 0 && sscanf(line, "%*s %15S", alg) == 1) {
+            m->Algorithm = hash_algorithm(alg);
+            m->Size = hash_size(m->Algorithm);
+        }
+        else if (strcmp(key, "chunk_size") == 0 && sscanf(line, "%*s %llu", &value) == 1) {
+            m->ChunkSize = (DWORD)value;
+        }
+        else if (strcmp(key, "length") == 0 && sscanf(line, "%*s %llu", &value) == 1) {
+            m->Length = value;
+        }
+        else if (strcmp(key, "chunks") == 0 && sscanf(line, "%*s %llu", &value) == 1 && m->Size && !m->Digest) {
+            m->Count = (DWORD)value;
+            if ((m->Digest = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, max(m->Count, 1) * m->Size)) == NULL)
+                break;
+        }
+        else if (strcmp(key, "tree") == 0 && sscanf(line, "%*s %64s", hex) == 1) {
+            tree = hash_unhex(hex, m->Size, m->Tree);
+        }
+        else if (strcmp(key, "chunk") == 0 && sscanf(line, "%*s %u %llu %llu %64s", &chunk, &offset, &length, hex) == 4) {
+            if (!m->Digest || chunk >= m->Count || offset != (ULONGLONG)chunk * m->ChunkSize || !hash_unhex(hex, m->Size, m->Digest + chunk * m->Size))
+                break;
+            chunks++;
+        }
+    }
+
+    fclose(f);
+
+    if (!m->Algorithm || !m->ChunkSize || !m->Digest || !tree || chunks != m->Count) {
+        if (m->Digest)
+            HeapFree(GetProcessHeap(), 0, m->Digest);
+        ZeroMemory(m, sizeof(*m));
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,292 @@
+// Device naming, length and identity shared by diskdump, diskrestore, diskbatch and diskbench
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+
+// DeviceIoControl for a handle opened with FILE_FLAG_OVERLAPPED
+BOOL ioctl(HANDLE h, DWORD code, LPVOID in, DWORD inlen, LPVOID out, DWORD outlen, LPDWORD ret) {
+    OVERLAPPED ovl = { 0 };
+    BOOL ok;
+    DWORD err;
+
+    ovl.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    ok = DeviceIoControl(h, code, in, inlen, out, outlen, ret, &ovl);
+    if (!ok && GetLastError() == ERROR_IO_PENDING)
+        ok = GetOverlappedResult(h, &ovl, ret, TRUE);
+
+    err = GetLastError();
+    CloseHandle(ovl.hEvent);
+    SetLastError(err);
+
+    return ok;
+}
+
+// Synchronous read on a handle opened with FILE_FLAG_OVERLAPPED
+BOOL read_at(HANDLE h, LPVOID buff, DWORD len, LONGLONG offset, LPDWORD ret) {
+    OVERLAPPED ovl = { 0 };
+    BOOL ok;
+
+    *ret = 0;
+    ovl.Offset = (DWORD)offset;
+    ovl.OffsetHigh = (DWORD)(offset >> 32);
+    ovl.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    ok = ReadFile(h, buff, len, NULL, &ovl) || GetLastError() == ERROR_IO_PENDING;
+    ok = ok && GetOverlappedResult(h, &ovl, ret, TRUE);
+
+    CloseHandle(ovl.hEvent);
+    return ok;
+}
+
+// Synchronous write on a handle opened with FILE_FLAG_OVERLAPPED
+BOOL write_at(HANDLE h, LPCVOID buff, DWORD len, LONGLONG offset) {
+    OVERLAPPED ovl = { 0 };
+    DWORD ret = 0;
+    BOOL ok;
+
+    ovl.Offset = (DWORD)offset;
+    ovl.OffsetHigh = (DWORD)(offset >> 32);
+    ovl.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    ok = WriteFile(h, buff, len, NULL, &ovl) || GetLastError() == ERROR_IO_PENDING;
+    ok = ok && GetOverlappedResult(h, &ovl, &ret, TRUE) && ret == len;
+
+    CloseHandle(ovl.hEvent);
+    return ok;
+}
+
+// TRUE for a non-empty run of digits only
+BOOL all_digits(WCHAR* s) {
+    return s[0] && wcsspn(s, L"0123456789") == wcslen(s);
+}
+
+// Device name of a disk number, floppy letter or \\.\PhysicalDriveN, anything else is an image file. 1 for a file,
+// 0 for a disk and -1 for a name that looks like a disk but is none of these (C:, disk2, PhysicalDrive1, \\.\C:, 2a),
+// rather than an image file of that name being created or read.
+// A floppy is A or B alone or with a colon, longer names starting with them are files.
+int disk_name(WCHAR* disk, WCHAR* name) {
+    wcsncpy(name, disk, MAX_PATH);
+
+    if (_wcsnicmp(disk, L"\\\\.\\PhysicalDrive", 17) == 0 && all_digits(disk + 17))
+        return 0;
+
+    if (all_digits(disk)) {
+        swprintf(name, MAX_PATH, L"\\\\.\\PhysicalDrive%s", disk);
+        return 0;
+    }
+
+    if ((disk[0] == 'a' || disk[0] == 'A' || disk[0] == 'b' || disk[0] == 'B') && (disk[1] == L'\0' || (disk[1] == L':' && disk[2] == L'\0'))) {
+        swprintf(name, MAX_PATH, L"\\\\.\\%c:", disk[0]);
+        return 0;
+    }
+
+    // Volumes, other devices and disk numbers that are mistyped
+    if (iswdigit(disk[0]) || wcsncmp(disk, L"\\\\.\\", 4) == 0 || (iswalpha(disk[0]) && disk[1] == L':' && disk[2] == L'\0') ||
+        (_wcsnicmp(disk, L"PhysicalDrive", 13) == 0 && all_digits(disk + 13)) || (_wcsnicmp(disk, L"disk", 4) == 0 && all_digits(disk + 4)))
+        return -1;
+
+    return 1;
+}
+
+// Length of a disk or image file. On removable media the first DISK_GET_LENGTH is not
+// supported, the geometry is used then.
+BOOL disk_length(HANDLE h, BOOL isfile, PLARGE_INTEGER length) {
+    GET_LENGTH_INFORMATION len;
+    DISK_GEOMETRY geom;
+    DWORD ret;
+
+    if (isfile)
+        return GetFileSizeEx(h, length);
+
+    if (ioctl(h, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &len, sizeof(len), &ret)) {
+        *length = len.Length;
+        return TRUE;
+    }
+
+    if (!ioctl(h, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &geom, sizeof(geom), &ret))
+        return FALSE;
+
+    length->QuadPart = geom.Cylinders.QuadPart * geom.TracksPerCylinder * geom.SectorsPerTrack * geom.BytesPerSector;
+    return TRUE;
+}
+
+// Logical sector size of a disk, 0 for an image file or a disk that does not tell
+DWORD disk_sector(HANDLE h, BOOL isfile) {
+    DISK_GEOMETRY geom;
+    DWORD ret;
+
+    if (isfile || !ioctl(h, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &geom, sizeof(geom), &ret))
+        return 0;
+
+    return geom.BytesPerSector;
+}
+
+// Storage device descriptor with the vendor, product and serial strings, NULL if the device does
+// not report one. Freed with HeapFree.
+PSTORAGE_DEVICE_DESCRIPTOR disk_desc(HANDLE h) {
+    STORAGE_PROPERTY_QUERY q = { StorageDeviceProperty, PropertyStandardQuery };
+    STORAGE_DESCRIPTOR_HEADER head = { 0 };
+    PSTORAGE_DEVICE_DESCRIPTOR d;
+    DWORD ret;
+
+    if (!ioctl(h, IOCTL_STORAGE_QUERY_PROPERTY, &q, sizeof(q), &head, sizeof(head), &ret) || head.Size < sizeof(STORAGE_DEVICE_DESCRIPTOR))
+        return NULL;
+
+    if ((d = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, head.Size)) == NULL)
+        return NULL;
+
+    if (!ioctl(h, IOCTL_STORAGE_QUERY_PROPERTY, &q, sizeof(q), d, head.Size, &ret)) {
+        HeapFree(GetProcessHeap(), 0, d);
+        return NULL;
+    }
+
+    return d;
+}
+
+// String from a storage device descriptor, "n/a" if the device did not report it
+char* desc_str(PSTORAGE_DEVICE_DESCRIPTOR d, DWORD offset) {
+    return (d && offset) ? (char*)d + offset : "n/a";
+}
+
+// Bus of a device as named in the manifest and by diskbatch
+WCHAR* disk_bus(PSTORAGE_DEVICE_DESCRIPTOR d) {
+    WCHAR* bus[] = { L"UNKNOWN", L"SCSI", L"ATAPI", L"ATA", L"1394", L"SSA", L"FC", L"USB", L"RAID", L"ISCSI", L"SAS", L"SATA", L"SD", L"MMC", L"VIRTUAL", L"VHD", L"MAX", L"NVME" };
+
+    return (d && (DWORD)d->BusType < ARRAYSIZE(bus)) ? bus[d->BusType] : bus[0];
+}
+
+// Sector size of the volume holding a file, the physical one if the volume reports it.
+// Unbuffered I/O on the file has to be aligned to it.
+DWORD file_sector(WCHAR* name) {
+    STORAGE_PROPERTY_QUERY q = { StorageAccessAlignmentProperty, PropertyStandardQuery };
+    STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR a = { 0 };
+    WCHAR full[MAX_PATH], root[MAX_PATH], vol[8];
+    DWORD spc, bps, clusters, total, ret;
+    HANDLE h;
+
+    if (!GetFullPathNameW(name, MAX_PATH, full, NULL) || !GetVolumePathNameW(full, root, MAX_PATH) ||
+        !GetDiskFreeSpaceW(root, &spc, &bps, &clusters, &total) || bps < 512)
+        bps = 4096;
+
+    // Mount points and shares only tell the logical size
+    if (iswalpha(root[0]) && root[1] == L':') {
+        swprintf(vol, ARRAYSIZE(vol), L"\\\\.\\%c:", root[0]);
+
+        if ((h = CreateFileW(vol, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL)) != INVALID_HANDLE_VALUE) {
+            if (DeviceIoControl(h, IOCTL_STORAGE_QUERY_PROPERTY, &q, sizeof(q), &a, sizeof(a), &ret, NULL) &&
+                a.BytesPerPhysicalSector > bps && a.BytesPerPhysicalSector <= 65536 && a.BytesPerPhysicalSector % bps == 0)
+                bps = a.BytesPerPhysicalSector;
+            CloseHandle(h);
+        }
+    }
+
+    return bps;
+}
+
+// Buffers carved out of one allocation, each aligned for unbuffered I/O. Freed all at once.
+typedef struct {
+    BYTE*       Base;
+    SIZE_T      Size;
+    SIZE_T      Used;
+    DWORD       Align;
+} POOL;
+
+// Room for count buffers of len bytes, align is a power of two
+BOOL pool_init(POOL* p, DWORD count, DWORD len, DWORD align) {
+    p->Align = max(align, 4096);
+    p->Size = (SIZE_T)count * ((len + p->Align - 1) & ~(SIZE_T)(p->Align - 1)) + p->Align;
+    p->Used = 0;
+
+    // Pages are zeroed and 4 KB aligned, larger alignments are made from the spare buffer
+    p->Base = VirtualAlloc(NULL, p->Size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (p->Base)
+        p->Used = (p->Align - (SIZE_T)p->Base % p->Align) % p->Align;
+
+    return p->Base != NULL;
+}
+
+// Next buffer, NULL when the pool is used up
+BYTE* pool_get(POOL* p, DWORD len) {
+    BYTE* b;
+    SIZE_T size = (len + p->Align - 1) & ~(SIZE_T)(p->Align - 1);
+
+    if (!p->Base || p->Used + size > p->Size)
+        return NULL;
+
+    b = p->Base + p->Used;
+    p->Used += size;
+    return b;
+}
+
+void pool_free(POOL* p) {
+    if (p->Base)
+        VirtualFree(p->Base, 0, MEM_RELEASE);
+    p->Base = NULL;
+}
+
+// Read only view of a mapped file at any offset. Views start on the allocation granularity,
+// data points at offset within it. NULL on failure, unmapped with UnmapViewOfFile.
+BYTE* map_view(HANDLE map, LONGLONG offset, DWORD length, BYTE** data) {
+    SYSTEM_INFO si;
+    LONGLONG base;
+    BYTE* view;
+
+    GetSystemInfo(&si);
+    base = offset - offset % si.dwAllocationGranularity;
+
+    if ((view = MapViewOfFile(map, FILE_MAP_READ, (DWORD)(base >> 32), (DWORD)base, (SIZE_T)(offset - base) + length)) != NULL)
+        *data = view + (offset - base);
+
+    return view;
+}
+
+#define CLONE_PIECE (1 << 30)  // bytes per block clone call
+
+// Shares the clusters of a range of one file with another on the same ReFS volume (block
+// cloning) instead of copying them. Both offsets have to be on a cluster and the target is
+// extended over the range. Bytes cloned, whole clusters unless the range ends the source,
+// 0 if the volume does not clone.
+LONGLONG clone_range(HANDLE src, LONGLONG from, HANDLE dst, LONGLONG to, LONGLONG length) {
+    FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integ;
+    DUPLICATE_EXTENTS_DATA dup = { 0 };
+    BY_HANDLE_FILE_INFORMATION info;
+    LARGE_INTEGER size;
+    LONGLONG done = 0;
+    DWORD ret;
+
+    if (!ioctl(src, FSCTL_GET_INTEGRITY_INFORMATION, NULL, 0, &integ, sizeof(integ), &ret) || !integ.ClusterSizeInBytes ||
+        from % integ.ClusterSizeInBytes || to % integ.ClusterSizeInBytes || !GetFileSizeEx(src, &size))
+        return 0;
+
+    if (from + length < size.QuadPart)
+        length -= length % integ.ClusterSizeInBytes;
+    if (length <= 0)
+        return 0;
+
+    // A sparse source only clones into a sparse target
+    if (GetFileInformationByHandle(src, &info) && (info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE))
+        ioctl(dst, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &ret);
+
+    if (!GetFileSizeEx(dst, &size))
+        return 0;
+    if (size.QuadPart < to + length) {
+        size.QuadPart = to + length;
+        if (!SetFilePointerEx(dst, size, NULL, FILE_BEGIN) || !SetEndOfFile(dst))
+            return 0;
+    }
+
+    // Large ranges go in pieces, a single call has to stay under 4 GB
+    dup.FileHandle = src;
+    while (done < length) {
+        dup.SourceFileOffset.QuadPart = from + done;
+        dup.TargetFileOffset.QuadPart = to + done;
+        dup.ByteCount.QuadPart = min(length - done, (LONGLONG)CLONE_PIECE);
+
+        if (!ioctl(dst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &dup, sizeof(dup), NULL, 0, &ret))
+            break;
+        done += dup.ByteCount.QuadPart;
+    }
+
+    return done;
+}
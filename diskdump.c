@@ -12,16 +12,93 @@
 #include <stdlib.h>
 #include <wchar.h>
 #include <stdarg.h>
+#include <io.h>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <immintrin.h>
+#elif defined(_M_ARM64)
+#include <arm64_neon.h>
+#elif defined(_M_ARM)
+#include <arm_neon.h>
+#endif
 
-#define BUFFER_SIZE 1 << 20 // 1 MB
+#include "diskimgz.h"
+#include "diskhash.h"
+#include "diskdelta.h"
+#include "diskstore.h"
+#include "diskjournal.h"
+#include "disktune.h"
+#include "diskdev.h"
+#include "diskpart.h"
+#include "diskfat.h"
+#include "diskregion.h"
+#include "diskvirt.h"
+#include "diskstat.h"
+
+#define BUFFER_SIZE (1 << 20) // 1 MB
+#define BUFFERS 8               // buffers in the read/write ring
+#define DEPTH 4                 // reads in flight
+#define GRANULE 4096            // default zero block size for sparse mode
 
 #define WIDEN2(x) L ## x
 #define WIDEN(x) WIDEN2(x)
 #define __WDATE__ WIDEN(__DATE__)
 #define __WTIME__ WIDEN(__TIME__)
 
-#define USAGE L"Usage: diskdump <disk#> <filename> [<sect_skip> [max_bytes]]\n\n"\
+#define USAGE L"Usage: diskdump [options] <disk#> <filename> [<sect_skip> [max_bytes]]\n"\
+              L"       diskdump --list <disk#>\n"\
+              L"       diskdump --store=D --gc\n\n"\
               L"Writes contents of <disk#> info file <filename>\n\n"\
+              L"Options:\n"\
+              L"  --list        list the MBR or GPT partitions of the disk or image and exit\n"\
+              L"  --part=N[,N...]|all\n"\
+              L"                read only the given partitions and the partition tables, the image\n"\
+              L"                keeps their offsets and is sparse in between\n"\
+              L"  --extract     with --part=N, the image holds just that partition\n"\
+              L"  --used        the region is a FAT12/16/32 volume, read only its boot sector, FATs,\n"\
+              L"                root directory and used clusters into a sparse image, free clusters\n"\
+              L"                are left as holes; with --part=N --extract for a partition\n"\
+              L"  --regions=F   dump the regions listed in F, or the enabled targets of a SCSI2SD\n"\
+              L"                configuration F saved by scsi2sd-util, in one pass over the disk,\n"\
+              L"                each into file <filename>.<name>, the gaps between them are not read\n"\
+              L"  --buffers=N   number of buffers in the read/write ring (default 8)\n"\
+              L"  --depth=N     number of disk reads in flight (default 4)\n"\
+              L"  --block=N     buffer size in bytes, multiple of 512 (default 1048576)\n"\
+              L"  --rate=N      read at most N MB per second\n"\
+              L"  --stats=F     write progress, latency percentiles and stall times of the disk\n"\
+              L"                and the file to F as JSON every few seconds and at the end\n"\
+              L"  --tune[=again] pick block size and depth for the disk by short read trials,\n"\
+              L"                cached per disk model, again repeats the trials (--block and\n"\
+              L"                --depth given as well are kept)\n"\
+              L"  --direct      write the image unbuffered and write-through, a long dump does not\n"\
+              L"                push everything else out of the file cache\n"\
+              L"  --stripes=N   split the dump in N ranges read side by side, for SSD and NVMe\n"\
+              L"                drives that need many reads in flight (default 1)\n"\
+              L"  --sparse[=N]  leave holes in the file for all-zero N byte blocks (default 4096)\n"\
+              L"  --format=vhd|vhdx|qcow2\n"\
+              L"                write a dynamic virtual disk that hypervisors attach as it is, 2 MB\n"\
+              L"                blocks of zeros are not allocated, block size is rounded up to 2 MB\n"\
+              L"  --compress[=huff|xpress|mszip|lzms]\n"\
+              L"                write a compressed image, block size chunks packed on all cores\n"\
+              L"  --hash[=xxh3|crc32c|sha256]\n"\
+              L"                digest every block on all cores, written to <filename>.manifest\n"\
+              L"                with the whole image digest and the disk identity\n"\
+              L"  --base=F      write only blocks that changed since the dump with manifest F (or\n"\
+              L"                image F with F.manifest) into a delta file, implies --hash\n"\
+              L"  --store=D     write the image into chunk store D instead of a file, <filename> is\n"\
+              L"                the name of its recipe, blocks already in the store are not written\n"\
+              L"                again, implies --hash=sha256\n"\
+              L"  --gc          remove chunks of store D that no recipe refers to, and show the\n"\
+              L"                size and dedup ratio of the store\n"\
+              L"  --rescue[=M]  keep going past read errors of a failing disk, retrying failed\n"\
+              L"                areas with smaller blocks down to single sectors, progress kept\n"\
+              L"                in map file M (default <filename>.map) to resume an interrupted\n"\
+              L"                rescue, bad sectors are left zero in the image\n"\
+              L"  --journal[=J] keep a checkpoint journal J (default <filename>.journal) while the\n"\
+              L"                dump runs, flushing the image every few seconds, removed when it\n"\
+              L"                completes\n"\
+              L"  --resume      continue an interrupted dump from its journal, the same command\n"\
+              L"                line has to be given again\n\n"\
               L"Disk# number can be obtained from:\n"\
               L"- Disk Management (diskmgmt.msc)\n"\
               L"- cmd: diskpart> list disk\n"\
@@ -30,7 +107,8 @@
               L"- ps: get-disk\n"\
               L"- ps: get-physicaldisk | ft deviceid,friendlyname\n"\
               L"Long form \\\\.\\PhysicalDriveXX is also allowed\n"\
-              L"Disk# can also be A and B for floppy drives\n\n"\
+              L"Disk# can also be A or B (A: or B:) for floppy drives\n"\
+              L"Disk# can also be a path to an image file\n\n"\
               L"sect_skip is number of 512 bytes sectors to skip\n\n"\
               L"max_bytes is maximum number of bytes to read from disk\n\n"
 
@@ -62,87 +140,922 @@ void error(int exit, WCHAR* msg, ...) {
         ExitProcess(1);
 }
 
+// Returns value of --name=value, empty string for --name, NULL if arg is not --name
+WCHAR* option(WCHAR* arg, WCHAR* name) {
+    size_t len = wcslen(name);
+
+    if (wcsncmp(arg, name, len) != 0)
+        return NULL;
+    if (arg[len] == L'=')
+        return arg + len + 1;
+    if (arg[len] == L'\0')
+        return arg + len;
+    return NULL;
+}
+
+// Milliseconds until pos bytes may have been read at rate bytes per second since start, 0 if now
+DWORD throttle(LONGLONG pos, LONGLONG rate, LARGE_INTEGER start, LARGE_INTEGER freq) {
+    LARGE_INTEGER now;
+    LONGLONG due;
+
+    QueryPerformanceCounter(&now);
+    due = (LONGLONG)((double)pos / (double)rate * (double)freq.QuadPart) + start.QuadPart;
+
+    return (due > now.QuadPart) ? (DWORD)((due - now.QuadPart) * 1000 / freq.QuadPart) + 1 : 0;
+}
+
+// Zero block detection. Vectorized for SSE2/AVX2 and NEON, plain loop for whatever is left over.
+#if defined(_M_X64) || defined(_M_IX86)
+int HaveAvx2 = -1;
+
+BOOL avx2(void) {
+    int r[4];
+
+    __cpuid(r, 0);
+    if (r[0] < 7)
+        return FALSE;
+
+    // OS must save YMM state (OSXSAVE + AVX, XCR0 bits 1 and 2)
+    __cpuid(r, 1);
+    if ((r[2] & (1 << 27)) == 0 || (r[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+        return FALSE;
+
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+}
+
+DWORD iszero_avx2(const BYTE* p, DWORD len) {
+    DWORD i;
+    __m256i v;
+
+    for (i = 0; i + 128 <= len; i += 128) {
+        v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + i)), _mm256_loadu_si256((const __m256i*)(p + i + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + i + 64)), _mm256_loadu_si256((const __m256i*)(p + i + 96)))
+        );
+        if (!_mm256_testz_si256(v, v))
+            break;
+    }
+    _mm256_zeroupper();
+
+    return i;
+}
+#endif
+
+BOOL iszero(const BYTE* p, DWORD len) {
+    DWORD i = 0;
+#if defined(_M_X64) || defined(_M_IX86)
+    __m128i v;
+
+    if (HaveAvx2 < 0)
+        HaveAvx2 = avx2();
+
+    // AVX2 stops at the first non-zero 128 bytes and SSE2 below confirms it
+    if (HaveAvx2)
+        i = iszero_avx2(p, len);
+
+    for (; i + 64 <= len; i += 64) {
+        v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i)), _mm_loadu_si128((const __m128i*)(p + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)), _mm_loadu_si128((const __m128i*)(p + i + 48)))
+        );
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+            return FALSE;
+    }
+#elif defined(_M_ARM64) || defined(_M_ARM)
+    uint8x16_t v;
+    uint64x2_t w;
+
+    for (; i + 64 <= len; i += 64) {
+        v = vorrq_u8(
+            vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+            vorrq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48))
+        );
+        w = vreinterpretq_u64_u8(v);
+        if (vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1))
+            return FALSE;
+    }
+#endif
+    for (; i < len; i++)
+        if (p[i])
+            return FALSE;
+
+    return TRUE;
+}
+
+// Sparse mode state and statistics
+typedef struct {
+    DWORD       Granule;    // zero block size, 0 when sparse mode is off
+    LONGLONG    Skipped;    // bytes left as holes
+    LONGLONG    Scanned;    // bytes scanned for zeros
+    LONGLONG    Ticks;      // time spent scanning
+} SPARSE;
+
+// Compressed mode state
+typedef struct {
+    IMGZ_HEADER Header;
+    DWORD       Algorithm;  // 0 when compression is off
+    LONGLONG    Pos;        // where the next chunk goes in the file
+    IMGZ_INDEX* Index;      // written after the last chunk
+    DWORD       Count;
+    DWORD       Max;
+} PACK;
+
+// Hash mode state, digests of all chunks in order for the manifest
+typedef struct {
+    int         Algorithm;  // HASH_NONE when hashing is off
+    DWORD       Size;       // digest bytes
+    BYTE*       Digest;
+    DWORD       Count;
+    DWORD       Max;
+} HASH;
+
+// Delta mode state, changed chunks are appended to the file and mapped
+typedef struct {
+    MANIFEST    Base;       // Base.Digest is NULL when delta mode is off
+    DELTA_HEADER Header;
+    LONGLONG    Pos;        // where the next changed chunk goes in the file
+    DELTA_EXTENT* Map;      // written after the last chunk
+    DWORD       Count;
+    DWORD       Max;
+    LONGLONG    Changed;    // bytes written
+} DIFF;
+
+// Store mode state, chunks are written to the store on the thread pool as they are hashed
+typedef struct {
+    WCHAR       Root[MAX_PATH]; // empty when store mode is off
+    DWORD       Chunks;
+    DWORD       New;        // chunks not in the store before
+    LONGLONG    Written;    // their bytes
+} STORE;
+
+// One buffer of the read/write ring
+enum { SLOT_FREE, SLOT_READING, SLOT_PACKING, SLOT_WRITING };
+
+typedef struct {
+    OVERLAPPED  Ovl;
+    BYTE*       Buff;
+    DWORD       Length;     // bytes requested, then bytes actually read
+    DWORD       Scan;       // how far the buffer has been written out
+    BOOL        Pending;    // write in flight
+    LONGLONG    Pos;        // position relative to the start of the dump
+    int         State;
+    BYTE*       Out;        // compressed chunk, IMGZ_CHUNK + payload
+    DWORD       OutLength;
+    HANDLE      Done;       // set when the chunk is hashed and packed
+    DWORD       Crc;        // of the unpacked chunk
+    int         Hash;       // digest algorithm, HASH_NONE for none
+    BYTE        Digest[HASH_MAX];
+    COMPRESSOR_HANDLE Codec; // NULL when not compressing
+    WCHAR*      Store;      // chunk store root, NULL when not storing
+    int         Stored;     // 1 written to the store, 0 there already, -1 failed
+    LONGLONG    Issued;     // tick the request in flight was queued
+    REGION*     Region;     // region the buffer belongs to, NULL when writing one image
+} SLOT;
+
+// Thread pool callback, hashes and packs one buffer into a chunk. Stored as is if it does not compress.
+VOID CALLBACK pack(PTP_CALLBACK_INSTANCE inst, PVOID ctx) {
+    SLOT* s = ctx;
+    IMGZ_CHUNK* c = (IMGZ_CHUNK*)s->Out;
+    SIZE_T packed = 0;
+
+    if (s->Hash && !hash(s->Hash, s->Buff, s->Length, s->Digest))
+        ZeroMemory(s->Digest, sizeof(s->Digest));
+
+    // A chunk without a digest cannot go into the store
+    if (s->Store)
+        s->Stored = (iszero(s->Digest, HASH_MAX)) ? -1 : store_put(s->Store, s->Digest, s->Buff, s->Length);
+
+    if (!s->Codec) {
+        SetEvent(s->Done);
+        return;
+    }
+
+    if (!imgz_api.Compress(s->Codec, s->Buff, s->Length, s->Out + sizeof(IMGZ_CHUNK), s->Length, &packed) || !packed || packed >= s->Length) {
+        CopyMemory(s->Out + sizeof(IMGZ_CHUNK), s->Buff, s->Length);
+        packed = s->Length;
+    }
+
+    c->Packed = (DWORD)packed;
+    c->Length = s->Length;
+    s->OutLength = sizeof(IMGZ_CHUNK) + (DWORD)packed;
+    s->Crc = crc32c(0, s->Buff, s->Length);
+
+    SetEvent(s->Done);
+}
+
+// Queue an overlapped read or write at given device/file offset
+BOOL submit(HANDLE h, SLOT* s, BYTE* buff, DWORD len, LONGLONG offset, BOOL write) {
+    LARGE_INTEGER now;
+    BOOL ok;
+
+    QueryPerformanceCounter(&now);
+    s->Issued = now.QuadPart;
+
+    s->Ovl.Internal = 0;
+    s->Ovl.InternalHigh = 0;
+    s->Ovl.Offset = (DWORD)offset;
+    s->Ovl.OffsetHigh = (DWORD)(offset >> 32);
+
+    if (write)
+        ok = WriteFile(h, buff, len, NULL, &s->Ovl);
+    else
+        ok = ReadFile(h, buff, len, NULL, &s->Ovl);
+
+    return ok || GetLastError() == ERROR_IO_PENDING;
+}
+
+// Queue the next write for a buffer. Normally that is the whole buffer at once, in sparse
+// mode it is the next run of granules that are not all zeros. Unbuffered writes are whole
+// sectors of align bytes, a short tail is padded with zeros and cut off when the dump is done.
+// A virtual disk gets the next block that is not all zeros, wherever it is allocated in the file.
+// Returns FALSE when done.
+BOOL write_next(HANDLE h, SLOT* s, SPARSE* sp, VIRT* v, DWORD align) {
+    LARGE_INTEGER t0, t1;
+    DWORD start, end, len;
+
+    if (s->Scan >= s->Length)
+        return FALSE;
+
+    // Buffers are whole blocks, a short last block is padded with zeros
+    if (v->Format) {
+        for (start = s->Scan; start < s->Length; start += v->Block)
+            if (!iszero(s->Buff + start, min(v->Block, s->Length - start)))
+                break;
+
+        s->Scan = min(start + v->Block, s->Length);
+        if (start >= s->Length)
+            return FALSE;
+
+        len = min(v->Block, s->Length - start);
+        ZeroMemory(s->Buff + start + len, v->Block - len);
+
+        if (!submit(h, s, s->Buff + start, v->Block, virt_alloc(v, (DWORD)((s->Pos + start) / v->Block)), TRUE))
+            error(1, L"Error writing to file");
+
+        s->Pending = TRUE;
+        return TRUE;
+    }
+
+    if (!sp->Granule) {
+        start = s->Scan;
+        end = s->Length;
+    }
+    else {
+        QueryPerformanceCounter(&t0);
+
+        for (start = s->Scan; start < s->Length; start += len) {
+            len = min(sp->Granule, s->Length - start);
+            if (!iszero(s->Buff + start, len))
+                break;
+        }
+        for (end = start; end < s->Length; end += len) {
+            len = min(sp->Granule, s->Length - end);
+            if (iszero(s->Buff + end, len))
+                break;
+        }
+
+        QueryPerformanceCounter(&t1);
+        sp->Ticks += t1.QuadPart - t0.QuadPart;
+        sp->Scanned += end - s->Scan;
+        sp->Skipped += start - s->Scan;
+    }
+
+    s->Scan = end;
+    if (start == end)
+        return FALSE;
+
+    if ((end - start) % align) {
+        ZeroMemory(s->Buff + end, align - (end - start) % align);
+        end += align - (end - start) % align;
+    }
+
+    // A region is written from the start of its own file
+    if (!submit((s->Region) ? s->Region->File : h, s, s->Buff + start, end - start, s->Pos + start - ((s->Region) ? s->Region->Start : 0), TRUE))
+        error(1, L"Error writing to file");
+
+    s->Pending = TRUE;
+    return TRUE;
+}
+
+// Striped mode, the dump is split in ranges of whole blocks that are read side by side
+typedef struct {
+    LONGLONG    Pos;        // next read, relative to the start of the dump
+    LONGLONG    End;
+} STRIPE;
+
+// Rescue mode map, ranges cover the whole dump in order. Status letters as in ddrescue:
+// '?' not tried yet, '*' failed with a block larger than a sector, '-' bad sector, '+' rescued
+typedef struct {
+    LONGLONG    Pos;        // relative to the start of the dump
+    LONGLONG    Size;
+    char        Status;
+} RANGE;
+
+// Rescue mode state
+typedef struct {
+    WCHAR       Name[MAX_PATH]; // map file, empty when rescue mode is off
+    RANGE*      Range;
+    DWORD       Count;
+    DWORD       Max;
+    LONGLONG    Offset;     // of the dump on the disk
+    LONGLONG    Length;     // of the dump
+    HANDLE      hDisk;      // opened with FILE_FLAG_OVERLAPPED
+    HANDLE      hFile;
+    BYTE*       Buff;       // BufferSize bytes
+    BOOL        IsFile;
+    ULONGLONG   Saved;      // tick count of the last map save
+    ULONGLONG   Shown;      // tick count of the last progress line
+} RESCUE;
+
+volatile LONG RescueStop = 0;
+
+BOOL WINAPI rescue_stop(DWORD type) {
+    InterlockedExchange(&RescueStop, 1);
+    return TRUE;
+}
+
+// Room for one more range
+void map_grow(RESCUE* r) {
+    if (r->Count == r->Max) {
+        r->Max = (r->Max) ? r->Max * 2 : 4096;
+        r->Range = (r->Range) ? HeapReAlloc(GetProcessHeap(), 0, r->Range, r->Max * sizeof(RANGE)) : HeapAlloc(GetProcessHeap(), 0, r->Max * sizeof(RANGE));
+        if (r->Range == NULL)
+            error(1, L"Unable to allocate memory");
+    }
+}
+
+// Index of the range holding pos
+DWORD map_find(RESCUE* r, LONGLONG pos) {
+    DWORD lo = 0, hi = r->Count - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (r->Range[mid].Pos <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+// Splits the range holding pos so that a range starts at pos, returns its index
+DWORD map_split(RESCUE* r, LONGLONG pos) {
+    DWORD i;
+
+    if (pos >= r->Length)
+        return r->Count;
+
+    i = map_find(r, pos);
+    if (r->Range[i].Pos == pos)
+        return i;
+
+    map_grow(r);
+
+    MoveMemory(&r->Range[i + 2], &r->Range[i + 1], (r->Count - i - 1) * sizeof(RANGE));
+    r->Range[i + 1].Pos = pos;
+    r->Range[i + 1].Size = r->Range[i].Pos + r->Range[i].Size - pos;
+    r->Range[i + 1].Status = r->Range[i].Status;
+    r->Range[i].Size = pos - r->Range[i].Pos;
+    r->Count++;
+
+    return i + 1;
+}
+
+// Marks pos..pos+size with status, merging with neighbours in the same status
+void map_set(RESCUE* r, LONGLONG pos, LONGLONG size, char status) {
+    DWORD i, j;
+
+    // First range covers the whole dump
+    if (!r->Count) {
+        map_grow(r);
+        r->Range[0].Pos = 0;
+        r->Range[0].Size = r->Length;
+        r->Range[0].Status = status;
+        r->Count = 1;
+        return;
+    }
+
+    i = map_split(r, pos);
+    j = map_split(r, pos + size);
+
+    r->Range[i].Size = size;
+    r->Range[i].Status = status;
+    MoveMemory(&r->Range[i + 1], &r->Range[j], (r->Count - j) * sizeof(RANGE));
+    r->Count -= j - i - 1;
+
+    if (i + 1 < r->Count && r->Range[i + 1].Status == status) {
+        r->Range[i].Size += r->Range[i + 1].Size;
+        MoveMemory(&r->Range[i + 1], &r->Range[i + 2], (r->Count - i - 2) * sizeof(RANGE));
+        r->Count--;
+    }
+    if (i && r->Range[i - 1].Status == status) {
+        r->Range[i - 1].Size += r->Range[i].Size;
+        MoveMemory(&r->Range[i], &r->Range[i + 1], (r->Count - i - 1) * sizeof(RANGE));
+        r->Count--;
+    }
+}
+
+// Bytes in given status
+LONGLONG map_bytes(RESCUE* r, char status) {
+    LONGLONG bytes = 0;
+    DWORD i;
+
+    for (i = 0; i < r->Count; i++)
+        if (r->Range[i].Status == status)
+            bytes += r->Range[i].Size;
+
+    return bytes;
+}
+
+// Reads the map of an interrupted rescue, FALSE if there is none
+BOOL map_load(RESCUE* r) {
+    FILE* f;
+    char line[256];
+    LONGLONG offset = -1, length = -1, pos, size, end = 0;
+    char status;
+
+    if ((f = _wfopen(r->Name, L"r")) == NULL)
+        return FALSE;
+
+    r->Count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#')
+            continue;
+        else if (sscanf(line, "offset %lld", &offset) == 1 || sscanf(line, "length %lld", &length) == 1)
+            continue;
+        else if (sscanf(line, "%llx %llx %c", &pos, &size, &status) != 3 || pos != end || size <= 0 || !strchr("?*-+", status))
+            error(1, L"Corrupt rescue map %s", r->Name);
+
+        map_grow(r);
+
+        r->Range[r->Count].Pos = pos;
+        r->Range[r->Count].Size = size;
+        r->Range[r->Count].Status = status;
+        r->Count++;
+        end = pos + size;
+    }
+    fclose(f);
+
+    if (offset != r->Offset || length != r->Length || end != r->Length)
+        error(1, L"Rescue map %s is for a different range: offset %lld length %lld", r->Name, offset, length);
+
+    return TRUE;
+}
+
+// Writes the map next to the image. The image is flushed first so the map never claims
+// more than what is on disk, and the map is replaced in one go so it is never half written.
+void map_save(RESCUE* r) {
+    WCHAR tmp[MAX_PATH];
+    FILE* f;
+    DWORD i;
+
+    if (!FlushFileBuffers(r->hFile))
+        error(1, L"Error flushing file");
+
+    swprintf(tmp, ARRAYSIZE(tmp), L"%s.tmp", r->Name);
+    if ((f = _wfopen(tmp, L"w")) == NULL)
+        error(1, L"Unable to open rescue map %s", tmp);
+
+    fprintf(f, "# DiskDump v1.3 rescue map\n");
+    fprintf(f, "# status: ? not tried, * failed block, - bad sector, + rescued\n");
+    fprintf(f, "offset %lld\n", r->Offset);
+    fprintf(f, "length %lld\n", r->Length);
+    for (i = 0; i < r->Count; i++)
+        fprintf(f, "0x%012llX 0x%012llX %c\n", r->Range[i].Pos, r->Range[i].Size, r->Range[i].Status);
+
+    if (fflush(f) != 0 || _commit(_fileno(f)) != 0 || fclose(f) != 0)
+        error(1, L"Error writing rescue map %s", tmp);
+
+    if (!MoveFileExW(tmp, r->Name, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+        error(1, L"Unable to replace rescue map %s", r->Name);
+
+    r->Saved = GetTickCount64();
+}
+
+// One pass over every range in given status, block bytes at a time. Rescued blocks are written
+// to the image. A failed block goes to '*', or to '-' once it is a single sector. With skip set
+// the pass jumps ahead after an error, twice as far for every further error, so the healthy
+// areas are read before the damaged ones are touched again. Skipped bytes stay '?'.
+void rescue_pass(RESCUE* r, char status, DWORD block, BOOL skip, WCHAR* name) {
+    LONGLONG pos, end, jump = 0;
+    DWORD i, len, ret;
+
+    for (pos = 0; pos < r->Length && !RescueStop; ) {
+        i = map_find(r, pos);
+        end = r->Range[i].Pos + r->Range[i].Size;
+
+        if (r->Range[i].Status != status) {
+            pos = end;
+            continue;
+        }
+
+        len = (DWORD)min((LONGLONG)block, end - pos);
+
+        // Disks only read whole sectors, the excess is cut off
+        if (read_at(r->hDisk, r->Buff, (r->IsFile) ? len : (len + 511) & ~511, r->Offset + pos, &ret) && ret >= len) {
+            if (!write_at(r->hFile, r->Buff, len, pos))
+                error(1, L"Error writing to file");
+
+            map_set(r, pos, len, '+');
+            pos += len;
+            jump = 0;
+        }
+        else {
+            map_set(r, pos, len, (len <= 512) ? '-' : '*');
+            pos += len;
+
+            if (skip) {
+                jump = (jump) ? min(jump * 2, 64LL << 20) : block;
+                pos = min(pos + jump, end);
+            }
+        }
+
+        if (GetTickCount64() - r->Shown >= 250) {
+            wprintf(L"%s [%u] at %llu: rescued %.1f MB, bad %.1f MB, to retry %.1f MB, untried %.1f MB      \r",
+                name,
+                block,
+                pos,
+                (float)map_bytes(r, '+') / (float)(1 << 20),
+                (float)map_bytes(r, '-') / (float)(1 << 20),
+                (float)map_bytes(r, '*') / (float)(1 << 20),
+                (float)map_bytes(r, '?') / (float)(1 << 20)
+            );
+            FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
+            r->Shown = GetTickCount64();
+        }
+
+        if (GetTickCount64() - r->Saved >= 5000)
+            map_save(r);
+    }
+
+    map_save(r);
+}
+
+// Rescue a failing disk: large blocks over the healthy areas first, then ever smaller blocks
+// over the failed ones down to single sectors. Progress is kept in the map so an interrupted
+// rescue continues where it stopped. Returns bytes rescued.
+LONGLONG rescue(RESCUE* r, DWORD block) {
+    DWORD i;
+
+    SetConsoleCtrlHandler(rescue_stop, TRUE);
+
+    rescue_pass(r, '?', block, TRUE, L"Copying");
+    rescue_pass(r, '?', block, FALSE, L"Filling");
+
+    while (block > 512 && !RescueStop) {
+        block = max(512, (block / 16) & ~511);
+        rescue_pass(r, '*', block, FALSE, L"Trimming");
+    }
+
+    SetConsoleCtrlHandler(rescue_stop, FALSE);
+
+    wprintf(L"\rRescue: %.1f MB (%llu bytes) rescued, %llu bytes in bad sectors, %llu bytes not done                \n",
+        (float)map_bytes(r, '+') / (float)(1 << 20),
+        map_bytes(r, '+'),
+        map_bytes(r, '-'),
+        map_bytes(r, '?') + map_bytes(r, '*')
+    );
+
+    for (i = 0, block = 0; i < r->Count; i++) {
+        if (r->Range[i].Status != '-')
+            continue;
+        if (block++ < 16)
+            wprintf(L"  bad sectors %llu-%llu\n", (r->Offset + r->Range[i].Pos) / 512, (r->Offset + r->Range[i].Pos + r->Range[i].Size - 1) / 512);
+    }
+    if (block > 16)
+        wprintf(L"  ... %u bad ranges in total, see %s\n", block, r->Name);
+
+    if (RescueStop)
+        wprintf(L"Interrupted, run again with the same --rescue to resume from %s\n", r->Name);
+
+    return map_bytes(r, '+');
+}
+
 int wmain(int argc, WCHAR* argv[]) {
     HANDLE                  hDisk;
+    HANDLE                  hDiskIo;
     HANDLE                  hFile;
-    WCHAR                   DevName[64] = { '\0' };
-    WCHAR*                  Buff;
+    HANDLE                  Wait[3];
+    WCHAR                   DevName[MAX_PATH] = { '\0' };
+    WCHAR                   ManifestName[MAX_PATH] = { '\0' };
+    WCHAR                   RegionName[MAX_PATH];
+    FILE*                   Manifest;
+    BYTE                    Tree[HASH_MAX];
+    char                    Hex[2 * HASH_MAX + 1];
     WCHAR*                  DiskNo;
     WCHAR*                  FileName;
+    WCHAR*                  Val;
     ULONG                   BytesRet;
     GET_LENGTH_INFORMATION  DiskLengthInfo;
-    DISK_GEOMETRY           DiskGeom;
     LARGE_INTEGER           Offset;
     LARGE_INTEGER           MaxBytes; // user specified
     LARGE_INTEGER           TotalBytesRead;
     LARGE_INTEGER           FileSize;
-    LARGE_INTEGER           Zero;
-    size_t                  size = 0;
+    LONGLONG                ReadPos;
+    SPARSE                  Sparse = { 0 };
+    PACK                    Pack = { 0 };
+    HASH                    Hash = { 0 };
+    DIFF                    Diff = { 0 };
+    RESCUE                  Rescue = { 0 };
+    JOURNAL                 Journal = { 0 };
+    LONGLONG                Committed;
+    LONGLONG                Rate = 0, RateBase;
+    DWORD                   Delay;
+    BOOL                    Resume = FALSE;
+    DELTA_EXTENT*           x;
+    LONGLONG                BaseLength;
+    IMGZ_TRAILER            Trailer = { 0 };
+    SYSTEM_INFO             SysInfo;
+    SLOT*                   Slot;
+    SLOT*                   s;
+    STRIPE*                 Stripe;
+    DWORD                   Stripes = 1, Turn = 0;
+    DWORD                   Align = 1;
+    POOL                    Pool = { 0 };
+    BOOL                    Direct = FALSE;
+    TUNE                    Tuned = { 0 };
+    char                    Model[256];
+    int                     Tune = 0;
+    LONGLONG                StripeSize;
+    DWORD                   BufferSize = BUFFER_SIZE;
+    DWORD                   Buffers = BUFFERS;
+    DWORD                   Depth = DEPTH;
+    DWORD                   Next = 0, ReadTail = 0, PackTail = 0, WriteTail = 0;
+    DWORD                   Reading = 0, Packing = 0, Writing = 0;
     DWORD                   BytesRead = 0;
+    DWORD                   i, n;
+    BOOL                    BuffersSet = FALSE, DepthSet = FALSE, BlockSet = FALSE;
+    BOOL                    IsFile = FALSE;
+    BOOL                    Eof = FALSE;
     DWORD                   ret = 0;
-    LARGE_INTEGER           pres, pbegin, pstart, pend;
-    STORAGE_PROPERTY_QUERY  desc_q = { StorageDeviceProperty,  PropertyStandardQuery };
-    STORAGE_DESCRIPTOR_HEADER desc_h = { 0 };
-    PSTORAGE_DEVICE_DESCRIPTOR desc_d;
+    LARGE_INTEGER           pres, pbegin, pend;
+    REPORT                  Report = { 0 };
+    STORE                   Store = { 0 };
+    VIRT                    Virt = { 0 };
+    STORE_STATS             StoreStats;
+    BOOL                    Gc = FALSE;
+    LAYOUT                  Layout;
+    EXTENT*                 Extent = NULL;
+    FATVOL                  Fat;
+    DWORD                   Extents = 0;
+    REGION                  Region[REGIONS];
+    DWORD                   Regions = 0;
+    WCHAR*                  RegionList = NULL;
+    WCHAR*                  PartList = NULL;
+    PART*                   Part;
+    BOOL                    List = FALSE, Extract = FALSE, Used = FALSE;
+    LONGLONG                Wanted;
+    LARGE_INTEGER           Slept;
+    PSTORAGE_DEVICE_DESCRIPTOR desc_d = NULL;
     WCHAR* ft[] = { L"Non-Removable", L"Removable" };
-    WCHAR* bus[] = { L"UNKNOWN", L"SCSI", L"ATAPI", L"ATA", L"1394", L"SSA", L"FC", L"USB", L"RAID", L"ISCSI", L"SAS", L"SATA", L"SD", L"MMC", L"VIRTUAL", L"VHD", L"MAX", L"NVME" };
+
+    // Progress goes out as it is printed when piped, diskbatch follows it
+    if (GetFileType(GetStdHandle(STD_OUTPUT_HANDLE)) == FILE_TYPE_PIPE)
+        setvbuf(stdout, NULL, _IONBF, 0);
 
     wprintf(L"DiskDump v1.3 by Antoni Sawicki <as@tenoware.com>, Build %s %s\n\n", __WDATE__, __WTIME__);
 
-    if (argc < 3)
+    // Options, shifted out so the positional arguments stay where they were
+    while (argc > 1 && wcsncmp(argv[1], L"--", 2) == 0) {
+        if ((Val = option(argv[1], L"--buffers")) != NULL)
+            Buffers = _wtoi(Val), BuffersSet = TRUE;
+        else if ((Val = option(argv[1], L"--depth")) != NULL)
+            Depth = _wtoi(Val), DepthSet = TRUE;
+        else if ((Val = option(argv[1], L"--block")) != NULL)
+            BufferSize = _wtoi(Val), BlockSet = TRUE;
+        else if ((Val = option(argv[1], L"--tune")) != NULL && (!*Val || wcscmp(Val, L"again") == 0))
+            Tune = (*Val) ? 2 : 1;
+        else if ((Val = option(argv[1], L"--stats")) != NULL && *Val)
+            Report.Stats = Val;
+        else if ((Val = option(argv[1], L"--list")) != NULL && !*Val)
+            List = TRUE;
+        else if ((Val = option(argv[1], L"--part")) != NULL && *Val)
+            PartList = Val;
+        else if ((Val = option(argv[1], L"--extract")) != NULL && !*Val)
+            Extract = TRUE;
+        else if ((Val = option(argv[1], L"--used")) != NULL && !*Val)
+            Used = TRUE;
+        else if ((Val = option(argv[1], L"--regions")) != NULL && *Val)
+            RegionList = Val;
+        else if ((Val = option(argv[1], L"--rate")) != NULL)
+            Rate = _wtoi64(Val) << 20;
+        else if ((Val = option(argv[1], L"--direct")) != NULL && !*Val)
+            Direct = TRUE;
+        else if ((Val = option(argv[1], L"--stripes")) != NULL)
+            Stripes = _wtoi(Val);
+        else if ((Val = option(argv[1], L"--sparse")) != NULL)
+            Sparse.Granule = (*Val) ? _wtoi(Val) : GRANULE;
+        else if ((Val = option(argv[1], L"--format")) != NULL) {
+            if ((Virt.Format = virt_format(Val)) == VIRT_NONE)
+                error(1, L"Unknown format %s\n\n%s\n", Val, USAGE);
+        }
+        else if ((Val = option(argv[1], L"--compress")) != NULL) {
+            if ((Pack.Algorithm = imgz_algorithm(Val)) == 0)
+                error(1, L"Unknown compression %s\n\n%s\n", Val, USAGE);
+        }
+        else if ((Val = option(argv[1], L"--hash")) != NULL) {
+            if ((Hash.Algorithm = hash_algorithm(Val)) == HASH_NONE)
+                error(1, L"Unknown hash %s\n\n%s\n", Val, USAGE);
+            Hash.Size = hash_size(Hash.Algorithm);
+        }
+        else if ((Val = option(argv[1], L"--base")) != NULL) {
+            if (!load_manifest(Val, &Diff.Base))
+                error(1, L"Unable to load manifest of %s, the base has to be dumped with --hash", Val);
+        }
+        else if ((Val = option(argv[1], L"--store")) != NULL && *Val)
+            wcsncpy(Store.Root, Val, ARRAYSIZE(Store.Root) - 1);
+        else if ((Val = option(argv[1], L"--gc")) != NULL && !*Val)
+            Gc = TRUE;
+        else if ((Val = option(argv[1], L"--rescue")) != NULL)
+            wcsncpy(Rescue.Name, (*Val) ? Val : L"*", ARRAYSIZE(Rescue.Name));
+        else if ((Val = option(argv[1], L"--resume")) != NULL && !*Val)
+            Resume = TRUE;
+        else if ((Val = option(argv[1], L"--journal")) != NULL)
+            wcsncpy(Journal.Name, (*Val) ? Val : L"*", ARRAYSIZE(Journal.Name));
+        else
+            error(1, L"Unknown option %s\n\n%s\n", argv[1], USAGE);
+
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    if (Buffers < 2 || Depth < 1 || BufferSize < 512 || BufferSize % 512 || Rate < 0 || Stripes < 1)
+        error(1, L"Invalid options: buffers=%u depth=%u block=%u rate=%lld stripes=%u\n\n%s\n", Buffers, Depth, BufferSize, Rate >> 20, Stripes, USAGE);
+
+    if (Sparse.Granule && (Sparse.Granule < 512 || Sparse.Granule % 512 || Sparse.Granule > BufferSize))
+        error(1, L"Invalid options: sparse=%u must be a multiple of 512 up to block size\n\n%s\n", Sparse.Granule, USAGE);
+
+    if (Sparse.Granule && Pack.Algorithm)
+        error(1, L"Invalid options: --sparse and --compress are exclusive, zeros compress anyway\n\n%s\n", USAGE);
+
+    if (Pack.Algorithm && !imgz_load())
+        error(1, L"--compress needs the Compression API of cabinet.dll, Windows 8 or later");
+
+    // Chunks are compared digest by digest, so size and hash come from the base
+    if (Diff.Base.Digest) {
+        if (Sparse.Granule || Pack.Algorithm)
+            error(1, L"Invalid options: --base does not go with --sparse or --compress\n\n%s\n", USAGE);
+
+        if (Hash.Algorithm && Hash.Algorithm != Diff.Base.Algorithm)
+            error(0, L"Base was hashed with %s, using it instead of %s", hash_name(Diff.Base.Algorithm), hash_name(Hash.Algorithm));
+
+        Hash.Algorithm = Diff.Base.Algorithm;
+        Hash.Size = Diff.Base.Size;
+        BufferSize = Diff.Base.ChunkSize;
+    }
+
+    // Failed areas are retried block by block in place, so the image has to be plain
+    if (Rescue.Name[0] && (Sparse.Granule || Pack.Algorithm || Hash.Algorithm || Diff.Base.Digest))
+        error(1, L"Invalid options: --rescue writes a raw image only\n\n%s\n", USAGE);
+
+    // Compressed chunks and delta extents go wherever the file ends, only images laid out
+    // like the disk can be continued from an offset. A rescue keeps its own map.
+    if (Resume && (Pack.Algorithm || Diff.Base.Digest || Rescue.Name[0]))
+        error(1, L"Invalid options: --resume does not go with --compress, --base or --rescue\n\n%s\n", USAGE);
+
+    // Headers, indexes, extent maps and rescued sectors are written at any offset and length
+    if (Direct && (Pack.Algorithm || Diff.Base.Digest || Rescue.Name[0]))
+        error(1, L"Invalid options: --direct writes raw or sparse images only\n\n%s\n", USAGE);
+
+    // Selected partitions and used clusters are read like stripes, in place and out of order,
+    // with gaps between them. A single extracted partition is an ordinary dump from its offset.
+    if (Extract && !PartList)
+        error(1, L"Invalid options: --extract needs --part=N\n\n%s\n", USAGE);
+
+    if (Used && PartList && !Extract)
+        error(1, L"Invalid options: --used reads a single volume, --part=N needs --extract\n\n%s\n", USAGE);
+
+    if (((PartList && !Extract) || Used) && (Stripes > 1 || Pack.Algorithm || Hash.Algorithm || Diff.Base.Digest || Rescue.Name[0] || Resume || Direct))
+        error(1, L"Invalid options: --part and --used do not go with --stripes, --compress, --hash, --base, --rescue, --resume or --direct\n\n%s\n", USAGE);
+
+    // Regions are read like selected partitions, but each buffer goes to the file of its region
+    if (RegionList && (PartList || Used || List || Stripes > 1 || Pack.Algorithm || Hash.Algorithm || Diff.Base.Digest || Rescue.Name[0] || Resume || Journal.Name[0] || Direct || Store.Root[0] || Virt.Format))
+        error(1, L"Invalid options: --regions only goes with --sparse and the buffer and rate options\n\n%s\n", USAGE);
+
+    // Chunks go into the store by their digest and the recipe lists them, there is no image
+    // file to write headers or holes into or to resume from
+    if (Store.Root[0]) {
+        if (Pack.Algorithm || Diff.Base.Digest || Rescue.Name[0] || Sparse.Granule || Direct || Resume || Journal.Name[0] || (PartList && !Extract) || Used)
+            error(1, L"Invalid options: --store does not go with --compress, --base, --rescue, --sparse, --direct, --resume, --journal, --part or --used\n\n%s\n", USAGE);
+
+        if (Hash.Algorithm && Hash.Algorithm != STORE_HASH)
+            error(0, L"The store names chunks by %s, using it instead of %s", hash_name(STORE_HASH), hash_name(Hash.Algorithm));
+
+        Hash.Algorithm = STORE_HASH;
+        Hash.Size = hash_size(STORE_HASH);
+    }
+    else if (Gc) {
+        error(1, L"Invalid options: --gc needs --store\n\n%s\n", USAGE);
+    }
+
+    // Blocks of a virtual disk go wherever the file ends and the tables that find them are written
+    // when the dump is done. Nothing is laid out like the disk to resume, rescue into or pack.
+    if (Virt.Format && (Pack.Algorithm || Diff.Base.Digest || Rescue.Name[0] || Sparse.Granule || Direct || Resume || Journal.Name[0] || Store.Root[0] || (PartList && !Extract) || Used))
+        error(1, L"Invalid options: --format does not go with --compress, --base, --rescue, --sparse, --direct, --resume, --journal, --store, --part or --used\n\n%s\n", USAGE);
+
+    // Checkpoints are an offset up to which the image is complete, only a dump written in order has one
+    if (Journal.Name[0] && (Pack.Algorithm || Diff.Base.Digest || Rescue.Name[0] || Stripes > 1 || (PartList && !Extract) || Used))
+        error(1, L"Invalid options: --journal does not go with --compress, --base, --rescue, --stripes, --part or --used\n\n%s\n", USAGE);
+
+    // Stripes complete out of order, only a raw or sparse image is written in place by offset.
+    // Nothing is written up to a single offset either, so there is no journal to resume from.
+    if (Stripes > 1 && (Pack.Algorithm || Diff.Base.Digest || Rescue.Name[0] || Resume))
+        error(1, L"Invalid options: --stripes does not go with --compress, --base, --rescue or --resume\n\n%s\n", USAGE);
+
+    // Enough buffers to keep every core packing or hashing while the disk and file are busy
+    GetSystemInfo(&SysInfo);
+    if ((Pack.Algorithm || Hash.Algorithm) && !BuffersSet)
+        Buffers = max(Buffers, SysInfo.dwNumberOfProcessors * 2 + Depth);
+
+    // At least one read in flight per stripe, and buffers for a second round while they are written
+    if (Stripes > 1) {
+        Depth = max(Depth, Stripes);
+        if (!BuffersSet)
+            Buffers = max(Buffers, Depth * 2);
+    }
+
+    // Only as many reads can be in flight as there are buffers to hold them
+    if (Depth > Buffers)
+        Depth = Buffers;
+
+    // Collecting the garbage of a store is all there is to do then
+    if (Gc) {
+        if (!store_gc(Store.Root, TRUE, &StoreStats))
+            error(1, L"Unable to read the recipes of store %s, nothing removed", Store.Root);
+
+        wprintf(L"Store %s: %u recipes of %.1f MB in %u chunks of %.1f MB, %.1fx dedup, removed %u files of %.1f MB\n",
+            Store.Root,
+            StoreStats.Recipes,
+            (float)StoreStats.Logical / (float)(1 << 20),
+            StoreStats.Chunks,
+            (float)StoreStats.Bytes / (float)(1 << 20),
+            (StoreStats.Bytes) ? (float)StoreStats.Logical / (float)StoreStats.Bytes : 0.0,
+            StoreStats.Removed,
+            (float)StoreStats.Freed / (float)(1 << 20)
+        );
+        return 0;
+    }
+
+    if (argc < ((List) ? 2 : 3) || ((PartList || RegionList) && argc > 3))
         error(1, L"Wrong number of parameters [argc=%d]\n\n%s\n", argc, USAGE);
 
     DiskNo = argv[1];
-    FileName = argv[2];
+    FileName = (List) ? L"" : argv[2];
     Offset.QuadPart = (argc >= 4) ? _wtoi64(argv[3]) * 512 : 0;
     MaxBytes.QuadPart = (argc == 5) ? _wtoi64(argv[4]) : 0;
 
-    if (wcsncmp(DiskNo, L"\\\\.\\PhysicalDrive", 13) == 0)
-        wcsncpy(DevName, DiskNo, ARRAYSIZE(DevName));
-    else if (iswdigit(DiskNo[0]))
-        swprintf(DevName, ARRAYSIZE(DevName), L"\\\\.\\PhysicalDrive%s", DiskNo);
-    else if (DiskNo[0] == 'a' || DiskNo[0] == 'A' || DiskNo[0] == 'b' || DiskNo[0] == 'B')
-        swprintf(DevName, ARRAYSIZE(DevName), L"\\\\.\\%c:", DiskNo[0]);
-    else
+    if (Store.Root[0] && wcspbrk(FileName, L"\\/:*?\"<>|"))
+        error(1, L"Invalid recipe name %s, it is a plain name kept in %s\\recipes", FileName, Store.Root);
+
+    if (wcscmp(Rescue.Name, L"*") == 0)
+        swprintf(Rescue.Name, ARRAYSIZE(Rescue.Name), L"%s.map", FileName);
+
+    // Journaling costs a flush every few seconds and is asked for, --resume alone looks for the default journal
+    if (wcscmp(Journal.Name, L"*") == 0 || (Resume && !Journal.Name[0]))
+        swprintf(Journal.Name, ARRAYSIZE(Journal.Name), L"%s.journal", FileName);
+
+    if ((IsFile = disk_name(DiskNo, DevName)) < 0)
+        error(1, L"Invalid options: %s is not a disk number, A:, B: or \\\\.\\PhysicalDriveN\n\n%s\n", DiskNo, USAGE);
+    if (IsFile && GetFileAttributesW(DevName) == INVALID_FILE_ATTRIBUTES)
         error(1, USAGE, argv[0]);
 
     // Open Disk
     if ((hDisk = CreateFileW(DevName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE)
         error(1, L"Cannot open %s", DevName);
 
-    __try {
+    if (IsFile) {
+        if (!disk_length(hDisk, TRUE, &DiskLengthInfo.Length) || !DiskLengthInfo.Length.QuadPart)
+            error(1, L"Unable to get file size for %s", DevName);
+
+        wprintf(L"Image %s %.1f MB  (%llu bytes)  \n",
+            DevName,
+            (float)DiskLengthInfo.Length.QuadPart / 1024.0 / 1024.0,
+            DiskLengthInfo.Length.QuadPart
+        );
+    }
+    else __try {
         // Disable Boundary Checks
         if (iswdigit(DiskNo[0]) && DeviceIoControl(hDisk, FSCTL_ALLOW_EXTENDED_DASD_IO, NULL, 0, NULL, 0, &BytesRet, NULL))
             error(0, L"Error on DeviceIoControl FSCTL_ALLOW_EXTENDED_DASD_IO");
 
-        // Try to obtain disk length. On removable media the first DISK_GET_LENGTH is not supported
-        if (!DeviceIoControl(hDisk, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &DiskLengthInfo, sizeof(GET_LENGTH_INFORMATION), &BytesRet, NULL)) {
-            if (!DeviceIoControl(hDisk, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &DiskGeom, sizeof(DISK_GEOMETRY), &BytesRet, NULL))
-                error(1, L"Error on DeviceIoControl IOCTL_DISK_GET_DRIVE_GEOMETRY [%d] ", BytesRet);
-
-            DiskLengthInfo.Length.QuadPart = DiskGeom.Cylinders.QuadPart * DiskGeom.TracksPerCylinder * DiskGeom.SectorsPerTrack * DiskGeom.BytesPerSector;
-        }
+        if (!disk_length(hDisk, FALSE, &DiskLengthInfo.Length))
+            error(1, L"Error on DeviceIoControl IOCTL_DISK_GET_DRIVE_GEOMETRY");
 
         if (!DiskLengthInfo.Length.QuadPart)
             error(1, L"Unable to obtain disk length info");
 
-        if (!DeviceIoControl(hDisk, IOCTL_STORAGE_QUERY_PROPERTY, &desc_q, sizeof(desc_q), &desc_h, sizeof(desc_h), &BytesRet, NULL))
-            error(0, L"Error on DeviceIoControl IOCTL_STORAGE_QUERY_PROPERTY Device Property [%d] ", BytesRet);
-
-        desc_d = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, desc_h.Size);
-
-        if (!DeviceIoControl(hDisk, IOCTL_STORAGE_QUERY_PROPERTY, &desc_q, sizeof(desc_q), desc_d, desc_h.Size, &BytesRet, NULL))
-            error(0, L"Error on DeviceIoControl IOCTL_STORAGE_QUERY_PROPERTY [%d] ", BytesRet);
-
-        if (desc_d->Version != sizeof(STORAGE_DEVICE_DESCRIPTOR))
-            error(0, L"STORAGE_DEVICE_DESCRIPTOR is wrong size [%d] should be [%d]", desc_d->Version, sizeof(STORAGE_DEVICE_DESCRIPTOR));
+        if ((desc_d = disk_desc(hDisk)) == NULL)
+            error(0, L"Error on DeviceIoControl IOCTL_STORAGE_QUERY_PROPERTY");
 
         wprintf(L"Disk %s %s %s %S %S %.1f MB  (%llu bytes)  \n",
             DiskNo,
-            (desc_d->RemovableMedia <= 1) ? ft[desc_d->RemovableMedia] : L"(n/a)",
-            (desc_d->BusType < ARRAYSIZE(bus)) ? bus[desc_d->BusType] : bus[0],
-            (desc_d->VendorIdOffset) ? (char*)desc_d + desc_d->VendorIdOffset : "n/a",
-            (desc_d + desc_d->ProductIdOffset) ? (char*)desc_d + desc_d->ProductIdOffset : "n/a",
+            (desc_d && desc_d->RemovableMedia <= 1) ? ft[desc_d->RemovableMedia] : L"(n/a)",
+            disk_bus(desc_d),
+            desc_str(desc_d, (desc_d) ? desc_d->VendorIdOffset : 0),
+            desc_str(desc_d, (desc_d) ? desc_d->ProductIdOffset : 0),
             (float)DiskLengthInfo.Length.QuadPart / 1024.0 / 1024.0,
             DiskLengthInfo.Length.QuadPart
         );
@@ -150,11 +1063,43 @@ int wmain(int argc, WCHAR* argv[]) {
     __except (1) {
     };
 
+    // Partitions are found on the disk itself, an image file is taken for a whole disk image
+    if ((List || PartList) && (!layout_load(hDisk, disk_sector(hDisk, IsFile), DiskLengthInfo.Length.QuadPart, &Layout) || (!Layout.Count && !List)))
+        error(1, L"No MBR or GPT partition table on %s", DevName);
+
+    if (List) {
+        layout_print(&Layout);
+        return 0;
+    }
+
+    if (Extract) {
+        if ((Part = layout_find(&Layout, _wtoi(PartList))) == NULL || wcschr(PartList, L','))
+            error(1, L"Invalid options: --extract takes a single partition, see --list\n\n%s\n", USAGE);
+
+        Offset.QuadPart = Part->Start;
+        MaxBytes.QuadPart = min(Part->Length, DiskLengthInfo.Length.QuadPart - Part->Start);
+        wprintf(L"Partition %u %S at %llu bytes, %llu bytes\n", Part->Number, Part->Type, Offset.QuadPart, MaxBytes.QuadPart);
+    }
+    else if (PartList) {
+        if ((Extent = HeapAlloc(GetProcessHeap(), 0, 2 * PARTS * sizeof(EXTENT))) == NULL)
+            error(1, L"Unable to allocate memory");
+
+        if ((Extents = layout_extents(&Layout, PartList, Extent)) == 0)
+            error(1, L"Invalid options: --part=%s is not in the partition table, see --list\n\n%s\n", PartList, USAGE);
+
+        for (i = 0, Wanted = 0; i < Extents; i++) {
+            Extent[i].End = min(Extent[i].End, DiskLengthInfo.Length.QuadPart);
+            Wanted += max(Extent[i].End - Extent[i].Start, 0);
+        }
+
+        wprintf(L"Partitions %s, %llu bytes in %u extents with the partition tables\n", PartList, Wanted, Extents);
+    }
+
     if (MaxBytes.QuadPart > DiskLengthInfo.Length.QuadPart)
         error(1, L"Max Bytes > Disk Size\n");
 
-    if (SetFilePointerEx(hDisk, Offset, NULL, FILE_BEGIN) == 0)
-        error(1, L"Unable to Set File Pointer for Offset [%ull] ", Offset.QuadPart);
+    if (Offset.QuadPart >= DiskLengthInfo.Length.QuadPart)
+        error(1, L"Offset [%llu] is beyond end of disk", Offset.QuadPart);
 
     if (Offset.QuadPart)
         DiskLengthInfo.Length.QuadPart -= Offset.QuadPart;
@@ -162,91 +1107,821 @@ int wmain(int argc, WCHAR* argv[]) {
     if (MaxBytes.QuadPart)
         DiskLengthInfo.Length.QuadPart = MaxBytes.QuadPart;
 
-    // Open File
-    if ((hFile = CreateFileW(FileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE)
+    // Used clusters of the volume the region holds, relative to its offset like everything else
+    if (Used) {
+        if (!fat_load(hDisk, Offset.QuadPart, DiskLengthInfo.Length.QuadPart, &Fat, &Extent, &Extents))
+            error(1, L"No FAT file system at offset %llu of %s", Offset.QuadPart, DevName);
+
+        Wanted = Fat.Length;
+        wprintf(L"FAT%u, %u clusters of %u bytes, %u used, reading %llu bytes (%.1f%%) in %u extents\n",
+            Fat.Bits,
+            Fat.Clusters,
+            Fat.Cluster,
+            Fat.Used,
+            Wanted,
+            (float)Wanted * 100.0 / DiskLengthInfo.Length.QuadPart,
+            Extents
+        );
+    }
+
+    // Regions are read in disk order one extent each, whole sectors that may neither overlap
+    // nor go past the end of the disk
+    if (RegionList) {
+        if (!region_load(RegionList, Region, &Regions))
+            error(1, L"Unable to read regions from %s, expected <name> <sect_skip> <max_bytes> lines or a SCSI2SD configuration", RegionList);
+
+        if ((Extent = HeapAlloc(GetProcessHeap(), 0, Regions * sizeof(EXTENT))) == NULL)
+            error(1, L"Unable to allocate memory");
+
+        for (i = 0, Wanted = 0; i < Regions; i++) {
+            if (Region[i].Length <= 0 || Region[i].Length % 512 || wcspbrk(Region[i].Name, L"\\/:*?\"<>|"))
+                error(1, L"Invalid region %s, the name has to be plain and the length whole sectors", Region[i].Name);
+
+            if (Region[i].Start + Region[i].Length > DiskLengthInfo.Length.QuadPart)
+                error(1, L"Region %s at sector %llu ends beyond end of disk", Region[i].Name, Region[i].Start / 512);
+
+            for (n = 0; n < i; n++)
+                if (_wcsicmp(Region[n].Name, Region[i].Name) == 0)
+                    error(1, L"Region %s is listed twice", Region[i].Name);
+
+            if (i && Region[i].Start < Region[i - 1].Start + Region[i - 1].Length)
+                error(1, L"Regions %s and %s overlap", Region[i - 1].Name, Region[i].Name);
+
+            Extent[i].Start = Region[i].Start;
+            Extent[i].End = Region[i].Start + Region[i].Length;
+            Wanted += Region[i].Length;
+            wprintf(L"Region %-8s sector %llu, %llu bytes\n", Region[i].Name, Region[i].Start / 512, Region[i].Length);
+        }
+
+        Extents = Regions;
+        wprintf(L"Reading %llu bytes in %u regions, one pass over %llu bytes of the disk\n", Wanted, Regions, Extent[Extents - 1].End - Extent[0].Start);
+    }
+
+    if (!Extents)
+        Wanted = DiskLengthInfo.Length.QuadPart;
+
+    // Second handle for the data path, overlapped so several reads can be queued at once
+    if ((hDiskIo = CreateFileW(DevName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL)) == INVALID_HANDLE_VALUE)
+        error(1, L"Cannot open %s for overlapped I/O", DevName);
+
+    // Block size and depth for this disk model from the cache, or from trials at the start of the
+    // region. An image file is read through the file system cache, trials would only measure that.
+    if (Tune && IsFile) {
+        error(0, L"Image files are not tuned, using block %u and depth %u", BufferSize, Depth);
+    }
+    else if (Tune) {
+        tune_model(Model, sizeof(Model), desc_str(desc_d, (desc_d) ? desc_d->VendorIdOffset : 0), desc_str(desc_d, (desc_d) ? desc_d->ProductIdOffset : 0));
+
+        // Deltas keep the chunk size of the base, only the depth is tried then
+        n = (BlockSet || Diff.Base.Digest) ? BufferSize : 0;
+
+        if (!n && Tune == 1 && tune_load(Model, FALSE, &Tuned)) {
+            wprintf(L"Tuned for %S before: block %u, depth %u, %.1f MB/s\n", Model, Tuned.Block, Tuned.Depth, Tuned.Speed);
+        }
+        else if (!tune_probe(hDiskIo, Offset.QuadPart, DiskLengthInfo.Length.QuadPart, FALSE, n, &Tuned)) {
+            error(0, L"Tuning trials failed, using block %u and depth %u", BufferSize, Depth);
+        }
+        else {
+            wprintf(L"Tuned for %S: block %u, depth %u, %.1f MB/s\n", Model, Tuned.Block, Tuned.Depth, Tuned.Speed);
+            if (!n && !tune_save(Model, FALSE, &Tuned))
+                error(0, L"Unable to cache the tuning");
+        }
+
+        if (Tuned.Block) {
+            if (!n)
+                BufferSize = max(Tuned.Block, Sparse.Granule);
+            if (!DepthSet)
+                Depth = max(Tuned.Depth, Stripes);
+            if (!BuffersSet)
+                Buffers = max(Buffers, ((Pack.Algorithm || Hash.Algorithm) ? SysInfo.dwNumberOfProcessors * 2 : Depth) + Depth);
+            if (Depth > Buffers)
+                Depth = Buffers;
+        }
+    }
+
+    // Every buffer is whole blocks of the virtual disk, written or left out one by one
+    if (Virt.Format) {
+        BufferSize = (BufferSize + VIRT_BLOCK - 1) / VIRT_BLOCK * VIRT_BLOCK;
+
+        if (!virt_init(&Virt, Virt.Format, DiskLengthInfo.Length.QuadPart))
+            error(1, L"Unable to create a %s of %llu bytes, too large or out of memory", virt_name(Virt.Format), DiskLengthInfo.Length.QuadPart);
+
+        wprintf(L"Dynamic %s, %u byte blocks, %u byte buffers\n", virt_name(Virt.Format), Virt.Block, BufferSize);
+    }
+
+    // A rescue map from an interrupted run means the image is kept and completed
+    if (Rescue.Name[0]) {
+        Rescue.Offset = Offset.QuadPart;
+        Rescue.Length = DiskLengthInfo.Length.QuadPart;
+        Resume = map_load(&Rescue);
+    }
+
+    // Identity of the dump, a journal of anything else is not resumed
+    if (Journal.Name[0]) {
+        journal_key(&Journal, "job dump");
+        journal_key(&Journal, "device %S", DevName);
+        journal_key(&Journal, "product %s", desc_str(desc_d, (desc_d) ? desc_d->ProductIdOffset : 0));
+        journal_key(&Journal, "serial %s", desc_str(desc_d, (desc_d) ? desc_d->SerialNumberOffset : 0));
+        journal_key(&Journal, "image %S", FileName);
+        journal_key(&Journal, "offset %llu", Offset.QuadPart);
+        journal_key(&Journal, "length %llu", DiskLengthInfo.Length.QuadPart);
+        journal_key(&Journal, "block %u", BufferSize);
+        journal_key(&Journal, "sparse %u", Sparse.Granule);
+        journal_key(&Journal, "hash %S", hash_name(Hash.Algorithm));
+        Journal.Size = Hash.Size;
+
+        if (Resume && (n = journal_load(&Journal)) != 1)
+            error(1, (n) ? L"Journal %s is for a different dump, the disk, image or options changed" : L"Nothing to resume, journal %s not found", Journal.Name);
+
+        // Everything is read again from the last chunk boundary that is on disk
+        if (Resume && (Journal.Committed > DiskLengthInfo.Length.QuadPart || (Journal.Committed % BufferSize && Journal.Committed != DiskLengthInfo.Length.QuadPart)))
+            error(1, L"Journal %s is damaged, committed offset %llu", Journal.Name, Journal.Committed);
+    }
+
+    // Open File, a store gets the chunks and at the end the recipe instead
+    if (Store.Root[0]) {
+        if (!store_create(Store.Root))
+            error(1, L"Unable to create store %s", Store.Root);
+
+        hFile = INVALID_HANDLE_VALUE;
+        wprintf(L"Storing into %s as %s, %u byte chunks\n", Store.Root, FileName, BufferSize);
+    }
+    // Every region gets a file of its own, written side by side as the disk is read
+    else if (Regions) {
+        hFile = INVALID_HANDLE_VALUE;
+
+        for (i = 0; i < Regions; i++) {
+            swprintf(RegionName, ARRAYSIZE(RegionName), L"%s.%s", FileName, Region[i].Name);
+            if ((Region[i].File = CreateFileW(RegionName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, CREATE_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL)) == INVALID_HANDLE_VALUE)
+                error(1, L"Unable to open file %s ", RegionName);
+
+            if (Sparse.Granule && !ioctl(Region[i].File, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &BytesRet))
+                error(0, L"Unable to make %s sparse, zero blocks will still be skipped", RegionName);
+        }
+    }
+    else if ((hFile = CreateFileW(FileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, (Resume) ? OPEN_EXISTING : CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | ((Direct) ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : 0), NULL)) == INVALID_HANDLE_VALUE)
         error(1, L"Unable to open file %s ", FileName);
 
+    // Unbuffered writes start on a sector of the volume and are whole sectors long
+    if (Direct) {
+        Align = file_sector(FileName);
+        if (BufferSize % Align || Sparse.Granule % Align)
+            error(1, L"Invalid options: block=%u and sparse=%u have to be multiples of the %u byte sectors of %s with --direct\n\n%s\n", BufferSize, Sparse.Granule, Align, FileName, USAGE);
+
+        wprintf(L"Direct I/O, %u byte sectors\n", Align);
+    }
+
+    // Ranges of a sparse file that are never written stay unallocated. The file is new so
+    // there is nothing to deallocate with FSCTL_SET_ZERO_DATA. Without sparse support
+    // (FAT, exFAT) the file system zero fills the gaps and the image is still correct.
+    if (Sparse.Granule && !Regions && !ioctl(hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &BytesRet))
+        error(0, L"Unable to make %s sparse, zero blocks will still be skipped", FileName);
+
+    // Stripes write far past the end of the file. In a sparse file the gap is not zero filled
+    // first, it fills in as the earlier stripes catch up.
+    else if ((Stripes > 1 || Extents) && !Sparse.Granule && !Store.Root[0] && !Regions)
+        ioctl(hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &BytesRet);
+
+    // Whatever was written past the last checkpoint is not trusted and read again
+    if (Resume && Journal.Name[0]) {
+        FileSize.QuadPart = Journal.Committed;
+        if (!SetFilePointerEx(hFile, FileSize, NULL, FILE_BEGIN) || !SetEndOfFile(hFile))
+            error(1, L"Unable to truncate file %s", FileName);
+
+        wprintf(L"Resuming at %llu bytes (%.1f%%) from journal %s\n",
+            Journal.Committed,
+            (float)Journal.Committed * 100.0 / DiskLengthInfo.Length.QuadPart,
+            Journal.Name
+        );
+    }
+
+    if (Journal.Name[0] && !journal_open(&Journal, Resume)) {
+        error(0, L"Unable to write journal %s, the dump cannot be resumed if interrupted", Journal.Name);
+        journal_close(&Journal, FALSE);
+        Journal.Name[0] = L'\0';
+    }
+
     TotalBytesRead.QuadPart = 0;
 
-    Buff = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, BUFFER_SIZE);
-    if (Buff == NULL)
+    Slot = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, Buffers * sizeof(SLOT));
+    if (Slot == NULL)
+        error(1, L"Unable to allocate memory");
+
+    // Buffers aligned to the sectors of the image file, or at least to pages
+    if (!pool_init(&Pool, Buffers, BufferSize, Align))
         error(1, L"Unable to allocate memory");
 
+    for (i = 0; i < Buffers; i++) {
+        Slot[i].Buff = pool_get(&Pool, BufferSize);
+        Slot[i].Ovl.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (Slot[i].Buff == NULL || Slot[i].Ovl.hEvent == NULL)
+            error(1, L"Unable to allocate memory");
+
+        if (Pack.Algorithm || Hash.Algorithm) {
+            Slot[i].Hash = Hash.Algorithm;
+            Slot[i].Store = (Store.Root[0]) ? Store.Root : NULL;
+            Slot[i].Done = CreateEventW(NULL, TRUE, FALSE, NULL);
+            if (Slot[i].Done == NULL)
+                error(1, L"Unable to allocate memory");
+        }
+
+        if (Pack.Algorithm) {
+            Slot[i].Out = HeapAlloc(GetProcessHeap(), 0, BufferSize + sizeof(IMGZ_CHUNK));
+            if (Slot[i].Out == NULL)
+                error(1, L"Unable to allocate memory");
+
+            if (!imgz_api.CreateCompressor(Pack.Algorithm | COMPRESS_RAW, NULL, &Slot[i].Codec))
+                error(1, L"Unable to create %s compressor", imgz_name(Pack.Algorithm));
+        }
+    }
+
+    // Placeholder header, rewritten with the map when done
+    if (Diff.Base.Digest) {
+        CopyMemory(Diff.Header.Magic, DELTA_MAGIC, sizeof(Diff.Header.Magic));
+        Diff.Header.Version = DELTA_VERSION;
+        Diff.Header.ChunkSize = BufferSize;
+        Diff.Header.Hash = Hash.Algorithm;
+        CopyMemory(Diff.Header.Base, Diff.Base.Tree, sizeof(Diff.Header.Base));
+        Diff.Pos = sizeof(Diff.Header);
+
+        if (!write_at(hFile, &Diff.Header, sizeof(Diff.Header), 0))
+            error(1, L"Error writing to file");
+
+        wprintf(L"Delta against %llu bytes in %u chunks of %u bytes, %s\n", Diff.Base.Length, Diff.Base.Count, BufferSize, hash_name(Hash.Algorithm));
+    }
+
+    // Placeholder header, rewritten with the length when done
+    if (Pack.Algorithm) {
+        CopyMemory(Pack.Header.Magic, IMGZ_MAGIC, sizeof(Pack.Header.Magic));
+        Pack.Header.Version = IMGZ_VERSION;
+        Pack.Header.Algorithm = Pack.Algorithm;
+        Pack.Header.ChunkSize = BufferSize;
+        Pack.Pos = sizeof(Pack.Header);
+
+        if (!write_at(hFile, &Pack.Header, sizeof(Pack.Header), 0))
+            error(1, L"Error writing to file");
+
+        wprintf(L"Compressing with %s, %u byte chunks, %u buffers\n", imgz_name(Pack.Algorithm), BufferSize, Buffers);
+    }
+
+    QueryPerformanceFrequency(&pres);
     QueryPerformanceCounter(&pbegin);
+    ReadPos = 0;
 
-    do {
-        QueryPerformanceCounter(&pstart);
-        ZeroMemory(Buff, BUFFER_SIZE);
+    // Resumed dump picks up the digests of the chunks already on disk, the image digest
+    // comes out the same as if it had run in one go
+    if (Resume && Journal.Name[0]) {
+        ReadPos = Journal.Committed;
+        TotalBytesRead.QuadPart = Journal.Committed;
 
-        if (MaxBytes.QuadPart && TotalBytesRead.QuadPart >= MaxBytes.QuadPart)
-            break;
+        if (Hash.Algorithm && Journal.Chunks) {
+            Hash.Digest = Journal.Digest;
+            Hash.Max = Journal.Max;
+            Hash.Count = Journal.Chunks;
+            Journal.Digest = NULL;
+        }
+    }
+
+    // Stripes are whole blocks so every buffer is one chunk, the last stripe takes the tail
+    Stripe = HeapAlloc(GetProcessHeap(), 0, max(Stripes, Extents) * sizeof(STRIPE));
+    if (Stripe == NULL)
+        error(1, L"Unable to allocate memory");
+
+    StripeSize = (DiskLengthInfo.Length.QuadPart - ReadPos + Stripes - 1) / Stripes;
+    StripeSize = (StripeSize + BufferSize - 1) / BufferSize * BufferSize;
+
+    for (i = 0; i < Stripes; i++) {
+        Stripe[i].Pos = min(ReadPos + i * StripeSize, DiskLengthInfo.Length.QuadPart);
+        Stripe[i].End = min(Stripe[i].Pos + StripeSize, DiskLengthInfo.Length.QuadPart);
+    }
+
+    // Selected partitions and used clusters are read one extent after the other, each a stripe of its own
+    if (Extents) {
+        for (i = 0; i < Extents; i++) {
+            Stripe[i].Pos = Extent[i].Start;
+            Stripe[i].End = max(Extent[i].End, Extent[i].Start);
+        }
+        Stripes = Extents;
+    }
+    else if (Stripes > 1)
+        wprintf(L"Reading %u stripes of %.1f MB, %u reads in flight\n", Stripes, (float)StripeSize / (float)(1 << 20), Depth);
+
+    // Rescue mode reads synchronously on its own, one block at a time, the ring below finds
+    // nothing left to do. The image gets its full length up front, bad sectors stay zero.
+    if (Rescue.Name[0]) {
+        if (Resume)
+            wprintf(L"Resuming rescue from %s, %llu bytes rescued so far\n", Rescue.Name, map_bytes(&Rescue, '+'));
+        else
+            map_set(&Rescue, 0, Rescue.Length, '?');
 
-        if (ReadFile(hDisk, Buff, BUFFER_SIZE, &BytesRead, NULL) == 0) {
+        Rescue.hDisk = hDiskIo;
+        Rescue.hFile = hFile;
+        Rescue.Buff = Slot[0].Buff;
+        Rescue.IsFile = IsFile;
 
-            // End of disk, nothing left
-            if (DiskLengthInfo.Length.QuadPart - TotalBytesRead.QuadPart == 0) {
+        FileSize.QuadPart = Rescue.Length;
+        if (!SetFilePointerEx(hFile, FileSize, NULL, FILE_BEGIN) || !SetEndOfFile(hFile))
+            error(1, L"Unable to extend file %s", FileName);
+
+        TotalBytesRead.QuadPart = rescue(&Rescue, BufferSize);
+        Eof = TRUE;
+    }
+
+    // Reads are queued into free buffers in ring order up to Depth at a time. Each buffer is
+    // written to the file as soon as its read completes, so the disk keeps reading while earlier
+    // buffers are being written. In compressed and hash mode buffers are hashed and packed on the
+    // thread pool first. Buffers go FREE -> READING -> (PACKING) -> WRITING in ring order.
+    // With --rate the next read waits until the average rate drops below the cap. With stripes
+    // the reads take turns between them, ReadPos counts the bytes queued in all of them.
+    RateBase = ReadPos;
+
+    // Progress is printed by the reporter thread, the loop only counts
+    Report.Verb = L'R';
+    Report.Tool = "diskdump";
+    Report.Source.Name = DevName;
+    Report.Sink.Name = FileName;
+    if (!report_start(&Report, Wanted, TotalBytesRead.QuadPart))
+        error(1, L"Unable to start the progress reporter");
+
+    for (;;) {
+        Delay = 0;
+
+        while (!Eof && ReadPos < Wanted && Reading < Depth && Slot[Next].State == SLOT_FREE &&
+            (!Rate || (Delay = throttle(ReadPos - RateBase, Rate, pbegin, pres)) == 0)) {
+            while (Stripe[Turn].Pos >= Stripe[Turn].End)
+                Turn = (Turn + 1) % Stripes;
+
+            s = &Slot[Next];
+            s->Pos = Stripe[Turn].Pos;
+            s->Region = (Regions) ? &Region[Turn] : NULL;
+            s->Length = (DWORD)min((LONGLONG)BufferSize, Stripe[Turn].End - s->Pos);
+
+            // Disks only read whole sectors, the excess is cut off when the read completes
+            if (!IsFile)
+                s->Length = (s->Length + 511) & ~511;
+
+            if (!submit(hDiskIo, s, s->Buff, s->Length, Offset.QuadPart + s->Pos, FALSE)) {
+                error(0, L"While queuing disk read at %llu", Offset.QuadPart + s->Pos);
+                Eof = TRUE;
                 break;
             }
-            // End of disk, dangling bytes left (< buffer size)
-            else if (DiskLengthInfo.Length.QuadPart - TotalBytesRead.QuadPart < BUFFER_SIZE) {
-                // Reading last sector
-                if (ReadFile(hDisk, Buff, DiskLengthInfo.Length.QuadPart - TotalBytesRead.QuadPart, &BytesRead, NULL) == 0)
-                    error(0, L"While reading last sector of the disk, Status=%d BytesToRead=%llu BytesRead=%d",
-                        ret, DiskLengthInfo.Length.QuadPart - TotalBytesRead.QuadPart, BytesRead
+
+            s->State = SLOT_READING;
+            Stripe[Turn].Pos += s->Length;
+            ReadPos += s->Length;
+            Reading++;
+            Next = (Next + 1) % Buffers;
+            if (!Extents)
+                Turn = (Turn + 1) % Stripes;
+        }
+
+        // Collect finished reads
+        while (Reading && HasOverlappedIoCompleted(&Slot[ReadTail].Ovl)) {
+            s = &Slot[ReadTail];
+            BytesRead = 0;
+
+            if (!GetOverlappedResult(hDiskIo, &s->Ovl, &BytesRead, TRUE) && GetLastError() != ERROR_HANDLE_EOF) {
+                // End of disk, dangling bytes left (< buffer size)
+                if (!Eof && s->Pos + s->Length >= DiskLengthInfo.Length.QuadPart && s->Pos < DiskLengthInfo.Length.QuadPart) {
+                    // Reading last sector
+                    s->Length = (DWORD)(DiskLengthInfo.Length.QuadPart - s->Pos);
+                    if (!submit(hDiskIo, s, s->Buff, s->Length, Offset.QuadPart + s->Pos, FALSE) || !GetOverlappedResult(hDiskIo, &s->Ovl, &BytesRead, TRUE))
+                        error(0, L"While reading last sector of the disk, Status=%d BytesToRead=%llu BytesRead=%d",
+                            ret, DiskLengthInfo.Length.QuadPart - s->Pos, BytesRead
+                        );
+                }
+                else if (!Eof) {
+                    error(0, L"While reading disk!\n  Status=%d\n  DiskLength=%llu\n  TotalBytesRead=%llu\n  Diff=%llu\n  Offset=%llu\n  BytesRead=%d\n",
+                        ret, DiskLengthInfo.Length.QuadPart, s->Pos, DiskLengthInfo.Length.QuadPart - s->Pos, Offset.QuadPart, BytesRead
                     );
+                }
+            }
+
+            report_io(&Report.Source, s->Issued, BytesRead, Report.Freq);
+
+            // Nothing more is read after an error or end of disk, buffers still in flight are dropped
+            if (Eof)
+                BytesRead = 0;
+            if (BytesRead < s->Length)
+                Eof = TRUE;
+
+            s->Length = (DWORD)min((LONGLONG)BytesRead, DiskLengthInfo.Length.QuadPart - s->Pos);
+            s->Scan = 0;
+
+            if (Pack.Algorithm || Hash.Algorithm) {
+                ResetEvent(s->Done);
+                if (!s->Length)
+                    SetEvent(s->Done);
+                else if (!TrySubmitThreadpoolCallback(pack, s, NULL))
+                    error(1, L"Unable to queue compression or hashing");
+
+                s->State = SLOT_PACKING;
+                Packing++;
             }
             else {
-                error(0, L"While reading disk!\n  Status=%d\n  DiskLength=%llu\n  TotalBytesRead=%llu\n  Diff=%llu\n  Offset=%llu\n  BytesRead=%d\n",
-                    ret, DiskLengthInfo.Length.QuadPart, TotalBytesRead.QuadPart, DiskLengthInfo.Length.QuadPart - TotalBytesRead.QuadPart, Offset.QuadPart, BytesRead
-                );
+                s->State = SLOT_WRITING;
+                write_next(hFile, s, &Sparse, &Virt, Align);
+                Writing++;
+            }
+
+            ReadTail = (ReadTail + 1) % Buffers;
+            Reading--;
+        }
+
+        // Chunks come back from the thread pool in order, digests are collected and packed chunks appended to the file
+        while (Packing && WaitForSingleObject(Slot[PackTail].Done, 0) == WAIT_OBJECT_0) {
+            s = &Slot[PackTail];
+
+            // Digests go by chunk number, stripes finish chunks out of order
+            if (Hash.Algorithm && s->Length) {
+                n = (DWORD)(s->Pos / BufferSize);
+
+                while (n >= Hash.Max) {
+                    Hash.Max = (Hash.Max) ? Hash.Max * 2 : 4096;
+                    Hash.Digest = (Hash.Digest) ? HeapReAlloc(GetProcessHeap(), 0, Hash.Digest, Hash.Max * Hash.Size) : HeapAlloc(GetProcessHeap(), 0, Hash.Max * Hash.Size);
+                    if (Hash.Digest == NULL)
+                        error(1, L"Unable to allocate memory");
+                }
+
+                CopyMemory(Hash.Digest + n * Hash.Size, s->Digest, Hash.Size);
+                Hash.Count = max(Hash.Count, n + 1);
+            }
+
+            // Delta mode writes a chunk only if its digest differs from the base, by chunk number as well
+            if (Diff.Base.Digest) {
+                n = (DWORD)(s->Pos / BufferSize);
+                BaseLength = (n < Diff.Base.Count) ? min((LONGLONG)Diff.Base.ChunkSize, (LONGLONG)Diff.Base.Length - (LONGLONG)n * Diff.Base.ChunkSize) : 0;
+                s->Scan = s->Length;
+
+                if (s->Length && (BaseLength != s->Length || memcmp(s->Digest, Diff.Base.Digest + n * Hash.Size, Hash.Size) != 0)) {
+                    if (!submit(hFile, s, s->Buff, s->Length, Diff.Pos, TRUE))
+                        error(1, L"Error writing to file");
+
+                    x = (Diff.Count) ? &Diff.Map[Diff.Count - 1] : NULL;
+                    if (x && x->Offset + x->Length == (ULONGLONG)s->Pos && x->Data + x->Length == (ULONGLONG)Diff.Pos) {
+                        x->Length += s->Length;
+                    }
+                    else {
+                        if (Diff.Count == Diff.Max) {
+                            Diff.Max = (Diff.Max) ? Diff.Max * 2 : 4096;
+                            Diff.Map = (Diff.Map) ? HeapReAlloc(GetProcessHeap(), 0, Diff.Map, Diff.Max * sizeof(DELTA_EXTENT)) : HeapAlloc(GetProcessHeap(), 0, Diff.Max * sizeof(DELTA_EXTENT));
+                            if (Diff.Map == NULL)
+                                error(1, L"Unable to allocate memory");
+                        }
+
+                        x = &Diff.Map[Diff.Count++];
+                        x->Offset = s->Pos;
+                        x->Data = Diff.Pos;
+                        x->Length = s->Length;
+                    }
+
+                    s->Pending = TRUE;
+                    Diff.Pos += s->Length;
+                    Diff.Changed += s->Length;
+                }
+            }
+            // Store mode, the chunk went into the store on the thread pool, nothing is written here
+            else if (Store.Root[0]) {
+                s->Scan = s->Length;
+
+                if (s->Length && s->Stored < 0)
+                    error(1, L"Error writing chunk at %llu to store %s", s->Pos, Store.Root);
+
+                if (s->Length) {
+                    Store.Chunks++;
+                    Store.New += s->Stored;
+                    Store.Written += (s->Stored) ? s->Length : 0;
+                }
+            }
+            else if (!Pack.Algorithm) {
+                write_next(hFile, s, &Sparse, &Virt, Align);
+            }
+            else if (s->Length) {
+                s->Scan = s->Length;
+
+                if (!submit(hFile, s, s->Out, s->OutLength, Pack.Pos, TRUE))
+                    error(1, L"Error writing to file");
+
+                if (Pack.Count == Pack.Max) {
+                    Pack.Max = (Pack.Max) ? Pack.Max * 2 : 4096;
+                    Pack.Index = (Pack.Index) ? HeapReAlloc(GetProcessHeap(), 0, Pack.Index, Pack.Max * sizeof(IMGZ_INDEX)) : HeapAlloc(GetProcessHeap(), 0, Pack.Max * sizeof(IMGZ_INDEX));
+                    if (Pack.Index == NULL)
+                        error(1, L"Unable to allocate memory");
+                }
+
+                Pack.Index[Pack.Count].Offset = Pack.Pos;
+                Pack.Index[Pack.Count].Packed = ((IMGZ_CHUNK*)s->Out)->Packed;
+                Pack.Index[Pack.Count].Crc = s->Crc;
+                Pack.Count++;
+
+                s->Pending = TRUE;
+                Pack.Pos += s->OutLength;
+            }
+
+            s->State = SLOT_WRITING;
+            PackTail = (PackTail + 1) % Buffers;
+            Packing--;
+            Writing++;
+        }
+
+        // Retire finished writes
+        while (Writing && (!Slot[WriteTail].Pending || HasOverlappedIoCompleted(&Slot[WriteTail].Ovl))) {
+            s = &Slot[WriteTail];
+
+            if (s->Pending && !GetOverlappedResult((s->Region) ? s->Region->File : hFile, &s->Ovl, &BytesRead, TRUE))
+                error(1, L"Error writing to file");
+            if (s->Pending)
+                report_io(&Report.Sink, s->Issued, BytesRead, Report.Freq);
+
+            s->Pending = FALSE;
+            if (write_next(hFile, s, &Sparse, &Virt, Align))
+                continue;
+
+            TotalBytesRead.QuadPart += s->Length;
+            if (s->Region)
+                s->Region->Done += s->Length;
+            Report.Done = TotalBytesRead.QuadPart;
+            Report.Last = s->Length;
+
+            s->State = SLOT_FREE;
+            WriteTail = (WriteTail + 1) % Buffers;
+            Writing--;
+
+            // Buffers retire in order, everything up to this one is written. Flushed and
+            // recorded on a chunk boundary, except for the very end.
+            if (Journal.File && GetTickCount64() - Journal.Saved >= JOURNAL_PERIOD) {
+                Committed = s->Pos + s->Length;
+                if (Committed < DiskLengthInfo.Length.QuadPart)
+                    Committed -= Committed % BufferSize;
+
+                if (!FlushFileBuffers(hFile))
+                    error(1, L"Error flushing file");
+
+                if (!journal_commit(&Journal, Committed, Hash.Digest, (DWORD)((Committed + BufferSize - 1) / BufferSize)))
+                    error(0, L"Error writing journal %s", Journal.Name);
             }
         }
 
-        if (WriteFile(hFile, Buff, BytesRead, NULL, NULL) == 0)
+        // Sleep until the oldest read, chunk or write completes
+        n = 0;
+        if (Reading)
+            Wait[n++] = Slot[ReadTail].Ovl.hEvent;
+        if (Packing)
+            Wait[n++] = Slot[PackTail].Done;
+        if (Writing)
+            Wait[n++] = Slot[WriteTail].Ovl.hEvent;
+
+        // Reads in flight with a free buffer to read into wait for the disk, a full ring for
+        // the file (or the packing). Waiting for --rate counts for neither.
+        if (n) {
+            QueryPerformanceCounter(&Slept);
+            WaitForMultipleObjects(n, Wait, FALSE, (Delay) ? Delay : INFINITE);
+            report_stall(&Report, Slept.QuadPart, (Delay) ? NULL : (Reading && Slot[Next].State == SLOT_FREE) ? &Report.Source : &Report.Sink);
+        }
+        else if (Delay)
+            Sleep(Delay);
+        else if (Eof || ReadPos >= Wanted)
+            break;
+    }
+
+    QueryPerformanceCounter(&pend);
+    if (!report_stop(&Report, TotalBytesRead.QuadPart == Wanted))
+        error(0, L"Error writing stats %s", Report.Stats);
+
+    // Index and trailer follow the last chunk, header goes in last with the final length
+    if (Pack.Algorithm) {
+        Trailer.Index = Pack.Pos;
+        Trailer.Count = Pack.Count;
+        Trailer.Crc = crc32c(0, Pack.Index, Pack.Count * sizeof(IMGZ_INDEX));
+        CopyMemory(Trailer.Magic, IMGZ_END, sizeof(Trailer.Magic));
+
+        if ((Pack.Count && !write_at(hFile, Pack.Index, Pack.Count * sizeof(IMGZ_INDEX), Pack.Pos)) ||
+            !write_at(hFile, &Trailer, sizeof(Trailer), Pack.Pos + Pack.Count * sizeof(IMGZ_INDEX)))
             error(1, L"Error writing to file");
 
-        TotalBytesRead.QuadPart += BytesRead;
-        QueryPerformanceCounter(&pend);
-        QueryPerformanceFrequency(&pres);
+        Pack.Header.Flags |= IMGZ_INDEXED;
+        Pack.Header.Length = TotalBytesRead.QuadPart;
+        if (!write_at(hFile, &Pack.Header, sizeof(Pack.Header), 0))
+            error(1, L"Error writing to file");
+    }
 
-        wprintf(L"R [%d] [%.1f MB] [%.1f%%] [%.1f MB/s]                \r",
-            BytesRead,
-            (float)TotalBytesRead.QuadPart /  (float) (1 << 20),
-            (float)TotalBytesRead.QuadPart * 100 / DiskLengthInfo.Length.QuadPart,
-            ((float)BytesRead / (float) (1 << 20)) / ((float)(pend.QuadPart-pstart.QuadPart)/(float)(pres.QuadPart))
-        );
-        FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
+    // Tables, headers and footer of the virtual disk follow the last block
+    if (Virt.Format && !virt_finish(hFile, &Virt))
+        error(1, L"Error writing to file");
 
-    } while (BytesRead != 0);
+    // Image digest is the digest of all chunk digests in order, so it can be checked
+    // chunk by chunk in parallel as well
+    if (Hash.Algorithm)
+        hash(Hash.Algorithm, Hash.Digest, Hash.Count * Hash.Size, Tree);
+
+    // Extent map follows the last changed chunk, header goes in last
+    if (Diff.Base.Digest) {
+        Diff.Header.Map = Diff.Pos;
+        Diff.Header.Count = Diff.Count;
+        Diff.Header.Length = TotalBytesRead.QuadPart;
+        CopyMemory(Diff.Header.Tree, Tree, Hash.Size);
+
+        if ((Diff.Count && !write_at(hFile, Diff.Map, Diff.Count * sizeof(DELTA_EXTENT), Diff.Pos)) ||
+            !write_at(hFile, &Diff.Header, sizeof(Diff.Header), 0))
+            error(1, L"Error writing to file");
+    }
 
-    if (MaxBytes.QuadPart) {
+    // Each region file ends where its last read did, trailing holes and all
+    if (Regions) {
+        for (i = 0; i < Regions; i++) {
+            FileSize.QuadPart = Region[i].Done;
+            SetFilePointerEx(Region[i].File, FileSize, NULL, FILE_BEGIN);
+            SetEndOfFile(Region[i].File);
+            CloseHandle(Region[i].File);
+        }
+    }
+    else if (MaxBytes.QuadPart && !Pack.Algorithm && !Diff.Base.Digest && !Store.Root[0] && !Virt.Format) {
         SetFilePointerEx(hFile, MaxBytes, NULL, FILE_BEGIN);
         SetEndOfFile(hFile);
     }
+    // The gap after the last extent is a hole up to the length of the disk or volume
+    else if (Extents && TotalBytesRead.QuadPart == Wanted) {
+        SetFilePointerEx(hFile, DiskLengthInfo.Length, NULL, FILE_BEGIN);
+        SetEndOfFile(hFile);
+    }
+    // Trailing holes were never written, extend the file over them. Direct writes padded the
+    // tail to a whole sector, cut it back. A failed stripe leaves a gap rather than a short
+    // image, the file is not cut back to the bytes read.
+    else if ((Sparse.Granule || Direct) && !Extents && (Stripes == 1 || TotalBytesRead.QuadPart == DiskLengthInfo.Length.QuadPart)) {
+        SetFilePointerEx(hFile, TotalBytesRead, NULL, FILE_BEGIN);
+        SetEndOfFile(hFile);
+    }
 
     wprintf(L"\rDone! [%.1f MB] (%llu bytes) [%.1f%%] [%.1f MB/s]                 \n",
         (float)TotalBytesRead.QuadPart / (float) (1 << 20),
         TotalBytesRead.QuadPart,
-        (float)TotalBytesRead.QuadPart * 100.0 / DiskLengthInfo.Length.QuadPart,
+        (float)TotalBytesRead.QuadPart * 100.0 / Wanted,
         (float)(TotalBytesRead.QuadPart / (1 << 20)) / ((float)(pend.QuadPart-pbegin.QuadPart)/(float)(pres.QuadPart))
     );
+    report_summary(&Report);
 
     GetFileSizeEx(hFile, &FileSize);
 
-    if (FileSize.QuadPart != DiskLengthInfo.Length.QuadPart)
-        wprintf(L"WARNING: Disk Size is %llu bytes, File Size is %llu bytes, Difference is %llu bytes!\n",
-            DiskLengthInfo.Length.QuadPart,
+    // Compressed file size says nothing about completeness, compare the unpacked length instead
+    if (Pack.Algorithm) {
+        wprintf(L"Compressed %llu bytes to %llu bytes (%.1f%%) with %s\n",
+            TotalBytesRead.QuadPart,
             FileSize.QuadPart,
-            DiskLengthInfo.Length.QuadPart - FileSize.QuadPart
+            (TotalBytesRead.QuadPart) ? (float)FileSize.QuadPart * 100.0 / TotalBytesRead.QuadPart : 0.0,
+            imgz_name(Pack.Algorithm)
+        );
+        FileSize = TotalBytesRead;
+    }
+
+    if (Diff.Base.Digest) {
+        wprintf(L"Delta: %llu bytes (%.1f%%) changed in %u extents, %llu bytes unchanged\n",
+            Diff.Changed,
+            (TotalBytesRead.QuadPart) ? (float)Diff.Changed * 100.0 / TotalBytesRead.QuadPart : 0.0,
+            Diff.Count,
+            TotalBytesRead.QuadPart - Diff.Changed
+        );
+        FileSize = TotalBytesRead;
+    }
+
+    // The store holds the image as chunks, what it took is the new ones
+    if (Store.Root[0]) {
+        wprintf(L"Store: %u chunks, %u new written (%.1f MB), %u already stored (%.1f%% deduplicated), ingest %.1f MB/s\n",
+            Store.Chunks,
+            Store.New,
+            (float)Store.Written / (float)(1 << 20),
+            Store.Chunks - Store.New,
+            (TotalBytesRead.QuadPart) ? (float)(TotalBytesRead.QuadPart - Store.Written) * 100.0 / TotalBytesRead.QuadPart : 0.0,
+            ((float)TotalBytesRead.QuadPart / (float)(1 << 20)) / ((float)(pend.QuadPart - pbegin.QuadPart) / (float)pres.QuadPart)
+        );
+        FileSize = TotalBytesRead;
+    }
+
+    // The file holds the allocated blocks and tables, the virtual disk is as long as the dump
+    if (Virt.Format) {
+        wprintf(L"%s: %u of %u blocks allocated, %llu bytes (%.1f%%) left out as zeros, file %.1f MB\n",
+            virt_name(Virt.Format),
+            Virt.Used,
+            Virt.Count,
+            max(TotalBytesRead.QuadPart - (LONGLONG)Virt.Used * Virt.Block, 0),
+            (TotalBytesRead.QuadPart) ? (float)max(TotalBytesRead.QuadPart - (LONGLONG)Virt.Used * Virt.Block, 0) * 100.0 / TotalBytesRead.QuadPart : 0.0,
+            (float)FileSize.QuadPart / (float)(1 << 20)
+        );
+        FileSize = TotalBytesRead;
+    }
+
+    for (i = 0; i < Regions; i++)
+        wprintf(L"%s.%s: %llu of %llu bytes%s\n", FileName, Region[i].Name, Region[i].Done, Region[i].Length, (Region[i].Done == Region[i].Length) ? L"" : L", INCOMPLETE");
+
+    // Stripes fill the file out of order, its size says nothing about a gap left by a failed read.
+    // Selected partitions are compared by the bytes read as well, the file spans the whole disk.
+    if (Stripes > 1 || Extents)
+        FileSize = TotalBytesRead;
+
+    if (FileSize.QuadPart != Wanted)
+        wprintf(L"WARNING: %s is %llu bytes, File Size is %llu bytes, Difference is %llu bytes!\n",
+            (Extents) ? L"Selection" : L"Disk Size",
+            Wanted,
+            FileSize.QuadPart,
+            Wanted - FileSize.QuadPart
         );
 
     if (Offset.QuadPart > 0)
         wprintf(L"Skipped %llu sectors / %llu bytes in the begining\n", Offset.QuadPart / 512, Offset.QuadPart);
 
-    CloseHandle(hFile);
+    if (Sparse.Granule)
+        wprintf(L"Sparse: %llu bytes (%.1f%%) left as holes, %u byte blocks scanned at %.1f MB/s\n",
+            Sparse.Skipped,
+            (TotalBytesRead.QuadPart) ? (float)Sparse.Skipped * 100.0 / TotalBytesRead.QuadPart : 0.0,
+            Sparse.Granule,
+            (Sparse.Ticks) ? ((float)Sparse.Scanned / (float)(1 << 20)) / ((float)Sparse.Ticks / (float)pres.QuadPart) : 0.0
+        );
+
+    // Manifest next to the image, for a delta it describes the whole image so the next delta can use it.
+    // In the store it is the recipe, only written for a complete image.
+    if (Store.Root[0] && TotalBytesRead.QuadPart != Wanted)
+        error(0, L"Dump incomplete, no recipe written, the chunks stored are removed by --gc");
+    else if (Hash.Algorithm) {
+        if (Store.Root[0])
+            store_recipe(Store.Root, FileName, ManifestName);
+        else
+            swprintf(ManifestName, ARRAYSIZE(ManifestName), L"%s.manifest", FileName);
+
+        if ((Manifest = _wfopen(ManifestName, L"w")) == NULL)
+            error(1, L"Unable to open manifest file %s", ManifestName);
+
+        fprintf(Manifest, "# DiskDump v1.3 manifest\n");
+        fprintf(Manifest, "device %S\n", DevName);
+        fprintf(Manifest, "vendor %s\n", desc_str(desc_d, (desc_d) ? desc_d->VendorIdOffset : 0));
+        fprintf(Manifest, "product %s\n", desc_str(desc_d, (desc_d) ? desc_d->ProductIdOffset : 0));
+        fprintf(Manifest, "revision %s\n", desc_str(desc_d, (desc_d) ? desc_d->ProductRevisionOffset : 0));
+        fprintf(Manifest, "serial %s\n", desc_str(desc_d, (desc_d) ? desc_d->SerialNumberOffset : 0));
+        fprintf(Manifest, "bus %S\n", (IsFile) ? L"FILE" : disk_bus(desc_d));
+        fprintf(Manifest, "removable %S\n", (desc_d && desc_d->RemovableMedia <= 1) ? ft[desc_d->RemovableMedia] : L"n/a");
+        fprintf(Manifest, "image %S\n", FileName);
+        fprintf(Manifest, "format %s%S\n", (Pack.Algorithm) ? "compressed " : (Store.Root[0]) ? "store" : (Sparse.Granule) ? "sparse" : (Diff.Base.Digest) ? "delta" : (Virt.Format) ? "" : "raw", (Pack.Algorithm) ? imgz_name(Pack.Algorithm) : (Virt.Format) ? virt_name(Virt.Format) : L"");
+        if (Diff.Base.Digest)
+            fprintf(Manifest, "base %s\n", hash_hex(Diff.Base.Tree, Hash.Size, Hex));
+        fprintf(Manifest, "offset %llu\n", Offset.QuadPart);
+        fprintf(Manifest, "sect_skip %llu\n", Offset.QuadPart / 512);
+        fprintf(Manifest, "max_bytes %llu\n", MaxBytes.QuadPart);
+        fprintf(Manifest, "length %llu\n", TotalBytesRead.QuadPart);
+        fprintf(Manifest, "hash %S\n", hash_name(Hash.Algorithm));
+        fprintf(Manifest, "chunk_size %u\n", BufferSize);
+        fprintf(Manifest, "chunks %u\n", Hash.Count);
+        fprintf(Manifest, "tree %s\n", hash_hex(Tree, Hash.Size, Hex));
+
+        // Chunk offsets are relative to the start of the dump, same as in the image
+        for (i = 0; i < Hash.Count; i++)
+            fprintf(Manifest, "chunk %u %llu %llu %s\n",
+                i,
+                (ULONGLONG)i * BufferSize,
+                min((ULONGLONG)BufferSize, TotalBytesRead.QuadPart - (ULONGLONG)i * BufferSize),
+                hash_hex(Hash.Digest + i * Hash.Size, Hash.Size, Hex)
+            );
+
+        if (fclose(Manifest) != 0)
+            error(1, L"Error writing manifest file %s", ManifestName);
+
+        wprintf(L"Hash: %s tree %S, %u chunks in %s\n", hash_name(Hash.Algorithm), hash_hex(Tree, Hash.Size, Hex), Hash.Count, ManifestName);
+    }
+
+    // An incomplete dump keeps its journal to be resumed
+    if (Journal.Name[0])
+        journal_close(&Journal, TotalBytesRead.QuadPart == DiskLengthInfo.Length.QuadPart);
+
+    if (hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
+    CloseHandle(hDiskIo);
     CloseHandle(hDisk);
-    HeapFree(GetProcessHeap(), 0, Buff);
+
+    for (i = 0; i < Buffers; i++) {
+        CloseHandle(Slot[i].Ovl.hEvent);
+
+        if (Pack.Algorithm || Hash.Algorithm)
+            CloseHandle(Slot[i].Done);
+
+        if (Pack.Algorithm) {
+            imgz_api.CloseCompressor(Slot[i].Codec);
+            HeapFree(GetProcessHeap(), 0, Slot[i].Out);
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, Slot);
+    HeapFree(GetProcessHeap(), 0, Stripe);
+    if (Extent)
+        HeapFree(GetProcessHeap(), 0, Extent);
+    pool_free(&Pool);
+    if (Pack.Index)
+        HeapFree(GetProcessHeap(), 0, Pack.Index);
+    if (Hash.Digest)
+        HeapFree(GetProcessHeap(), 0, Hash.Digest);
+    if (Diff.Base.Digest)
+        HeapFree(GetProcessHeap(), 0, Diff.Base.Digest);
+    if (Diff.Map)
+        HeapFree(GetProcessHeap(), 0, Diff.Map);
+    if (Rescue.Range)
+        HeapFree(GetProcessHeap(), 0, Rescue.Range);
 
     return 0;
 }
-
@@ -0,0 +1,146 @@
+// FAT12/16/32 used cluster map for diskdump --used, needs diskpart.h for EXTENT
+//
+// The boot sector gives the layout of the volume: reserved sectors, the FATs, the FAT12/16
+// root directory and the data clusters. Everything up to the first cluster is metadata and
+// always read, of the data area only clusters with a non-zero FAT entry. Bad clusters are
+// left out, reading them is slow on failing media and their contents do not matter.
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#define FAT_GAP (64 * 1024)     // free runs up to this long are read through, a seek costs more
+#define FAT_PIECE (1 << 20)     // bytes of FAT read at a time
+
+typedef struct {
+    DWORD       Bits;       // 12, 16 or 32
+    DWORD       Sector;     // bytes per sector of the volume
+    DWORD       Cluster;    // bytes per cluster
+    DWORD       Clusters;   // data clusters
+    DWORD       Used;       // allocated clusters
+    LONGLONG    Data;       // bytes before the first cluster
+    LONGLONG    Length;     // bytes read, metadata and used clusters with the gaps read through
+} FATVOL;
+
+DWORD fat_entry(BYTE* fat, DWORD bits, DWORD c) {
+    DWORD v;
+
+    if (bits == 32)
+        return le32(fat + c * 4) & 0x0FFFFFFF;
+    if (bits == 16)
+        return fat[c * 2] | fat[c * 2 + 1] << 8;
+
+    // Two entries in three bytes
+    v = fat[c + c / 2] | fat[c + c / 2 + 1] << 8;
+    return (c & 1) ? v >> 4 : v & 0xFFF;
+}
+
+// Appends an extent or grows the last one over a short gap. List grows by doubling.
+BOOL fat_extent(EXTENT** list, DWORD* count, DWORD* max, LONGLONG start, LONGLONG end) {
+    EXTENT* x;
+
+    if (*count && start - (*list)[*count - 1].End <= FAT_GAP) {
+        (*list)[*count - 1].End = end;
+        return TRUE;
+    }
+
+    if (*count == *max) {
+        *max = (*max) ? *max * 2 : 1024;
+        x = (*list) ? HeapReAlloc(GetProcessHeap(), 0, *list, *max * sizeof(EXTENT)) : HeapAlloc(GetProcessHeap(), 0, *max * sizeof(EXTENT));
+        if (x == NULL)
+            return FALSE;
+        *list = x;
+    }
+
+    (*list)[*count].Start = start;
+    (*list)[*count].End = end;
+    (*count)++;
+    return TRUE;
+}
+
+// Extents of a FAT volume at offset of the disk to read, relative to offset, sorted and clipped
+// to length. The list is freed with HeapFree. FALSE if there is no FAT file system there.
+BOOL fat_load(HANDLE h, LONGLONG offset, LONGLONG length, FATVOL* v, EXTENT** out, DWORD* count) {
+    DWORD spc, reserved, fats, rootents, fatsz, max = 0, c, ret, len;
+    LONGLONG total, fatbytes, pos, start, end;
+    BYTE* buff;
+    BOOL ok = FALSE;
+
+    ZeroMemory(v, sizeof(FATVOL));
+    *out = NULL;
+    *count = 0;
+
+    // Whole 4 KB so the read is whole sectors on any disk
+    if ((buff = VirtualAlloc(NULL, 4096, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        return FALSE;
+
+    if (!read_at(h, buff, 4096, offset, &ret) || ret < 512) {
+        VirtualFree(buff, 0, MEM_RELEASE);
+        return FALSE;
+    }
+
+    v->Sector = buff[11] | buff[12] << 8;
+    spc = buff[13];
+    reserved = buff[14] | buff[15] << 8;
+    fats = buff[16];
+    rootents = buff[17] | buff[18] << 8;
+    total = (buff[19] | buff[20] << 8) ? (buff[19] | buff[20] << 8) : le32(buff + 32);
+    fatsz = (buff[22] | buff[23] << 8) ? (buff[22] | buff[23] << 8) : le32(buff + 36);
+    VirtualFree(buff, 0, MEM_RELEASE);
+
+    // Sanity of the BIOS parameter block, anything else is not FAT
+    if (v->Sector < 512 || v->Sector > 4096 || (v->Sector & (v->Sector - 1)) || !spc || (spc & (spc - 1)) ||
+        !reserved || !fats || fats > 4 || !fatsz || !total)
+        return FALSE;
+
+    v->Cluster = spc * v->Sector;
+    v->Data = ((LONGLONG)reserved + (LONGLONG)fats * fatsz + ((LONGLONG)rootents * 32 + v->Sector - 1) / v->Sector) * v->Sector;
+    if (v->Data >= total * v->Sector || v->Data >= length)
+        return FALSE;
+
+    v->Clusters = (DWORD)((total * v->Sector - v->Data) / v->Cluster);
+    v->Bits = (v->Clusters < 4085) ? 12 : (v->Clusters < 65525) ? 16 : 32;
+
+    // The first FAT has to hold an entry for every cluster
+    fatbytes = (LONGLONG)fatsz * v->Sector;
+    if (fatbytes < ((LONGLONG)v->Clusters + 2) * v->Bits / 8 + 1 || fatbytes > 0x7FFFFFFF)
+        return FALSE;
+
+    if ((buff = VirtualAlloc(NULL, (SIZE_T)fatbytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        return FALSE;
+
+    for (pos = 0; pos < fatbytes; pos += len) {
+        len = (DWORD)min(fatbytes - pos, (LONGLONG)FAT_PIECE);
+        if (!read_at(h, buff + pos, len, offset + (LONGLONG)reserved * v->Sector + pos, &ret) || ret != len)
+            goto done;
+    }
+
+    // Boot sector, reserved sectors, FATs and root directory, then runs of used clusters
+    if (!fat_extent(out, count, &max, 0, v->Data))
+        goto done;
+
+    for (c = 2; c < v->Clusters + 2; c++) {
+        ret = fat_entry(buff, v->Bits, c);
+        if (!ret || ret == ((v->Bits == 12) ? 0xFF7 : (v->Bits == 16) ? 0xFFF7 : 0x0FFFFFF7))
+            continue;
+
+        v->Used++;
+        start = v->Data + (LONGLONG)(c - 2) * v->Cluster;
+        end = min(start + v->Cluster, length);
+        if (start >= length)
+            break;
+        if (!fat_extent(out, count, &max, start, end))
+            goto done;
+    }
+
+    for (c = 0; c < *count; c++)
+        v->Length += (*out)[c].End - (*out)[c].Start;
+    ok = TRUE;
+
+done:
+    VirtualFree(buff, 0, MEM_RELEASE);
+    if (!ok && *out) {
+        HeapFree(GetProcessHeap(), 0, *out);
+        *out = NULL;
+        *count = 0;
+    }
+    return ok;
+}
@@ -0,0 +1,385 @@
+// Checksums and digests shared by diskdump and diskrestore
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <emmintrin.h>
+#elif defined(_M_ARM64)
+#include <intrin.h>
+#include <arm64intr.h>
+#endif
+#include <bcrypt.h>
+#include <ctype.h>
+
+#pragma comment(lib, "bcrypt.lib")
+
+// CRC32C (Castagnoli). Uses the SSE4.2 / ARMv8 crc32c instructions when present,
+// slicing-by-8 tables otherwise. Pass 0 to start, previous result to continue.
+DWORD       crc32c_table[8][256];
+BOOL        crc32c_hw;
+INIT_ONCE   crc32c_once = INIT_ONCE_STATIC_INIT;
+
+BOOL CALLBACK crc32c_init(PINIT_ONCE once, PVOID param, PVOID* ctx) {
+    DWORD i, j, c;
+#if defined(_M_X64) || defined(_M_IX86)
+    int r[4];
+
+    __cpuid(r, 1);
+    crc32c_hw = (r[2] & (1 << 20)) != 0;
+#elif defined(_M_ARM64)
+    crc32c_hw = IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE);
+#endif
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++)
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        crc32c_table[0][i] = c;
+    }
+
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xFF];
+
+    return TRUE;
+}
+
+DWORD crc32c(DWORD crc, const void* buff, SIZE_T len) {
+    const BYTE* p = buff;
+    ULONGLONG v;
+
+    InitOnceExecuteOnce(&crc32c_once, crc32c_init, NULL, NULL);
+    crc = ~crc;
+
+    if (crc32c_hw) {
+#if defined(_M_X64)
+        for (; len >= 8; len -= 8, p += 8)
+            crc = (DWORD)_mm_crc32_u64(crc, *(const ULONGLONG UNALIGNED*)p);
+#elif defined(_M_IX86)
+        for (; len >= 4; len -= 4, p += 4)
+            crc = _mm_crc32_u32(crc, *(const DWORD UNALIGNED*)p);
+#elif defined(_M_ARM64)
+        for (; len >= 8; len -= 8, p += 8)
+            crc = __crc32cd(crc, *(const ULONGLONG UNALIGNED*)p);
+#endif
+    }
+
+    for (; len >= 8; len -= 8, p += 8) {
+        v = *(const ULONGLONG UNALIGNED*)p ^ crc;
+        crc = crc32c_table[7][v & 0xFF] ^ crc32c_table[6][(v >> 8) & 0xFF] ^
+              crc32c_table[5][(v >> 16) & 0xFF] ^ crc32c_table[4][(v >> 24) & 0xFF] ^
+              crc32c_table[3][(v >> 32) & 0xFF] ^ crc32c_table[2][(v >> 40) & 0xFF] ^
+              crc32c_table[1][(v >> 48) & 0xFF] ^ crc32c_table[0][v >> 56];
+    }
+
+    for (; len; len--, p++)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p) & 0xFF];
+
+    return ~crc;
+}
+
+// XXH3 64 bit, seed 0 and the default secret, bit exact with XXH3_64bits() of xxHash 0.8
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1 0x165667919E3779F9ULL
+#define XXH_PRIME_MX2 0x9FB21C651E98DF25ULL
+
+const BYTE xxh3_secret[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+#define XXH_READ32(p) (*(const DWORD UNALIGNED*)(p))
+#define XXH_READ64(p) (*(const ULONGLONG UNALIGNED*)(p))
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+ULONGLONG xxh3_mul128_fold64(ULONGLONG a, ULONGLONG b) {
+#if defined(_M_X64)
+    ULONGLONG hi, lo = _umul128(a, b, &hi);
+    return lo ^ hi;
+#elif defined(_M_ARM64)
+    return (a * b) ^ __umulh(a, b);
+#else
+    ULONGLONG ll = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    ULONGLONG hl = (a >> 32) * (b & 0xFFFFFFFF);
+    ULONGLONG lh = (a & 0xFFFFFFFF) * (b >> 32);
+    ULONGLONG hh = (a >> 32) * (b >> 32);
+    ULONGLONG cross = (ll >> 32) + (hl & 0xFFFFFFFF) + lh;
+    return ((cross << 32) | (ll & 0xFFFFFFFF)) ^ (hh + (hl >> 32) + (cross >> 32));
+#endif
+}
+
+ULONGLONG xxh3_avalanche(ULONGLONG h) {
+    h ^= h >> 37;
+    h *= XXH_PRIME_MX1;
+    return h ^ (h >> 32);
+}
+
+ULONGLONG xxh64_avalanche(ULONGLONG h) {
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+ULONGLONG xxh3_mix16(const BYTE* p, const BYTE* secret) {
+    return xxh3_mul128_fold64(XXH_READ64(p) ^ XXH_READ64(secret), XXH_READ64(p + 8) ^ XXH_READ64(secret + 8));
+}
+
+// One 64 byte stripe into the 8 accumulators
+void xxh3_accumulate(ULONGLONG* acc, const BYTE* p, const BYTE* secret) {
+#if defined(_M_X64) || defined(_M_IX86)
+    __m128i* xacc = (__m128i*)acc;
+    __m128i data, key;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        data = _mm_loadu_si128((const __m128i*)(p + i * 16));
+        key = _mm_xor_si128(data, _mm_loadu_si128((const __m128i*)(secret + i * 16)));
+        xacc[i] = _mm_add_epi64(
+            _mm_mul_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1))),
+            _mm_add_epi64(xacc[i], _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2)))
+        );
+    }
+#else
+    ULONGLONG data, key;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        data = XXH_READ64(p + i * 8);
+        key = data ^ XXH_READ64(secret + i * 8);
+        acc[i ^ 1] += data;
+        acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+#endif
+}
+
+void xxh3_scramble(ULONGLONG* acc, const BYTE* secret) {
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= XXH_READ64(secret + i * 8);
+        acc[i] *= XXH_PRIME32_1;
+    }
+}
+
+ULONGLONG xxh3_long(const BYTE* p, SIZE_T len) {
+    __declspec(align(16)) ULONGLONG acc[8] = {
+        XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+        XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1
+    };
+    SIZE_T blocks = (len - 1) / 1024, stripes, b, n;
+    ULONGLONG h = len * XXH_PRIME64_1;
+
+    // 16 stripes per block, each one takes the secret 8 bytes further
+    for (b = 0; b < blocks; b++) {
+        for (n = 0; n < 16; n++)
+            xxh3_accumulate(acc, p + b * 1024 + n * 64, xxh3_secret + n * 8);
+        xxh3_scramble(acc, xxh3_secret + sizeof(xxh3_secret) - 64);
+    }
+
+    stripes = ((len - 1) - blocks * 1024) / 64;
+    for (n = 0; n < stripes; n++)
+        xxh3_accumulate(acc, p + blocks * 1024 + n * 64, xxh3_secret + n * 8);
+    xxh3_accumulate(acc, p + len - 64, xxh3_secret + sizeof(xxh3_secret) - 64 - 7);
+
+    for (n = 0; n < 4; n++)
+        h += xxh3_mul128_fold64(acc[2 * n] ^ XXH_READ64(xxh3_secret + 11 + n * 16), acc[2 * n + 1] ^ XXH_READ64(xxh3_secret + 11 + n * 16 + 8));
+
+    return xxh3_avalanche(h);
+}
+
+ULONGLONG xxh3(const void* buff, SIZE_T len) {
+    const BYTE* p = buff;
+    const BYTE* k = xxh3_secret;
+    ULONGLONG h, lo, hi;
+    SIZE_T i;
+
+    if (len == 0)
+        return xxh64_avalanche(XXH_READ64(k + 56) ^ XXH_READ64(k + 64));
+
+    if (len <= 3)
+        return xxh64_avalanche((((DWORD)p[0] << 16) | ((DWORD)p[len >> 1] << 24) | p[len - 1] | ((DWORD)len << 8)) ^ (ULONGLONG)(XXH_READ32(k) ^ XXH_READ32(k + 4)));
+
+    if (len <= 8) {
+        h = (XXH_READ32(p + len - 4) + ((ULONGLONG)XXH_READ32(p) << 32)) ^ (XXH_READ64(k + 8) ^ XXH_READ64(k + 16));
+        h ^= XXH_ROTL64(h, 49) ^ XXH_ROTL64(h, 24);
+        h *= XXH_PRIME_MX2;
+        h ^= (h >> 35) + len;
+        h *= XXH_PRIME_MX2;
+        return h ^ (h >> 28);
+    }
+
+    if (len <= 16) {
+        lo = XXH_READ64(p) ^ (XXH_READ64(k + 24) ^ XXH_READ64(k + 32));
+        hi = XXH_READ64(p + len - 8) ^ (XXH_READ64(k + 40) ^ XXH_READ64(k + 48));
+        return xxh3_avalanche(len + _byteswap_uint64(lo) + hi + xxh3_mul128_fold64(lo, hi));
+    }
+
+    if (len <= 128) {
+        h = len * XXH_PRIME64_1;
+        for (i = 0; i < 4 && len > 32 * i; i++)
+            h += xxh3_mix16(p + 16 * i, k + 32 * i) + xxh3_mix16(p + len - 16 * (i + 1), k + 32 * i + 16);
+        return xxh3_avalanche(h);
+    }
+
+    if (len <= 240) {
+        h = len * XXH_PRIME64_1;
+        for (i = 0; i < 8; i++)
+            h += xxh3_mix16(p + 16 * i, k + 16 * i);
+        lo = xxh3_mix16(p + len - 16, k + 136 - 17);
+        h = xxh3_avalanche(h);
+        for (i = 8; i < len / 16; i++)
+            lo += xxh3_mix16(p + 16 * i, k + 16 * (i - 8) + 3);
+        return xxh3_avalanche(h + lo);
+    }
+
+    return xxh3_long(p, len);
+}
+
+// SHA-256 through CNG, which uses the SHA extensions of the CPU when present
+BCRYPT_ALG_HANDLE   sha256_alg;
+INIT_ONCE           sha256_once = INIT_ONCE_STATIC_INIT;
+
+BOOL CALLBACK sha256_init(PINIT_ONCE once, PVOID param, PVOID* ctx) {
+    return BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&sha256_alg, BCRYPT_SHA256_ALGORITHM, NULL, 0));
+}
+
+BOOL sha256(const void* buff, SIZE_T len, BYTE* digest) {
+    BCRYPT_HASH_HANDLE h = NULL;
+    BOOL ok;
+
+    if (!InitOnceExecuteOnce(&sha256_once, sha256_init, NULL, NULL))
+        return FALSE;
+
+    ok = BCRYPT_SUCCESS(BCryptCreateHash(sha256_alg, &h, NULL, 0, NULL, 0, 0)) &&
+         BCRYPT_SUCCESS(BCryptHashData(h, (PUCHAR)buff, (ULONG)len, 0)) &&
+         BCRYPT_SUCCESS(BCryptFinishHash(h, digest, 32, 0));
+
+    if (h)
+        BCryptDestroyHash(h);
+
+    return ok;
+}
+
+// Digests by name, first one is the default. CRC32C and XXH3 are stored big endian
+// so their hex form reads the same as the number.
+enum { HASH_NONE, HASH_XXH3, HASH_CRC32C, HASH_SHA256 };
+
+#define HASH_MAX 32             // largest digest in bytes
+
+struct {
+    WCHAR*      Name;
+    int         Algorithm;
+    DWORD       Size;
+} hash_algorithms[] = {
+    { L"xxh3",   HASH_XXH3,   8 },
+    { L"crc32c", HASH_CRC32C, 4 },
+    { L"sha256", HASH_SHA256, 32 },
+};
+
+WCHAR* hash_name(int algorithm) {
+    int i;
+
+    for (i = 0; i < ARRAYSIZE(hash_algorithms); i++)
+        if (hash_algorithms[i].Algorithm == algorithm)
+            return hash_algorithms[i].Name;
+
+    return L"none";
+}
+
+int hash_algorithm(WCHAR* name) {
+    int i;
+
+    if (!name || !*name)
+        return hash_algorithms[0].Algorithm;
+
+    for (i = 0; i < ARRAYSIZE(hash_algorithms); i++)
+        if (_wcsicmp(hash_algorithms[i].Name, name) == 0)
+            return hash_algorithms[i].Algorithm;
+
+    return HASH_NONE;
+}
+
+DWORD hash_size(int algorithm) {
+    int i;
+
+    for (i = 0; i < ARRAYSIZE(hash_algorithms); i++)
+        if (hash_algorithms[i].Algorithm == algorithm)
+            return hash_algorithms[i].Size;
+
+    return 0;
+}
+
+// Digest of a buffer, hash_size() bytes. Safe to call from many threads at once.
+BOOL hash(int algorithm, const void* buff, SIZE_T len, BYTE* digest) {
+    ULONGLONG v;
+    int i;
+
+    switch (algorithm) {
+    case HASH_XXH3:
+        v = xxh3(buff, len);
+        for (i = 0; i < 8; i++)
+            digest[i] = (BYTE)(v >> (56 - 8 * i));
+        return TRUE;
+    case HASH_CRC32C:
+        v = crc32c(0, buff, len);
+        for (i = 0; i < 4; i++)
+            digest[i] = (BYTE)(v >> (24 - 8 * i));
+        return TRUE;
+    case HASH_SHA256:
+        return sha256(buff, len, digest);
+    }
+
+    return FALSE;
+}
+
+// Lower case hex of a digest, out must hold 2 * len + 1 chars
+char* hash_hex(const BYTE* digest, DWORD len, char* out) {
+    DWORD i;
+
+    for (i = 0; i < len; i++) {
+        out[2 * i] = "0123456789abcdef"[digest[i] >> 4];
+        out[2 * i + 1] = "0123456789abcdef"[digest[i] & 15];
+    }
+    out[2 * len] = '\0';
+
+    return out;
+}
+
+// Digest from hex, FALSE unless it is exactly len bytes
+BOOL hash_unhex(const char* hex, DWORD len, BYTE* digest) {
+    DWORD i;
+    int d[2], j;
+
+    for (i = 0; i < len; i++) {
+        for (j = 0; j < 2; j++) {
+            char c = hex[2 * i + j];
+            d[j] = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+            if (d[j] < 0)
+                return FALSE;
+        }
+        digest[i] = (BYTE)(d[0] << 4 | d[1]);
+    }
+
+    return !isxdigit((unsigned char)hex[2 * len]);
+}
@@ -0,0 +1,144 @@
+// Compressed disk image container shared by diskdump and diskrestore
+//
+// The image is split in fixed size chunks, each compressed on its own with
+// the Windows Compression API so chunks can be packed and unpacked in
+// parallel. Layout:
+//
+//   IMGZ_HEADER
+//   IMGZ_CHUNK + payload    repeated, payload is stored raw when
+//   ...                     it does not compress (Packed == Length)
+//   IMGZ_INDEX              one per chunk, if IMGZ_INDEXED is set
+//   ...
+//   IMGZ_TRAILER            last bytes of the file, locates the index
+//
+// The index makes the image seekable: chunk N holds image bytes starting
+// at N * ChunkSize, so any range can be restored by reading just the chunks
+// that cover it. It also carries a CRC32C of every unpacked chunk. Images
+// without the index can still be read from start to end.
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#include <compressapi.h>
+
+#define IMGZ_MAGIC "DISKIMGZ"
+#define IMGZ_VERSION 1
+#define IMGZ_END "DIMGZEND"
+
+#define IMGZ_INDEXED 1          // IMGZ_HEADER Flags, index and trailer present
+
+#pragma pack(push, 1)
+typedef struct {
+    BYTE        Magic[8];       // IMGZ_MAGIC
+    DWORD       Version;        // IMGZ_VERSION
+    DWORD       Algorithm;      // COMPRESS_ALGORITHM_*
+    DWORD       ChunkSize;      // uncompressed bytes per chunk, last one may be shorter
+    DWORD       Flags;          // IMGZ_INDEXED
+    ULONGLONG   Length;         // uncompressed image length, 0 while being written
+} IMGZ_HEADER;
+
+typedef struct {
+    DWORD       Packed;         // payload bytes that follow
+    DWORD       Length;         // uncompressed bytes
+} IMGZ_CHUNK;
+
+typedef struct {
+    ULONGLONG   Offset;         // file offset of the IMGZ_CHUNK
+    DWORD       Packed;         // payload bytes
+    DWORD       Crc;            // CRC32C of the unpacked chunk
+} IMGZ_INDEX;
+
+typedef struct {
+    ULONGLONG   Index;          // file offset of the first IMGZ_INDEX
+    DWORD       Count;          // number of chunks
+    DWORD       Crc;            // CRC32C of the whole index
+    BYTE        Magic[8];       // IMGZ_END
+} IMGZ_TRAILER;
+#pragma pack(pop)
+
+// The Compression API is in cabinet.dll from Windows 8 on. It is looked up when an image is packed
+// or unpacked rather than imported, so the tools still start on Windows 7 for plain images.
+struct {
+    BOOL (WINAPI* CreateCompressor)(DWORD, PVOID, COMPRESSOR_HANDLE*);
+    BOOL (WINAPI* Compress)(COMPRESSOR_HANDLE, LPCVOID, SIZE_T, PVOID, SIZE_T, SIZE_T*);
+    BOOL (WINAPI* CloseCompressor)(COMPRESSOR_HANDLE);
+    BOOL (WINAPI* CreateDecompressor)(DWORD, PVOID, DECOMPRESSOR_HANDLE*);
+    BOOL (WINAPI* Decompress)(DECOMPRESSOR_HANDLE, LPCVOID, SIZE_T, PVOID, SIZE_T, SIZE_T*);
+    BOOL (WINAPI* CloseDecompressor)(DECOMPRESSOR_HANDLE);
+} imgz_api;
+
+// FALSE if cabinet.dll or one of its entry points is missing
+BOOL imgz_load(void) {
+    HMODULE m;
+
+    if (imgz_api.CloseDecompressor)
+        return TRUE;
+
+    if ((m = LoadLibraryW(L"cabinet.dll")) == NULL)
+        return FALSE;
+
+    *(FARPROC*)&imgz_api.CreateCompressor = GetProcAddress(m, "CreateCompressor");
+    *(FARPROC*)&imgz_api.Compress = GetProcAddress(m, "Compress");
+    *(FARPROC*)&imgz_api.CloseCompressor = GetProcAddress(m, "CloseCompressor");
+    *(FARPROC*)&imgz_api.CreateDecompressor = GetProcAddress(m, "CreateDecompressor");
+    *(FARPROC*)&imgz_api.Decompress = GetProcAddress(m, "Decompress");
+    *(FARPROC*)&imgz_api.CloseDecompressor = GetProcAddress(m, "CloseDecompressor");
+
+    if (!imgz_api.CreateCompressor || !imgz_api.Compress || !imgz_api.CloseCompressor ||
+        !imgz_api.CreateDecompressor || !imgz_api.Decompress || !imgz_api.CloseDecompressor) {
+        ZeroMemory(&imgz_api, sizeof(imgz_api));
+        FreeLibrary(m);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Compression algorithms by name, first one is the default
+struct {
+    WCHAR*      Name;
+    DWORD       Algorithm;
+} imgz_algorithms[] = {
+    { L"huff",   COMPRESS_ALGORITHM_XPRESS_HUFF },
+    { L"xpress", COMPRESS_ALGORITHM_XPRESS },
+    { L"mszip",  COMPRESS_ALGORITHM_MSZIP },
+    { L"lzms",   COMPRESS_ALGORITHM_LZMS },
+};
+
+WCHAR* imgz_name(DWORD algorithm) {
+    int i;
+
+    for (i = 0; i < ARRAYSIZE(imgz_algorithms); i++)
+        if (imgz_algorithms[i].Algorithm == algorithm)
+            return imgz_algorithms[i].Name;
+
+    return L"unknown";
+}
+
+DWORD imgz_algorithm(WCHAR* name) {
+    int i;
+
+    if (!name || !*name)
+        return imgz_algorithms[0].Algorithm;
+
+    for (i = 0; i < ARRAYSIZE(imgz_algorithms); i++)
+        if (_wcsicmp(imgz_algorithms[i].Name, name) == 0)
+            return imgz_algorithms[i].Algorithm;
+
+    return 0;
+}
+
+// Recognize images compressed by other tools from their first bytes, NULL if none
+WCHAR* imgz_foreign(BYTE* p, DWORD len) {
+    if (len >= 2 && p[0] == 0x1F && p[1] == 0x8B)
+        return L"gzip";
+    if (len >= 4 && p[0] == 0x28 && p[1] == 0xB5 && p[2] == 0x2F && p[3] == 0xFD)
+        return L"zstd";
+    if (len >= 6 && memcmp(p, "\xFD" "7zXZ\0", 6) == 0)
+        return L"xz";
+    if (len >= 3 && memcmp(p, "BZh", 3) == 0)
+        return L"bzip2";
+    if (len >= 4 && memcmp(p, "LZIP", 4) == 0)
+        return L"lzip";
+
+    return NULL;
+}
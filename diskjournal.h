@@ -0,0 +1,146 @@
+// Checkpoint journal shared by diskdump and diskrestore
+//
+// Long jobs flush what they have written every few seconds and then append a
+// checkpoint, so an interrupted job continues from the last durable write
+// instead of from the start. The journal is a text file:
+//
+//   key value               identity of the job, has to match to resume
+//   ...
+//   chunk <n> <hex>         digest of chunk n, the running hash state
+//   ...
+//   commit <offset> <chunks> end
+//                           everything before offset is durable, so are the
+//                           digests of the first chunks
+//
+// Lines are only ever appended. A line torn by a crash does not parse and is
+// ignored, so the last complete commit wins. Include after diskhash.h.
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#include <io.h>
+
+#define JOURNAL_PERIOD 5000     // ms between checkpoints
+
+typedef struct {
+    WCHAR       Name[MAX_PATH]; // empty when journaling is off
+    FILE*       File;
+    char        Header[4096];   // identity of the job, key value lines
+    LONGLONG    Committed;      // durable offset
+    DWORD       Chunks;         // chunk digests journaled or read back
+    DWORD       Size;           // digest bytes, 0 for none
+    BYTE*       Digest;         // digests read back by journal_load
+    DWORD       Max;
+    ULONGLONG   Saved;          // tick count of the last checkpoint
+} JOURNAL;
+
+// Adds a line to the identity of the job
+void journal_key(JOURNAL* j, const char* fmt, ...) {
+    va_list valist;
+    size_t n = strlen(j->Header);
+
+    va_start(valist, fmt);
+    _vsnprintf(j->Header + n, sizeof(j->Header) - n - 2, fmt, valist);
+    va_end(valist);
+
+    strcat(j->Header, "\n");
+}
+
+// Reads back the last checkpoint. 1 when done, 0 if there is no journal, -1 if it belongs to
+// another job or is damaged.
+int journal_load(JOURNAL* j) {
+    FILE* f;
+    char line[512], header[sizeof(j->Header)] = { 0 }, hex[2 * HASH_MAX + 1], end[8];
+    LONGLONG offset;
+    DWORD n, chunks = 0;
+    BOOL body = FALSE;
+
+    if ((f = _wfopen(j->Name, L"r")) == NULL)
+        return 0;
+
+    j->Committed = 0;
+    j->Chunks = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        // Chunks are journaled in order, a digest may be repeated after a resume
+        if (strncmp(line, "chunk ", 6) == 0) {
+            body = TRUE;
+            if (!j->Size || sscanf(line, "chunk %u %64s", &n, hex) != 2 || n > chunks || strlen(hex) != 2 * j->Size)
+                continue;
+
+            if (n == j->Max) {
+                j->Max = (j->Max) ? j->Max * 2 : 4096;
+                j->Digest = (j->Digest) ? HeapReAlloc(GetProcessHeap(), 0, j->Digest, j->Max * j->Size) : HeapAlloc(GetProcessHeap(), 0, j->Max * j->Size);
+                if (j->Digest == NULL)
+                    break;
+            }
+
+            if (hash_unhex(hex, j->Size, j->Digest + n * j->Size) && n == chunks)
+                chunks++;
+        }
+        else if (strncmp(line, "commit ", 7) == 0) {
+            body = TRUE;
+            if (sscanf(line, "commit %lld %u %7s", &offset, &n, end) != 3 || strcmp(end, "end") != 0 || n > chunks)
+                continue;
+
+            j->Committed = offset;
+            j->Chunks = n;
+        }
+        else if (!body && strlen(header) + strlen(line) < sizeof(header)) {
+            strcat(header, line);
+        }
+    }
+
+    fclose(f);
+
+    return (strcmp(header, j->Header) == 0 && (j->Digest || !chunks)) ? 1 : -1;
+}
+
+// Starts a new journal, or appends to the one read back when resuming. FALSE if it cannot be written.
+BOOL journal_open(JOURNAL* j, BOOL resume) {
+    if ((j->File = _wfopen(j->Name, (resume) ? L"a" : L"w")) == NULL)
+        return FALSE;
+
+    // The last line may have been torn, start on a fresh one
+    if (resume)
+        fputs("\n", j->File);
+    else
+        fprintf(j->File, "# DiskDump v1.3 journal\n%s", j->Header);
+
+    j->Saved = GetTickCount64();
+    return fflush(j->File) == 0 && _commit(_fileno(j->File)) == 0;
+}
+
+// Records that everything before offset is durable, along with the digests of the first chunks.
+// The caller flushes the target first.
+BOOL journal_commit(JOURNAL* j, LONGLONG offset, const BYTE* digest, DWORD chunks) {
+    char hex[2 * HASH_MAX + 1];
+
+    for (; j->Size && j->Chunks < chunks; j->Chunks++)
+        fprintf(j->File, "chunk %u %s\n", j->Chunks, hash_hex(digest + j->Chunks * j->Size, j->Size, hex));
+
+    fprintf(j->File, "commit %lld %u end\n", offset, chunks);
+
+    j->Saved = GetTickCount64();
+    if (fflush(j->File) != 0 || _commit(_fileno(j->File)) != 0)
+        return FALSE;
+
+    j->Committed = offset;
+    return TRUE;
+}
+
+// Closes the journal, a finished job does not need it any more
+void journal_close(JOURNAL* j, BOOL done) {
+    if (j->File)
+        fclose(j->File);
+    j->File = NULL;
+
+    if (done)
+        DeleteFileW(j->Name);
+
+    if (j->Digest)
+        HeapFree(GetProcessHeap(), 0, j->Digest);
+    j->Digest = NULL;
+}
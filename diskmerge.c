@@ -0,0 +1,206 @@
+// DiskMerge 1.0
+// Replays a base image and a chain of diskdump --base deltas into a full image
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include <stdarg.h>
+
+#include "diskhash.h"
+#include "diskdelta.h"
+
+#define BUFFER_SIZE (1 << 20) // 1 MB
+
+#define WIDEN2(x) L ## x
+#define WIDEN(x) WIDEN2(x)
+#define __WDATE__ WIDEN(__DATE__)
+#define __WTIME__ WIDEN(__TIME__)
+
+#define USAGE L"Usage: diskmerge <output> <base> <delta> [delta ...]\n\n"\
+              L"Writes <base> with the changes of every <delta> applied in order to <output>\n\n"\
+              L"Base is a raw image, deltas are written by diskdump --base. Output can be the\n"\
+              L"base itself to apply the deltas in place. The chain is checked against the\n"\
+              L"image digests recorded in every delta and the manifest of the base if present.\n"\
+              L"The manifest of the last delta is copied next to the output, so it can be the\n"\
+              L"base of the next diskdump --base.\n\n"
+
+void error(int exit, WCHAR* msg, ...) {
+    va_list valist;
+    WCHAR vaBuff[1024] = { L'\0' };
+    WCHAR errBuff[1024] = { L'\0' };
+    DWORD err;
+
+    err = GetLastError();
+
+    va_start(valist, msg);
+    vswprintf(vaBuff, ARRAYSIZE(vaBuff), msg, valist);
+    va_end(valist);
+
+    wprintf(L"\n\n%s: %s\n", (exit) ? L"ERROR" : L"WARNING", vaBuff);
+
+    if (err) {
+        FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS | FORMAT_MESSAGE_MAX_WIDTH_MASK, NULL, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), errBuff, ARRAYSIZE(errBuff), NULL);
+        wprintf(L"[0x%08X] %s\n\n", err, errBuff);
+    }
+    else {
+        putchar(L'\n');
+    }
+
+    FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
+
+    if (exit)
+        ExitProcess(1);
+}
+
+// Synchronous read or write at given offset
+BOOL io_at(HANDLE h, LPVOID buff, DWORD len, LONGLONG offset, BOOL write) {
+    OVERLAPPED ovl = { 0 };
+    DWORD ret = 0;
+    BOOL ok;
+
+    ovl.Offset = (DWORD)offset;
+    ovl.OffsetHigh = (DWORD)(offset >> 32);
+
+    if (write)
+        ok = WriteFile(h, buff, len, &ret, &ovl);
+    else
+        ok = ReadFile(h, buff, len, &ret, &ovl);
+
+    return ok && ret == len;
+}
+
+int wmain(int argc, WCHAR* argv[]) {
+    HANDLE                  hOut;
+    HANDLE                  hDelta;
+    WCHAR                   OutPath[MAX_PATH];
+    WCHAR                   BasePath[MAX_PATH];
+    WCHAR                   From[MAX_PATH];
+    WCHAR                   To[MAX_PATH];
+    WCHAR*                  OutName;
+    WCHAR*                  BaseName;
+    BYTE*                   Buff;
+    DELTA_HEADER*           Delta;
+    DELTA_EXTENT*           Extent;
+    MANIFEST                Base;
+    LARGE_INTEGER           Length;
+    LONGLONG                Pos;
+    LONGLONG                Applied = 0;
+    DWORD                   Deltas, Size, Len;
+    DWORD                   i, j;
+    char                    Hex[2 * HASH_MAX + 1];
+
+    wprintf(L"DiskMerge v1.0, Build %s %s\n\n", __WDATE__, __WTIME__);
+
+    if (argc < 4)
+        error(1, L"Wrong number of parameters [argc=%d]\n\n%s\n", argc, USAGE);
+
+    OutName = argv[1];
+    BaseName = argv[2];
+    Deltas = argc - 3;
+
+    Delta = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, Deltas * sizeof(DELTA_HEADER));
+    Buff = HeapAlloc(GetProcessHeap(), 0, BUFFER_SIZE);
+    if (Delta == NULL || Buff == NULL)
+        error(1, L"Unable to allocate memory");
+
+    // Check the whole chain before touching the output
+    for (i = 0; i < Deltas; i++) {
+        if ((hDelta = CreateFileW(argv[3 + i], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL)) == INVALID_HANDLE_VALUE)
+            error(1, L"Unable to open delta %s", argv[3 + i]);
+
+        if (!io_at(hDelta, &Delta[i], sizeof(DELTA_HEADER), 0, FALSE) ||
+            memcmp(Delta[i].Magic, DELTA_MAGIC, sizeof(Delta[i].Magic)) != 0 || Delta[i].Version != DELTA_VERSION || !Delta[i].Map)
+            error(1, L"File %s is not a delta or it is incomplete", argv[3 + i]);
+
+        CloseHandle(hDelta);
+
+        Size = hash_size(Delta[i].Hash);
+        if (i && (Delta[i].Hash != Delta[i - 1].Hash || memcmp(Delta[i].Base, Delta[i - 1].Tree, Size) != 0))
+            error(1, L"Delta %s is not based on %s", argv[3 + i], argv[2 + i]);
+
+        wprintf(L"Delta %s %u extents, %llu bytes, %s %S\n", argv[3 + i], Delta[i].Count, Delta[i].Length, hash_name(Delta[i].Hash), hash_hex(Delta[i].Tree, Size, Hex));
+    }
+
+    if (!load_manifest(BaseName, &Base))
+        error(0, L"No manifest for base %s, unable to check that the first delta belongs to it", BaseName);
+    else if (Base.Algorithm != Delta[0].Hash || memcmp(Base.Tree, Delta[0].Base, Base.Size) != 0)
+        error(1, L"Delta %s is not based on %s", argv[3], BaseName);
+
+    // Start from a copy of the base unless the deltas are applied in place
+    GetFullPathNameW(OutName, ARRAYSIZE(OutPath), OutPath, NULL);
+    GetFullPathNameW(BaseName, ARRAYSIZE(BasePath), BasePath, NULL);
+
+    if (_wcsicmp(OutPath, BasePath) != 0) {
+        wprintf(L"Copying %s to %s...\n", BaseName, OutName);
+        if (!CopyFileW(BaseName, OutName, FALSE))
+            error(1, L"Unable to copy %s to %s", BaseName, OutName);
+    }
+
+    if ((hOut = CreateFileW(OutName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE)
+        error(1, L"Unable to open file %s", OutName);
+
+    for (i = 0; i < Deltas; i++) {
+        if ((hDelta = CreateFileW(argv[3 + i], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL)) == INVALID_HANDLE_VALUE)
+            error(1, L"Unable to open delta %s", argv[3 + i]);
+
+        if ((Extent = HeapAlloc(GetProcessHeap(), 0, max(Delta[i].Count, 1) * sizeof(DELTA_EXTENT))) == NULL)
+            error(1, L"Unable to allocate memory");
+
+        if (Delta[i].Count && !io_at(hDelta, Extent, Delta[i].Count * sizeof(DELTA_EXTENT), Delta[i].Map, FALSE))
+            error(1, L"Error reading extent map of %s", argv[3 + i]);
+
+        for (j = 0; j < Delta[i].Count; j++) {
+            if (Extent[j].Offset + Extent[j].Length > Delta[i].Length || Extent[j].Data + Extent[j].Length > Delta[i].Map)
+                error(1, L"Corrupt extent map in delta %s", argv[3 + i]);
+
+            for (Pos = 0; Pos < (LONGLONG)Extent[j].Length; Pos += Len) {
+                Len = (DWORD)min((LONGLONG)BUFFER_SIZE, (LONGLONG)Extent[j].Length - Pos);
+
+                if (!io_at(hDelta, Buff, Len, Extent[j].Data + Pos, FALSE))
+                    error(1, L"Error reading delta %s", argv[3 + i]);
+                if (!io_at(hOut, Buff, Len, Extent[j].Offset + Pos, TRUE))
+                    error(1, L"Error writing to file %s", OutName);
+            }
+
+            Applied += Extent[j].Length;
+        }
+
+        wprintf(L"Applied %s [%.1f MB] (%llu bytes)               \r", argv[3 + i], (float)Applied / (float)(1 << 20), Applied);
+        FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
+
+        HeapFree(GetProcessHeap(), 0, Extent);
+        CloseHandle(hDelta);
+    }
+
+    // Image may have grown or shrunk with the device
+    Length.QuadPart = Delta[Deltas - 1].Length;
+    if (!SetFilePointerEx(hOut, Length, NULL, FILE_BEGIN) || !SetEndOfFile(hOut))
+        error(1, L"Unable to set length of %s", OutName);
+
+    FlushFileBuffers(hOut);
+    CloseHandle(hOut);
+
+    swprintf(From, ARRAYSIZE(From), L"%s.manifest", argv[argc - 1]);
+    swprintf(To, ARRAYSIZE(To), L"%s.manifest", OutName);
+    if (GetFileAttributesW(From) != INVALID_FILE_ATTRIBUTES && !CopyFileW(From, To, FALSE))
+        error(0, L"Unable to copy manifest %s to %s", From, To);
+
+    wprintf(L"\rDone! %u deltas, %.1f MB (%llu bytes) applied, image %llu bytes %s %S\n",
+        Deltas,
+        (float)Applied / (float)(1 << 20),
+        Applied,
+        Length.QuadPart,
+        hash_name(Delta[Deltas - 1].Hash),
+        hash_hex(Delta[Deltas - 1].Tree, hash_size(Delta[Deltas - 1].Hash), Hex)
+    );
+
+    if (Base.Digest)
+        HeapFree(GetProcessHeap(), 0, Base.Digest);
+    HeapFree(GetProcessHeap(), 0, Delta);
+    HeapFree(GetProcessHeap(), 0, Buff);
+
+    return 0;
+}
@@ -0,0 +1,282 @@
+// MBR and GPT partition tables shared by diskdump and diskrestore
+//
+// Partitions are numbered as Linux and partmount.sh do: MBR primaries 1-4 by slot, logical
+// partitions of the extended one from 5 on, GPT entries by slot. The sectors holding the tables
+// themselves (MBR, extended boot records, both GPT headers and entry arrays) are kept as well,
+// an image of selected partitions has to carry them to be mountable.
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#define PARTS 128               // partitions and table ranges kept
+#define GPT_ENTRIES 1024        // most GPT entries read
+
+typedef struct {
+    DWORD       Number;
+    LONGLONG    Start;      // bytes from the start of the disk
+    LONGLONG    Length;
+    char        Type[40];   // MBR type byte or GPT type name or GUID
+    WCHAR       Name[37];   // GPT partition name
+} PART;
+
+typedef struct {
+    LONGLONG    Start;
+    LONGLONG    End;
+} EXTENT;
+
+typedef struct {
+    DWORD       Sector;     // logical sector size the table is written for
+    BOOL        Gpt;
+    DWORD       Count;
+    PART        Part[PARTS];
+    DWORD       Tables;
+    EXTENT      Table[PARTS];
+} LAYOUT;
+
+// Well known GPT partition types, anything else is shown by its GUID
+const struct { char* Guid; char* Name; } gpt_types[] = {
+    { "C12A7328-F81F-11D2-BA4B-00A0C93EC93B", "EFI System" },
+    { "E3C9E316-0B5C-4DB8-817D-F92DF00215AE", "Microsoft reserved" },
+    { "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7", "Basic data" },
+    { "DE94BBA4-06D1-4D40-A16A-BFD50179D6AC", "Windows recovery" },
+    { "0FC63DAF-8483-4772-8E79-3D69D8477DE4", "Linux filesystem" },
+    { "0657FD6D-A4AB-43C4-84E5-0933C84B4F4F", "Linux swap" },
+    { "E6D6D379-F507-44C2-A23C-238F2A3DF928", "Linux LVM" },
+    { "48465300-0000-11AA-AA11-00306543ECAC", "Apple HFS+" },
+    { "7C3457EF-0000-11AA-AA11-00306543ECAC", "Apple APFS" },
+    { "21686148-6449-6E6F-744E-656564454649", "BIOS boot" },
+};
+
+// Little endian fields of the on-disk tables
+DWORD le32(BYTE* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (DWORD)p[3] << 24;
+}
+
+ULONGLONG le64(BYTE* p) {
+    return le32(p) | (ULONGLONG)le32(p + 4) << 32;
+}
+
+void layout_table(LAYOUT* l, LONGLONG start, LONGLONG length) {
+    if (l->Tables < PARTS && length > 0) {
+        l->Table[l->Tables].Start = start;
+        l->Table[l->Tables].End = start + length;
+        l->Tables++;
+    }
+}
+
+PART* layout_part(LAYOUT* l, DWORD number, LONGLONG start, LONGLONG length) {
+    PART* p;
+
+    if (l->Count == PARTS || length <= 0)
+        return NULL;
+
+    p = &l->Part[l->Count++];
+    ZeroMemory(p, sizeof(PART));
+    p->Number = number;
+    p->Start = start;
+    p->Length = length;
+    return p;
+}
+
+// Sectors read from the disk into a page aligned buffer, whole sectors as raw disks want them
+BOOL layout_read(HANDLE h, LONGLONG offset, BYTE* buff, DWORD len) {
+    DWORD ret;
+
+    return read_at(h, buff, len, offset, &ret) && ret == len;
+}
+
+// GPT at the given sector size, FALSE if there is no header there
+BOOL layout_gpt(HANDLE h, LAYOUT* l, DWORD ss, LONGLONG disklen, BYTE* buff, DWORD room) {
+    ULONGLONG alt, entries, first, last;
+    DWORD count, size, bytes, i, j;
+    BYTE* e;
+    BYTE* g;
+    PART* p;
+
+    if (!layout_read(h, ss, buff, ss) || memcmp(buff, "EFI PART", 8) != 0)
+        return FALSE;
+
+    alt = le64(buff + 32);
+    entries = le64(buff + 72);
+    count = min(le32(buff + 80), GPT_ENTRIES);
+    size = le32(buff + 84);
+
+    if (size < 128 || size > 4096 || entries < 2 || (LONGLONG)entries * ss >= disklen)
+        return FALSE;
+
+    bytes = (count * size + ss - 1) / ss * ss;
+    if (bytes > room || !layout_read(h, entries * ss, buff, bytes))
+        return FALSE;
+
+    l->Sector = ss;
+    l->Gpt = TRUE;
+
+    // Protective MBR, primary header and entries, backup entries and header at the end
+    layout_table(l, 0, (LONGLONG)entries * ss + bytes);
+    if ((LONGLONG)(alt + 1) * ss <= disklen && alt * ss > (ULONGLONG)bytes)
+        layout_table(l, (LONGLONG)alt * ss - bytes, bytes + ss);
+
+    for (i = 0; i < count; i++) {
+        e = buff + i * size;
+        first = le64(e + 32);
+        last = le64(e + 40);
+
+        for (j = 0; j < 16 && !e[j]; j++)
+            ;
+        if (j == 16 || last < first || (p = layout_part(l, i + 1, (LONGLONG)first * ss, (LONGLONG)(last - first + 1) * ss)) == NULL)
+            continue;
+
+        // Mixed endian GUID as it is written out
+        _snprintf(p->Type, sizeof(p->Type) - 1, "%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+            le32(e), e[4] | e[5] << 8, e[6] | e[7] << 8, e[8], e[9], e[10], e[11], e[12], e[13], e[14], e[15]);
+        for (j = 0; j < ARRAYSIZE(gpt_types); j++)
+            if (strcmp(p->Type, gpt_types[j].Guid) == 0)
+                strcpy(p->Type, gpt_types[j].Name);
+
+        for (j = 0, g = e + 56; j < 36 && (g[0] || g[1]); j++, g += 2)
+            p->Name[j] = g[0] | g[1] << 8;
+    }
+
+    return TRUE;
+}
+
+// Partition table of a disk or image, sector is the logical sector size of a disk or 0 for an
+// image file where it is guessed. Count is 0 when there is no table.
+BOOL layout_load(HANDLE h, DWORD sector, LONGLONG disklen, LAYOUT* l) {
+    BYTE* buff;
+    BYTE* m;
+    DWORD room = GPT_ENTRIES * 128 + 4096, i, n;
+    LONGLONG base, ebr, start;
+    PART* p;
+    BOOL ok = FALSE, gpt = FALSE;
+
+    ZeroMemory(l, sizeof(LAYOUT));
+    l->Sector = (sector) ? sector : 512;
+
+    if ((buff = VirtualAlloc(NULL, room, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        return FALSE;
+
+    if (!layout_read(h, 0, buff, l->Sector) || buff[510] != 0x55 || buff[511] != 0xAA)
+        goto done;
+
+    // Protective MBR, the GPT header is in the next sector. Images of 4K disks have it at 4096.
+    for (i = 0; i < 4; i++)
+        gpt = gpt || buff[446 + i * 16 + 4] == 0xEE;
+
+    if (gpt) {
+        ok = layout_gpt(h, l, l->Sector, disklen, buff, room) || (!sector && layout_gpt(h, l, 4096, disklen, buff, room));
+        goto done;
+    }
+
+    // The MBR is kept aside, the boot records of logical partitions are read over it
+    layout_table(l, 0, l->Sector);
+    m = buff + l->Sector;
+    CopyMemory(m, buff, l->Sector);
+
+    for (i = 0; i < 4; i++) {
+        BYTE* e = m + 446 + i * 16;
+
+        if (!e[4] || !le32(e + 12))
+            continue;
+
+        start = (LONGLONG)le32(e + 8) * l->Sector;
+        if (e[4] != 0x05 && e[4] != 0x0F && e[4] != 0x85) {
+            if ((p = layout_part(l, i + 1, start, (LONGLONG)le32(e + 12) * l->Sector)) != NULL)
+                _snprintf(p->Type, sizeof(p->Type) - 1, "MBR 0x%02X", e[4]);
+            continue;
+        }
+
+        // Extended partition, not listed itself. A chain of boot records each holding one logical
+        // partition relative to itself and a link to the next one relative to the extended one.
+        base = start;
+        for (ebr = base, n = 5; n < 5 + PARTS && layout_read(h, ebr, buff, l->Sector) && buff[510] == 0x55 && buff[511] == 0xAA; n++) {
+            layout_table(l, ebr, l->Sector);
+
+            if (buff[446 + 4] && le32(buff + 446 + 12) && (p = layout_part(l, n, ebr + (LONGLONG)le32(buff + 446 + 8) * l->Sector, (LONGLONG)le32(buff + 446 + 12) * l->Sector)) != NULL)
+                _snprintf(p->Type, sizeof(p->Type) - 1, "MBR 0x%02X", buff[446 + 4]);
+
+            if (!buff[446 + 16 + 4] || !le32(buff + 446 + 16 + 8))
+                break;
+            ebr = base + (LONGLONG)le32(buff + 446 + 16 + 8) * l->Sector;
+        }
+    }
+    ok = TRUE;
+
+done:
+    VirtualFree(buff, 0, MEM_RELEASE);
+    return ok;
+}
+
+// Prints the partitions with their start in 512 byte sectors, the unit of sect_skip
+void layout_print(LAYOUT* l) {
+    DWORD i;
+    PART* p;
+
+    wprintf(L"%s partition table, %u byte sectors\n", (l->Gpt) ? L"GPT" : L"MBR", l->Sector);
+    wprintf(L"%-4s %-14s %-14s %-10s %s\n", L"#", L"START", L"SECTORS", L"SIZE", L"TYPE");
+
+    for (i = 0; i < l->Count; i++) {
+        p = &l->Part[i];
+        wprintf(L"%-4u %-14llu %-14llu %8.1f %s %-20S %s\n",
+            p->Number,
+            p->Start / 512,
+            p->Length / 512,
+            (p->Length >= (1LL << 30)) ? (float)p->Length / (float)(1 << 30) : (float)p->Length / (float)(1 << 20),
+            (p->Length >= (1LL << 30)) ? L"GB" : L"MB",
+            p->Type,
+            p->Name
+        );
+    }
+}
+
+PART* layout_find(LAYOUT* l, DWORD number) {
+    DWORD i;
+
+    for (i = 0; i < l->Count; i++)
+        if (l->Part[i].Number == number)
+            return &l->Part[i];
+
+    return NULL;
+}
+
+// Extents to read for a list of partition numbers or "all", with the tables, sorted and merged.
+// Out has room for 2 * PARTS. 0 if a number is not in the table.
+DWORD layout_extents(LAYOUT* l, WCHAR* list, EXTENT* out) {
+    EXTENT x;
+    DWORD n = 0, i, j;
+    WCHAR* end;
+    PART* p;
+
+    for (i = 0; i < l->Tables; i++)
+        out[n++] = l->Table[i];
+
+    if (_wcsicmp(list, L"all") == 0) {
+        for (i = 0; i < l->Count && n < 2 * PARTS; i++) {
+            out[n].Start = l->Part[i].Start;
+            out[n++].End = l->Part[i].Start + l->Part[i].Length;
+        }
+    }
+    else {
+        while (*list && n < 2 * PARTS) {
+            if ((p = layout_find(l, wcstoul(list, &end, 10))) == NULL || end == list || (*end && *end != L','))
+                return 0;
+
+            out[n].Start = p->Start;
+            out[n++].End = p->Start + p->Length;
+            list = (*end) ? end + 1 : end;
+        }
+    }
+
+    // Insertion sort, then overlapping and touching extents are joined
+    for (i = 1; i < n; i++)
+        for (j = i, x = out[i]; j > 0 && out[j - 1].Start > x.Start; j--)
+            out[j] = out[j - 1], out[j - 1] = x;
+
+    for (i = 1, j = 0; i < n; i++) {
+        if (out[i].Start <= out[j].End)
+            out[j].End = max(out[j].End, out[i].End);
+        else
+            out[++j] = out[i];
+    }
+
+    return (n) ? j + 1 : 0;
+}
@@ -0,0 +1,99 @@
+// Regions of a disk for diskdump --regions, each dumped into a file of its own
+//
+// A region list has one region per line, # starts a comment:
+//
+//   <name> <sect_skip> <max_bytes>     as on the diskdump command line, 512 byte sectors
+//
+// A configuration saved by scsi2sd-util is read as well, every enabled SCSI target is a region
+// named scsi<id> starting at its sdSectorStart, scsiSectors of bytesPerSector long.
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#define REGIONS 64              // most regions read
+
+typedef struct {
+    WCHAR       Name[64];
+    LONGLONG    Start;      // bytes from the start of the disk
+    LONGLONG    Length;
+    HANDLE      File;       // INVALID_HANDLE_VALUE until opened
+    LONGLONG    Done;       // bytes written to the file
+} REGION;
+
+BOOL region_add(REGION* r, DWORD* count, WCHAR* name, ULONGLONG sector, ULONGLONG length) {
+    if (*count == REGIONS)
+        return FALSE;
+
+    ZeroMemory(&r[*count], sizeof(REGION));
+    wcsncpy(r[*count].Name, name, ARRAYSIZE(r[*count].Name) - 1);
+    r[*count].Start = (LONGLONG)sector * 512;
+    r[*count].Length = (LONGLONG)length;
+    r[*count].File = INVALID_HANDLE_VALUE;
+    (*count)++;
+    return TRUE;
+}
+
+// Reads a region list or SCSI2SD configuration into r, which holds REGIONS, sorted by start.
+// FALSE if the file cannot be read, has a line that is neither or holds no region.
+BOOL region_load(WCHAR* path, REGION* r, DWORD* count) {
+    char line[512], name[64];
+    WCHAR wname[64];
+    ULONGLONG sector, length, start = 0, sectors = 0, bytes = 512;
+    REGION t;
+    DWORD i, j, id = 0;
+    BOOL target = FALSE, enabled = FALSE, ok = TRUE;
+    FILE* f;
+
+    *count = 0;
+    if ((f = _wfopen(path, L"r")) == NULL)
+        return FALSE;
+
+    while (ok && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, " %63s", name) != 1 || name[0] == '#')
+            continue;
+
+        // scsi2sd-util writes one element per line, a target is complete at its end tag
+        if (name[0] == '<') {
+            if (sscanf(line, " <SCSITarget id=\"%u\"", &id) == 1) {
+                target = TRUE;
+                enabled = FALSE;
+                start = sectors = 0;
+                bytes = 512;
+            }
+            else if (strstr(line, "</SCSITarget>") && target) {
+                swprintf(wname, ARRAYSIZE(wname), L"scsi%u", id);
+                if (enabled && sectors)
+                    ok = region_add(r, count, wname, start, sectors * bytes);
+                target = FALSE;
+            }
+            else if (target) {
+                if (strstr(line, "<enabled>"))
+                    enabled = strstr(line, "true") != NULL;
+                sscanf(line, " <sdSectorStart>%llu", &start);
+                sscanf(line, " <scsiSectors>%llu", &sectors);
+                sscanf(line, " <bytesPerSector>%llu", &bytes);
+            }
+            continue;
+        }
+
+        if (sscanf(line, " %63s %llu %llu", name, &sector, &length) != 3) {
+            ok = FALSE;
+            break;
+        }
+
+        mbstowcs(wname, name, ARRAYSIZE(wname) - 1);
+        wname[ARRAYSIZE(wname) - 1] = L'\0';
+        ok = region_add(r, count, wname, sector, length);
+    }
+
+    fclose(f);
+
+    // Few regions, sorted in place
+    for (i = 1; i < *count; i++)
+        for (j = i; j > 0 && r[j].Start < r[j - 1].Start; j--) {
+            t = r[j];
+            r[j] = r[j - 1];
+            r[j - 1] = t;
+        }
+
+    return ok && *count;
+}
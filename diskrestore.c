@@ -13,16 +13,75 @@
 #include <wchar.h>
 #include <stdarg.h>
 
-#define BUFFER_SIZE 1 << 20 // 1 MB
+#include "diskimgz.h"
+#include "diskhash.h"
+#include "diskdelta.h"
+#include "diskstore.h"
+#include "diskjournal.h"
+#include "disktune.h"
+#include "diskdev.h"
+#include "diskstat.h"
+#include "diskpart.h"
+#include "diskvirt.h"
+
+#define BUFFER_SIZE (1 << 20) // 1 MB
+#define BUFFERS 16              // buffers in the read/write ring, source is prefetched into them
+#define DEPTH 4                 // disk writes in flight
+#define TARGETS 32              // fan-out targets besides the first
+
+enum { HOLES_OFF, HOLES_SKIP, HOLES_ZERO, HOLES_TRIM };
 
 #define WIDEN2(x) L ## x
 #define WIDEN(x) WIDEN2(x)
 #define __WDATE__ WIDEN(__DATE__)
 #define __WTIME__ WIDEN(__TIME__)
 
-#define USAGE L"Usage: diskrestore <filename> <disk#> [sect_skip]\n\n"\
+#define USAGE L"Usage: diskrestore [options] <filename> <disk#>[,<disk#>...] [sect_skip]\n\n"\
               L"Write contents of <filename> info physical disk <disk#>\n\n"\
-              L"Filename can be \"nul\" to just write zeros over whole disk\n\n"\
+              L"Several disks separated by commas are written at once from a single read of the\n"\
+              L"file, each with its own queue of writes. A disk that fails is dropped and the\n"\
+              L"others carry on. The slowest disk is at most --buffers blocks behind the fastest.\n\n"\
+              L"Filename can be \"nul\" to just write zeros over whole disk\n"\
+              L"Images compressed by diskdump --compress are unpacked on the fly\n"\
+              L"Delta files of diskdump --base write only their changes over the base, which\n"\
+              L"the disk has to hold already. Restore the base, then each delta in order.\n"\
+              L"Dynamic and fixed VHD, VHDX and qcow2 images are read natively, only their\n"\
+              L"allocated blocks are written, unallocated ones are skipped unless --holes says\n"\
+              L"otherwise. Differencing disks and qcow2 with a backing file are not read.\n"\
+              L"An image file restored into an image file on the same ReFS volume shares its\n"\
+              L"clusters by block cloning instead of copying them, where the offsets allow.\n\n"\
+              L"Options:\n"\
+              L"  --skip=N      start at 512 byte sector N of the image instead of its beginning\n"\
+              L"  --max=N       write at most N bytes of the image\n"\
+              L"  --delta       read the disk first and write only blocks that differ, saves\n"\
+              L"                flash wear when the disk already holds a similar image\n"\
+              L"  --verify[=P]  read the disk back after writing and compare block digests taken\n"\
+              L"                while writing, P is the percentage of random blocks checked (default 100)\n"\
+              L"  --journal[=J] keep a checkpoint journal J (default <filename>.<disk#>.restore.journal)\n"\
+              L"                while the restore runs, removed when it completes\n"\
+              L"  --resume      continue an interrupted restore from its journal, the same command\n"\
+              L"                line has to be given again\n"\
+              L"  --buffers=N   number of buffers the file is read ahead into (default 16)\n"\
+              L"  --depth=N     number of disk writes in flight (default 4)\n"\
+              L"  --block=N     buffer size in bytes, multiple of 512 (default 1048576)\n"\
+              L"  --tune[=again] pick block size and depth for the disk by short write trials\n"\
+              L"                that put back what they read, cached per disk model, again\n"\
+              L"                repeats the trials (--block and --depth given as well are kept)\n"\
+              L"  --direct      read a raw image unbuffered, a long restore does not push\n"\
+              L"                everything else out of the file cache\n"\
+              L"  --store=D     restore image <filename> from chunk store D of diskdump --store,\n"\
+              L"                chunks are fetched and checked against their digest on all cores\n"\
+              L"  --part=N      write the image into partition N of the disk's MBR or GPT table\n"\
+              L"                (see diskdump --list), it has to fit, sect_skip is not given\n"\
+              L"  --map         write a raw image straight from a mapped view of the file\n"\
+              L"                instead of reading it into buffers first, saves a copy\n"\
+              L"  --stats=F     write progress, latency percentiles and stall times of the file\n"\
+              L"                and the disk to F as JSON every few seconds and at the end\n"\
+              L"  --holes=skip|zero|trim\n"\
+              L"                write only allocated ranges of a sparse file, holes are:\n"\
+              L"                skip - left alone, disk keeps whatever it held there\n"\
+              L"                zero - written with zeros without reading the file\n"\
+              L"                trim - discarded with a single TRIM command, zero written if unsupported\n\n"\
               L"Disk# number can be obtained from:\n"\
               L"- Disk Management (diskmgmt.msc)\n"\
               L"- cmd: diskpart> list disk\n"\
@@ -31,7 +90,8 @@
               L"- ps: get-disk\n"\
               L"- ps: get-physicaldisk | ft deviceid,friendlyname\n"\
               L"Long form \\\\.\\PhysicalDriveXX is also allowed\n"\
-              L"Disk# can also be A and B for floppy drives\n\n"\
+              L"Disk# can also be A or B (A: or B:) for floppy drives\n"\
+              L"Disk# can also be a path to an image file, it is created if missing\n\n"\
               L"sect_skip is number of 512 bytes sectors to skip\n\n"
 
 void error(int exit, WCHAR* msg, ...) {
@@ -62,94 +122,562 @@ void error(int exit, WCHAR* msg, ...) {
         ExitProcess(1);
 }
 
+// Returns value of --name=value, empty string for --name, NULL if arg is not --name
+WCHAR* option(WCHAR* arg, WCHAR* name) {
+    size_t len = wcslen(name);
+
+    if (wcsncmp(arg, name, len) != 0)
+        return NULL;
+    if (arg[len] == L'=')
+        return arg + len + 1;
+    if (arg[len] == L'\0')
+        return arg + len;
+    return NULL;
+}
+
+// Image layout, data is read from the file, holes are never read
+typedef struct {
+    LONGLONG    Start;
+    LONGLONG    End;
+    BOOL        Hole;
+    LONGLONG    File;       // file offset of Start, data only
+} SEGMENT;
+
+// Append a segment, merging it with the previous one of the same kind
+void add_segment(SEGMENT** seg, DWORD* n, LONGLONG start, LONGLONG end, BOOL hole, LONGLONG file) {
+    SEGMENT* g = (*n) ? &(*seg)[*n - 1] : NULL;
+
+    if (end <= start)
+        return;
+
+    if (g && g->Hole == hole && g->End == start && (hole || g->File + (g->End - g->Start) == file)) {
+        g->End = end;
+        return;
+    }
+
+    *seg = (*seg) ? HeapReAlloc(GetProcessHeap(), 0, *seg, (*n + 1) * sizeof(SEGMENT)) : HeapAlloc(GetProcessHeap(), 0, sizeof(SEGMENT));
+    if (*seg == NULL)
+        error(1, L"Unable to allocate memory");
+
+    (*seg)[*n].Start = start;
+    (*seg)[*n].End = end;
+    (*seg)[*n].Hole = hole;
+    (*seg)[*n].File = file;
+    (*n)++;
+}
+
+// Split size bytes of a file from base on into data and hole segments from its allocated
+// ranges, rounded out to whole sectors. Segments are relative to base.
+DWORD map_holes(HANDLE h, LONGLONG base, LONGLONG size, SEGMENT** seg) {
+    FILE_ALLOCATED_RANGE_BUFFER q;
+    FILE_ALLOCATED_RANGE_BUFFER r[256];
+    LONGLONG pos = 0, start, end;
+    DWORD n = 0, i, ret;
+    BOOL more;
+
+    do {
+        q.FileOffset.QuadPart = base + pos;
+        q.Length.QuadPart = size - pos;
+        ret = 0;
+
+        more = !ioctl(h, FSCTL_QUERY_ALLOCATED_RANGES, &q, sizeof(q), r, sizeof(r), &ret);
+        if (more && GetLastError() != ERROR_MORE_DATA)
+            error(1, L"Error on DeviceIoControl FSCTL_QUERY_ALLOCATED_RANGES");
+
+        for (i = 0; i < ret / sizeof(r[0]); i++) {
+            start = max((r[i].FileOffset.QuadPart - base) & ~511LL, pos);
+            end = min((r[i].FileOffset.QuadPart - base + r[i].Length.QuadPart + 511) & ~511LL, size);
+            if (end <= start)
+                continue;
+
+            add_segment(seg, &n, pos, start, TRUE, 0);
+            add_segment(seg, &n, start, end, FALSE, base + start);
+            pos = end;
+        }
+    } while (more && ret && pos < size);
+
+    add_segment(seg, &n, pos, size, TRUE, 0);
+
+    return n;
+}
+
+// Clear a hole on the target with a single command. Returns FALSE if zeros have to be written instead.
+BOOL clear_hole(HANDLE h, int mode, BOOL file, LONGLONG offset, LONGLONG len) {
+    FILE_ZERO_DATA_INFORMATION zero;
+    struct {
+        DEVICE_MANAGE_DATA_SET_ATTRIBUTES   Attr;
+        DEVICE_DATA_SET_RANGE               Range;
+    } dsm = { 0 };
+    DWORD ret;
+
+    if (mode == HOLES_SKIP)
+        return TRUE;
+
+    // Image file target, deallocate the range which then reads back as zeros
+    if (file) {
+        zero.FileOffset.QuadPart = offset;
+        zero.BeyondFinalZero.QuadPart = offset + len;
+        return ioctl(h, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &ret);
+    }
+
+    if (mode != HOLES_TRIM)
+        return FALSE;
+
+    dsm.Attr.Size = sizeof(dsm.Attr);
+    dsm.Attr.Action = DeviceDsmAction_Trim;
+    dsm.Attr.DataSetRangesOffset = (DWORD)((BYTE*)&dsm.Range - (BYTE*)&dsm);
+    dsm.Attr.DataSetRangesLength = sizeof(dsm.Range);
+    dsm.Range.StartingOffset = offset;
+    dsm.Range.LengthInBytes = len & ~511LL;
+
+    if (!ioctl(h, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &dsm, sizeof(dsm), NULL, 0, &ret)) {
+        error(0, L"TRIM of %llu bytes at %llu failed, writing zeros instead", len, offset);
+        return FALSE;
+    }
+
+    // A sub sector tail is left for the zero writer
+    return (len % 512) == 0;
+}
+
+// Verify mode, digest of every buffer written in order
+typedef struct {
+    LONGLONG    Pos;        // device/file offset
+    DWORD       Length;
+    BOOL        Check;      // picked for the read back
+    ULONGLONG   Digest;
+} WRITTEN;
+
+typedef struct {
+    DWORD       Percent;    // share of buffers read back, 0 when verify is off
+    WRITTEN*    Chunk;
+    DWORD       Count;
+    DWORD       Max;
+} VERIFY;
+
+// One buffer of the read/write ring
+enum { SLOT_FREE, SLOT_READING, SLOT_UNPACKING, SLOT_READY, SLOT_WRITING };
+
+typedef struct {
+    OVERLAPPED  Ovl;
+    BYTE*       Buff;       // Own, Pack or the shared zero buffer
+    BYTE*       Own;
+    DWORD       Length;     // bytes requested, then bytes to write
+    LONGLONG    Pos;        // position relative to the start of the image
+    int         State;
+    BYTE*       Pack;       // compressed chunk as read from the file
+    BYTE*       Payload;    // compressed bytes within Pack
+    DWORD       Packed;     // payload bytes
+    DWORD       Raw;        // unpacked bytes
+    DWORD       Cut;        // unpacked bytes before the restored range
+    DWORD       Want;       // unpacked bytes within the restored range
+    DWORD       Crc;        // CRC32C of the unpacked chunk from the index
+    BOOL        Check;
+    BOOL        Failed;
+    HANDLE      Done;       // set when the chunk is unpacked or hashed
+    BOOL        Hash;       // take the digest for --verify
+    ULONGLONG   Digest;     // XXH3 of the bytes to write, or read back
+    DWORD       Entry;      // verify list entry being read back
+    BYTE*       Old;        // disk contents for --delta
+    BOOL        Comparing;  // disk read for --delta in flight
+    BOOL        Same;       // disk already holds the buffer, nothing written
+    ULONGLONG   Seq;        // buffers filled before this one
+    BYTE*       View;       // mapped view of the image Buff points into, NULL when read
+    LONGLONG    Issued;     // tick the request in flight was queued
+    DECOMPRESSOR_HANDLE Codec;
+    WCHAR*      Store;      // chunk store root, NULL when not restoring from one
+    BYTE*       Key;        // digest of the chunk to fetch from it
+} SLOT;
+
+// Thread pool callback, unpacks one chunk into the slot buffer
+VOID CALLBACK unpack(PTP_CALLBACK_INSTANCE inst, PVOID ctx) {
+    SLOT* s = ctx;
+    SIZE_T raw = 0;
+
+    if (s->Packed == s->Raw) {
+        CopyMemory(s->Own, s->Payload, s->Raw);
+        raw = s->Raw;
+    }
+    else if (!imgz_api.Decompress(s->Codec, s->Payload, s->Packed, s->Own, s->Raw, &raw)) {
+        raw = 0;
+    }
+
+    s->Failed = (raw != s->Raw) || (s->Check && crc32c(0, s->Own, s->Raw) != s->Crc);
+
+    if (s->Hash && !s->Failed)
+        s->Digest = xxh3(s->Own + s->Cut, s->Want);
+
+    SetEvent(s->Done);
+}
+
+// Thread pool callback, fetches one chunk from the store, checked against its digest
+VOID CALLBACK fetch(PTP_CALLBACK_INSTANCE inst, PVOID ctx) {
+    SLOT* s = ctx;
+
+    s->Failed = !store_get(s->Store, s->Key, s->Own, s->Raw);
+
+    if (s->Hash && !s->Failed)
+        s->Digest = xxh3(s->Own + s->Cut, s->Want);
+
+    SetEvent(s->Done);
+}
+
+// Thread pool callback, digest of a buffer for --verify
+VOID CALLBACK digest(PTP_CALLBACK_INSTANCE inst, PVOID ctx) {
+    SLOT* s = ctx;
+
+    s->Digest = xxh3(s->Buff, s->Length);
+    SetEvent(s->Done);
+}
+
+// Queue a digest of the slot buffer, the slot waits in SLOT_UNPACKING until it is done
+void queue_digest(SLOT* s) {
+    ResetEvent(s->Done);
+    if (!TrySubmitThreadpoolCallback(digest, s, NULL))
+        error(1, L"Unable to queue hashing");
+
+    s->State = SLOT_UNPACKING;
+}
+
+// Disks only take whole sectors, a short tail is padded with zeros
+void pad_sector(SLOT* s) {
+    if (s->Length % 512) {
+        ZeroMemory(s->Buff + s->Length, 512 - s->Length % 512);
+        s->Length += 512 - s->Length % 512;
+    }
+}
+
+// Fan-out target besides the first. It writes the same buffers of the ring in the same order
+// through its own queue, a buffer is free again once every target that is left has written it.
+typedef struct {
+    WCHAR*      DiskNo;
+    WCHAR       DevName[MAX_PATH];
+    HANDLE      h;
+    BOOL        IsFile;
+    BOOL        Failed;
+    LONGLONG    Length;     // of the disk
+    OVERLAPPED* Ovl;        // one per slot
+    BOOL*       Pending;    // write of the slot in flight
+    DWORD       Next;       // slot to write next
+    DWORD       Tail;       // oldest slot written
+    DWORD       Writing;
+    ULONGLONG   Queued;     // slots written or in flight
+    ULONGLONG   Retired;    // slots written
+    LONGLONG    Written;    // bytes
+    LARGE_INTEGER End;      // when the last write finished
+} TARGET;
+
+// Opens and locks a fan-out target, FALSE if it cannot be used. An image file that does not exist
+// yet is left without a handle, create_target makes it once the overwrite is confirmed.
+BOOL open_target(TARGET* t, DWORD buffers) {
+    LARGE_INTEGER size;
+    DWORD i, ret;
+
+    if ((t->IsFile = disk_name(t->DiskNo, t->DevName)) < 0)
+        return FALSE;
+
+    if ((t->h = CreateFileW(t->DevName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL)) == INVALID_HANDLE_VALUE &&
+        !(t->IsFile && GetLastError() == ERROR_FILE_NOT_FOUND))
+        return FALSE;
+
+    if (!t->IsFile) {
+        if (iswdigit(t->DiskNo[0]))
+            ioctl(t->h, FSCTL_ALLOW_EXTENDED_DASD_IO, NULL, 0, NULL, 0, &ret);
+
+        if (!ioctl(t->h, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &ret))
+            return FALSE;
+    }
+
+    if (t->h != INVALID_HANDLE_VALUE) {
+        if (!disk_length(t->h, t->IsFile, &size))
+            return FALSE;
+        t->Length = size.QuadPart;
+    }
+
+    t->Ovl = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, buffers * sizeof(OVERLAPPED));
+    t->Pending = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, buffers * sizeof(BOOL));
+    if (t->Ovl == NULL || t->Pending == NULL)
+        error(1, L"Unable to allocate memory");
+
+    for (i = 0; i < buffers; i++)
+        if ((t->Ovl[i].hEvent = CreateEventW(NULL, TRUE, FALSE, NULL)) == NULL)
+            error(1, L"Unable to allocate memory");
+
+    return TRUE;
+}
+
+// Creates an image file target that open_target did not find
+BOOL create_target(TARGET* t) {
+    if (t->h != INVALID_HANDLE_VALUE)
+        return TRUE;
+
+    return (t->h = CreateFileW(t->DevName, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL)) != INVALID_HANDLE_VALUE;
+}
+
+// Drops a failed fan-out target, its writes in flight are cancelled and waited for
+void drop_target(TARGET* t, DWORD buffers, LONGLONG pos) {
+    DWORD i, ret;
+
+    error(0, L"Writing to %s failed at %llu, dropped, the other disks carry on", t->DevName, pos);
+
+    CancelIoEx(t->h, NULL);
+    for (i = 0; i < buffers; i++)
+        if (t->Pending[i])
+            GetOverlappedResult(t->h, &t->Ovl[i], &ret, TRUE);
+
+    t->Failed = TRUE;
+    t->Writing = 0;
+}
+
+// TRUE when every fan-out target that is left has written the slot
+BOOL written_all(TARGET* t, DWORD n, ULONGLONG seq) {
+    for (; n; n--, t++)
+        if (!t->Failed && t->Retired <= seq)
+            return FALSE;
+
+    return TRUE;
+}
+
+// Queue an overlapped read or write at given device/file offset
+BOOL submit(HANDLE h, SLOT* s, BYTE* buff, DWORD len, LONGLONG offset, BOOL write) {
+    LARGE_INTEGER now;
+    BOOL ok;
+
+    QueryPerformanceCounter(&now);
+    s->Issued = now.QuadPart;
+
+    s->Ovl.Internal = 0;
+    s->Ovl.InternalHigh = 0;
+    s->Ovl.Offset = (DWORD)offset;
+    s->Ovl.OffsetHigh = (DWORD)(offset >> 32);
+
+    if (write)
+        ok = WriteFile(h, buff, len, NULL, &s->Ovl);
+    else
+        ok = ReadFile(h, buff, len, NULL, &s->Ovl);
+
+    return ok || GetLastError() == ERROR_IO_PENDING;
+}
+
 int wmain(int argc, WCHAR* argv[]) {
     HANDLE                  hDisk;
-    HANDLE                  hFile;
-    WCHAR                   DevName[64] = { '\0' };
-    WCHAR*                  Buff;
+    HANDLE                  hFile = INVALID_HANDLE_VALUE;
+    HANDLE                  Wait[MAXIMUM_WAIT_OBJECTS];
+    WCHAR                   DevName[MAX_PATH] = { '\0' };
+    BYTE*                   Zero = NULL;
+    SEGMENT*                Segment = NULL;
+    SEGMENT*                g;
     WCHAR*                  DiskNo;
     WCHAR*                  FileName;
+    WCHAR*                  Val;
     ULONG                   BytesRet;
     GET_LENGTH_INFORMATION  DiskLengthInfo;
-    DISK_GEOMETRY           DiskGeom;
     LARGE_INTEGER           Offset;
     LARGE_INTEGER           TotalBytesRead;
     LARGE_INTEGER           TotalBytesWritten;
     LARGE_INTEGER           FileSize;
-    LARGE_INTEGER           Zero;
-    size_t                  size = 0;
+    LARGE_INTEGER           PackSize;
+    IMGZ_HEADER             Image;
+    IMGZ_CHUNK              Frame = { 0 };
+    IMGZ_TRAILER            Trailer = { 0 };
+    IMGZ_INDEX*             Index = NULL;
+    DELTA_HEADER            Delta;
+    DELTA_EXTENT*           Extent = NULL;
+    BOOL                    IsDelta = FALSE;
+    VIRT                    Virt = { 0 };
+    char                    Hex[2 * HASH_MAX + 1];
+    DWORD                   Chunks = 0, Chunk;
+    LONGLONG                PackPos = 0;
+    LONGLONG                ChunkPos = 0, Start;
+    LONGLONG                Skip = 0, Max = 0;
+    BOOL                    Compressed = FALSE;
+    WCHAR*                  StoreRoot = NULL;
+    WCHAR                   RecipeName[MAX_PATH];
+    MANIFEST                Recipe = { 0 };
+    BOOL                    Stored = FALSE;
+    BOOL                    Direct = FALSE;
+    BOOL                    Map = FALSE;
+    HANDLE                  hMap = NULL;
+    LONGLONG                Cloned = 0;
+    DWORD                   Align = 1;
+    POOL                    Pool = { 0 };
+    LONGLONG                ReadPos;
+    LONGLONG                HoleBytes = 0;
+    SLOT*                   Slot;
+    SLOT*                   s;
+    VERIFY                  Verify = { 0 };
+    WRITTEN*                v;
+    LONGLONG                BadStart = 0, BadEnd = 0;
+    LONGLONG                CheckedBytes = 0;
+    DWORD                   Bad = 0, Checked = 0;
+    BOOL                    Compare = FALSE;
+    LONGLONG                Compared = 0, Unchanged = 0;
+    LONGLONG                WriteBusy = 0;
+    LARGE_INTEGER           wstart, wend;
+    DWORD                   Writes = 0;
+    JOURNAL                 Journal = { 0 };
+    BOOL                    Resume = FALSE;
+    FILETIME                FileTime = { 0 };
+    LONGLONG                Committed;
+    TARGET                  Target[TARGETS];
+    TARGET*                 t;
+    DWORD                   Targets = 0;
+    ULONGLONG               Filled = 0;
+    BOOL                    Sectors;
+    BOOL                    Dropped = FALSE;
+    BOOL                    Cleared, Alive;
+    LARGE_INTEGER           DiskEnd = { 0 };
+    WCHAR*                  Comma;
+    DWORD                   BufferSize = BUFFER_SIZE;
+    DWORD                   Buffers = BUFFERS;
+    DWORD                   Depth = DEPTH;
+    BOOL                    BuffersSet = FALSE, DepthSet = FALSE, BlockSet = FALSE;
+    TUNE                    Tuned = { 0 };
+    char                    Model[256];
+    int                     Tune = 0;
+    BOOL                    Trial;
+    DWORD                   Next = 0, ReadTail = 0, UnpackTail = 0, WriteNext = 0, WriteTail = 0;
+    DWORD                   Reading = 0, Unpacking = 0, Writing = 0;
     DWORD                   BytesRead = 0;
     DWORD                   BytesWritten = 0;
-    DWORD                   ret = 0;
+    DWORD                   i, n;
+    DWORD                   Segments = 0, Seg = 0;
+    int                     Holes = HOLES_OFF;
     DWORD                   NullFile = 0;
+    BOOL                    IsFile = FALSE;
+    BOOL                    Eof = FALSE;
     LARGE_INTEGER           pres, pbegin, pstart, pend;
-    STORAGE_PROPERTY_QUERY  desc_q = { StorageDeviceProperty,  PropertyStandardQuery };
-    STORAGE_DESCRIPTOR_HEADER desc_h = { 0 };
-    PSTORAGE_DEVICE_DESCRIPTOR desc_d;
+    REPORT                  Report = { 0 };
+    LARGE_INTEGER           Slept;
+    LAYOUT                  Layout;
+    PART*                   Part = NULL;
+    WCHAR*                  PartNo = NULL;
+    PSTORAGE_DEVICE_DESCRIPTOR desc_d = NULL;
     WCHAR* ft[] = { L"Non-Removable", L"Removable" };
-    WCHAR* bus[] = { L"UNKNOWN", L"SCSI", L"ATAPI", L"ATA", L"1394", L"SSA", L"FC", L"USB", L"RAID", L"ISCSI", L"SAS", L"SATA", L"SD", L"MMC", L"VIRTUAL", L"VHD", L"MAX", L"NVME" };
 
     wprintf(L"DiskRestore v1.3 by Antoni Sawicki <as@tenoware.com>, Build %s %s\n\n", __WDATE__, __WTIME__);
 
-    if (argc < 3)
+    // Options, shifted out so the positional arguments stay where they were
+    while (argc > 1 && wcsncmp(argv[1], L"--", 2) == 0) {
+        if ((Val = option(argv[1], L"--buffers")) != NULL)
+            Buffers = _wtoi(Val), BuffersSet = TRUE;
+        else if ((Val = option(argv[1], L"--depth")) != NULL)
+            Depth = _wtoi(Val), DepthSet = TRUE;
+        else if ((Val = option(argv[1], L"--block")) != NULL)
+            BufferSize = _wtoi(Val), BlockSet = TRUE;
+        else if ((Val = option(argv[1], L"--tune")) != NULL && (!*Val || wcscmp(Val, L"again") == 0))
+            Tune = (*Val) ? 2 : 1;
+        else if ((Val = option(argv[1], L"--skip")) != NULL)
+            Skip = _wtoi64(Val) * 512;
+        else if ((Val = option(argv[1], L"--max")) != NULL)
+            Max = _wtoi64(Val);
+        else if ((Val = option(argv[1], L"--delta")) != NULL && !*Val)
+            Compare = TRUE;
+        else if ((Val = option(argv[1], L"--resume")) != NULL && !*Val)
+            Resume = TRUE;
+        else if ((Val = option(argv[1], L"--journal")) != NULL)
+            wcsncpy(Journal.Name, (*Val) ? Val : L"*", ARRAYSIZE(Journal.Name));
+        else if ((Val = option(argv[1], L"--verify")) != NULL)
+            Verify.Percent = (*Val) ? _wtoi(Val) : 100;
+        else if ((Val = option(argv[1], L"--direct")) != NULL && !*Val)
+            Direct = TRUE;
+        else if ((Val = option(argv[1], L"--map")) != NULL && !*Val)
+            Map = TRUE;
+        else if ((Val = option(argv[1], L"--stats")) != NULL && *Val)
+            Report.Stats = Val;
+        else if ((Val = option(argv[1], L"--part")) != NULL && *Val)
+            PartNo = Val;
+        else if ((Val = option(argv[1], L"--store")) != NULL && *Val)
+            StoreRoot = Val;
+        else if ((Val = option(argv[1], L"--holes")) != NULL && wcscmp(Val, L"skip") == 0)
+            Holes = HOLES_SKIP;
+        else if ((Val = option(argv[1], L"--holes")) != NULL && wcscmp(Val, L"zero") == 0)
+            Holes = HOLES_ZERO;
+        else if ((Val = option(argv[1], L"--holes")) != NULL && wcscmp(Val, L"trim") == 0)
+            Holes = HOLES_TRIM;
+        else
+            error(1, L"Unknown option %s\n\n%s\n", argv[1], USAGE);
+
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    if (Buffers < 2 || Depth < 1 || BufferSize < 512 || BufferSize % 512 || Skip < 0 || Max < 0 || Verify.Percent > 100)
+        error(1, L"Invalid options: buffers=%u depth=%u block=%u skip=%lld max=%lld verify=%u\n\n%s\n", Buffers, Depth, BufferSize, Skip / 512, Max, Verify.Percent, USAGE);
+
+    // Only as many writes can be in flight as there are buffers to hold them
+    if (Depth > Buffers)
+        Depth = Buffers;
+
+    if (argc < 3 || (PartNo && argc > 3))
         error(1, L"Wrong number of parameters [argc=%d]\n\n%s\n", argc, USAGE);
 
     FileName = argv[1];
     DiskNo = argv[2];
     Offset.QuadPart = (argc == 4) ? _wtoi64(argv[3]) * 512 : 0;
 
-    if (wcscmp(FileName, L"nul") == 0)
+    if (wcscmp(FileName, L"nul") == 0 && !StoreRoot)
         NullFile = 1;
 
-    if (wcsncmp(DiskNo, L"\\\\.\\PhysicalDrive", 13) == 0)
-        wcsncpy(DevName, DiskNo, ARRAYSIZE(DevName));
-    else if (iswdigit(DiskNo[0]))
-        swprintf(DevName, ARRAYSIZE(DevName), L"\\\\.\\PhysicalDrive%s", DiskNo);
-    else if (DiskNo[0] == 'a' || DiskNo[0] == 'A' || DiskNo[0] == 'b' || DiskNo[0] == 'B')
-        swprintf(DevName, ARRAYSIZE(DevName), L"\\\\.\\%c:", DiskNo[0]);
-    else
-        error(1, USAGE, argv[0]);
+    // Fan-out, the first disk goes through the usual path and the rest get a TARGET each
+    ZeroMemory(Target, sizeof(Target));
+    for (Comma = wcschr(DiskNo, L','); Comma; Comma = wcschr(Comma + 1, L',')) {
+        if (Targets == TARGETS)
+            error(1, L"Too many disks, at most %u", TARGETS + 1);
+
+        *Comma = L'\0';
+        Target[Targets++].DiskNo = Comma + 1;
+    }
+
+    if (Targets && (Compare || Verify.Percent || Resume || Journal.Name[0]))
+        error(1, L"Invalid options: several disks do not go with --delta, --verify, --resume or --journal\n\n%s\n", USAGE);
+
+    // Each disk has its own table, a partition is only looked up on one
+    if (Targets && PartNo)
+        error(1, L"Invalid options: several disks do not go with --part\n\n%s\n", USAGE);
 
-    // Open Disk
-    if ((hDisk = CreateFileW(DevName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE)
+    if ((IsFile = disk_name(DiskNo, DevName)) < 0)
+        error(1, L"Invalid options: %s is not a disk number, A:, B: or \\\\.\\PhysicalDriveN\n\n%s\n", DiskNo, USAGE);
+
+    // Open Disk, an image file target that does not exist yet is only created once the overwrite is confirmed
+    if ((hDisk = CreateFileW(DevName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL)) == INVALID_HANDLE_VALUE &&
+        !(IsFile && GetLastError() == ERROR_FILE_NOT_FOUND))
         error(1, L"Cannot open %s", DevName);
 
-    __try {
-        if (iswdigit(DiskNo[0]) && DeviceIoControl(hDisk, FSCTL_ALLOW_EXTENDED_DASD_IO, NULL, 0, NULL, 0, &BytesRet, NULL))
+    if (IsFile) {
+        DiskLengthInfo.Length.QuadPart = 0;
+        if (hDisk != INVALID_HANDLE_VALUE && !disk_length(hDisk, TRUE, &DiskLengthInfo.Length))
+            error(1, L"Unable to get file size for %s", DevName);
+
+        wprintf(L"Image %s %.1f MB  (%llu bytes) (0x%llX)  \n",
+            DevName,
+            (float)DiskLengthInfo.Length.QuadPart / (float)(1 << 20),
+            DiskLengthInfo.Length.QuadPart,
+            DiskLengthInfo.Length.QuadPart
+        );
+    }
+    else __try {
+        if (iswdigit(DiskNo[0]) && ioctl(hDisk, FSCTL_ALLOW_EXTENDED_DASD_IO, NULL, 0, NULL, 0, &BytesRet))
             error(0, L"Error on DeviceIoControl FSCTL_ALLOW_EXTENDED_DASD_IO");
 
-        if (!DeviceIoControl(hDisk, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &BytesRet, NULL))
+        if (!ioctl(hDisk, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &BytesRet))
             error(1, L"Error on DeviceIoControl FSCTL_LOCK_VOLUME [%d] ", BytesRet);
 
-        // Try to obtain disk length. On removable media the first DISK_GET_LENGTH is not supported
-        if (!DeviceIoControl(hDisk, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &DiskLengthInfo, sizeof(GET_LENGTH_INFORMATION), &BytesRet, NULL)) {
-            if (!DeviceIoControl(hDisk, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &DiskGeom, sizeof(DISK_GEOMETRY), &BytesRet, NULL))
-                error(1, L"Error on DeviceIoControl IOCTL_DISK_GET_DRIVE_GEOMETRY [%d] ", BytesRet);
-
-            DiskLengthInfo.Length.QuadPart = DiskGeom.Cylinders.QuadPart * DiskGeom.TracksPerCylinder * DiskGeom.SectorsPerTrack * DiskGeom.BytesPerSector;
-        }
+        if (!disk_length(hDisk, FALSE, &DiskLengthInfo.Length))
+            error(1, L"Error on DeviceIoControl IOCTL_DISK_GET_DRIVE_GEOMETRY");
 
         if (!DiskLengthInfo.Length.QuadPart)
             error(1, L"Unable to obtain disk length info");
 
-        if (!DeviceIoControl(hDisk, IOCTL_STORAGE_QUERY_PROPERTY, &desc_q, sizeof(desc_q), &desc_h, sizeof(desc_h), &BytesRet, NULL))
-            error(0, L"Error on DeviceIoControl IOCTL_STORAGE_QUERY_PROPERTY Device Property [%d] ", BytesRet);
-
-        desc_d = malloc(desc_h.Size);
-        ZeroMemory(desc_d, desc_h.Size);
-
-        if (!DeviceIoControl(hDisk, IOCTL_STORAGE_QUERY_PROPERTY, &desc_q, sizeof(desc_q), desc_d, desc_h.Size, &BytesRet, NULL))
-            error(0, L"Error on DeviceIoControl IOCTL_STORAGE_QUERY_PROPERTY [%d] ", BytesRet);
-
-        if (desc_d->Version != sizeof(STORAGE_DEVICE_DESCRIPTOR))
-            error(0, L"STORAGE_DEVICE_DESCRIPTOR is wrong size [%d] should be [%d]", desc_d->Version, sizeof(STORAGE_DEVICE_DESCRIPTOR));
+        if ((desc_d = disk_desc(hDisk)) == NULL)
+            error(0, L"Error on DeviceIoControl IOCTL_STORAGE_QUERY_PROPERTY");
 
         wprintf(L"Disk %s %s %s %S %S %.1f MB  (%llu bytes) (0x%llX)  \n",
             DiskNo,
-            (desc_d->RemovableMedia <= 1) ? ft[desc_d->RemovableMedia] : L"(n/a)",
-            (desc_d->BusType < ARRAYSIZE(bus)) ? bus[desc_d->BusType] : bus[0],
-            (desc_d->VendorIdOffset) ? (char*)desc_d + desc_d->VendorIdOffset : "n/a",
-            (desc_d + desc_d->ProductIdOffset) ? (char*)desc_d + desc_d->ProductIdOffset : "n/a",
+            (desc_d && desc_d->RemovableMedia <= 1) ? ft[desc_d->RemovableMedia] : L"(n/a)",
+            disk_bus(desc_d),
+            desc_str(desc_d, (desc_d) ? desc_d->VendorIdOffset : 0),
+            desc_str(desc_d, (desc_d) ? desc_d->ProductIdOffset : 0),
             (float)DiskLengthInfo.Length.QuadPart / (float)(1 << 20),
             DiskLengthInfo.Length.QuadPart,
             DiskLengthInfo.Length.QuadPart
@@ -158,14 +686,49 @@ int wmain(int argc, WCHAR* argv[]) {
     __except (1) {
     };
 
-    // Offset
-    if (SetFilePointerEx(hDisk, Offset, NULL, FILE_BEGIN) == 0)
-        error(1, L"Unable to Set File Pointer for Offset [%ull] ", Offset.QuadPart);
+    // The table already on the disk says where the partition starts
+    if (PartNo) {
+        if (!layout_load(hDisk, disk_sector(hDisk, IsFile), DiskLengthInfo.Length.QuadPart, &Layout) || !Layout.Count)
+            error(1, L"No MBR or GPT partition table on %s", DevName);
+
+        if ((Part = layout_find(&Layout, _wtoi(PartNo))) == NULL)
+            error(1, L"Invalid options: --part=%s is not in the partition table of %s\n\n%s\n", PartNo, DevName, USAGE);
+
+        Offset.QuadPart = Part->Start;
+        wprintf(L"Partition %u %S at %llu bytes, %llu bytes\n", Part->Number, Part->Type, Part->Start, Part->Length);
+    }
+
+    // Offset, image files grow as they are written
+    if (Offset.QuadPart >= DiskLengthInfo.Length.QuadPart && (!IsFile || NullFile))
+        error(1, L"Offset [%llu] is beyond end of disk", Offset.QuadPart);
+
+    for (t = Target; t < Target + Targets; t++) {
+        if (disk_name(t->DiskNo, t->DevName) < 0)
+            error(1, L"Invalid options: %s is not a disk number, A:, B: or \\\\.\\PhysicalDriveN\n\n%s\n", t->DiskNo, USAGE);
+
+        if (!open_target(t, Buffers)) {
+            error(0, L"Cannot open %s, left out", t->DevName);
+            t->Failed = TRUE;
+            continue;
+        }
+
+        wprintf(L"Disk %s %.1f MB  (%llu bytes) (0x%llX)  \n",
+            t->DevName,
+            (float)t->Length / (float)(1 << 20),
+            t->Length,
+            t->Length
+        );
+    }
+
+    // A short tail is padded to a whole sector if any target is a disk
+    Sectors = !IsFile;
+    for (t = Target; t < Target + Targets; t++)
+        Sectors = Sectors || (!t->Failed && !t->IsFile);
 
     if (Offset.QuadPart)
         wprintf(L"Offset: %llu (0x%llX) 512b sectors, %.1f MB (%llu bytes) (0x%llX)\n",
-		_wtoi64(argv[3]),
-		_wtoi64(argv[3]),
+		Offset.QuadPart / 512,
+		Offset.QuadPart / 512,
 		(float)Offset.QuadPart / (float)(1 << 20),
 		Offset.QuadPart,
 		Offset.QuadPart
@@ -173,77 +736,936 @@ int wmain(int argc, WCHAR* argv[]) {
 
     // Open File
     if (!NullFile) {
-        if ((hFile = CreateFileW(FileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE)
-            error(1, L"Unable to open file %s ", FileName);
+        // Image in a chunk store, length and chunk size come from its recipe, the tree digest
+        // tells if it changed since an interrupted restore
+        if (StoreRoot) {
+            store_recipe(StoreRoot, FileName, RecipeName);
+            if (!load_manifest(RecipeName, &Recipe) || Recipe.Algorithm != STORE_HASH || Recipe.ChunkSize > (1 << 30))
+                error(1, L"Unable to load recipe %s", RecipeName);
+
+            if (Holes)
+                error(1, L"Invalid options: --holes does not apply to images in a store");
+
+            Stored = TRUE;
+            FileSize.QuadPart = Recipe.Length;
+            BufferSize = Recipe.ChunkSize;
+            BytesRead = 0;
+
+            journal_key(&Journal, "image %S", RecipeName);
+            journal_key(&Journal, "image_tree %s", hash_hex(Recipe.Tree, Recipe.Size, Hex));
+
+            wprintf(L"Recipe %s, %u chunks of %u bytes, %.1f MB (%llu bytes)\n",
+                RecipeName,
+                Recipe.Count,
+                Recipe.ChunkSize,
+                (float)Recipe.Length / (float)(1 << 20),
+                Recipe.Length
+            );
+        }
+        else {
+            if ((hFile = CreateFileW(FileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL)) == INVALID_HANDLE_VALUE)
+                error(1, L"Unable to open file %s ", FileName);
+
+            if (GetFileSizeEx(hFile, &FileSize) == 0)
+                error(1, L"Unable to get file sie for file %s ", FileName);
+
+            // Size and time tell if the image changed since an interrupted restore
+            GetFileTime(hFile, NULL, NULL, &FileTime);
+            journal_key(&Journal, "image %S", FileName);
+            journal_key(&Journal, "image_size %llu", FileSize.QuadPart);
+            journal_key(&Journal, "image_time %08X%08X", FileTime.dwHighDateTime, FileTime.dwLowDateTime);
+
+            if (!read_at(hFile, &Image, sizeof(Image), 0, &BytesRead))
+                BytesRead = 0;
+        }
+
+        if ((Val = imgz_foreign((BYTE*)&Image, BytesRead)) != NULL)
+            error(1, L"File %s is %s compressed, decompress it first", FileName, Val);
+
+        // Compressed image, restored length and buffer size come from the header
+        if (BytesRead == sizeof(Image) && memcmp(Image.Magic, IMGZ_MAGIC, sizeof(Image.Magic)) == 0) {
+            if (Image.Version != IMGZ_VERSION || !Image.Length || Image.ChunkSize < 512 || Image.ChunkSize % 512)
+                error(1, L"File %s is an unsupported or incomplete compressed image", FileName);
+
+            if (!read_at(hFile, &Frame, sizeof(Frame), sizeof(Image), &BytesRead) || BytesRead != sizeof(Frame))
+                error(1, L"Error reading file");
 
-        if (GetFileSizeEx(hFile, &FileSize) == 0)
-            error(1, L"Unable to get file sie for file %s ", FileName);
+            if (Holes)
+                error(1, L"Invalid options: --holes does not apply to compressed images");
+
+            // Chunk index from the end of the file, without it the chunks are read from the start
+            if (Image.Flags & IMGZ_INDEXED) {
+                Chunks = (DWORD)((Image.Length + Image.ChunkSize - 1) / Image.ChunkSize);
+
+                if (!read_at(hFile, &Trailer, sizeof(Trailer), FileSize.QuadPart - sizeof(Trailer), &BytesRead) || BytesRead != sizeof(Trailer) ||
+                    memcmp(Trailer.Magic, IMGZ_END, sizeof(Trailer.Magic)) != 0 || Trailer.Count != Chunks ||
+                    Trailer.Index + (ULONGLONG)Chunks * sizeof(IMGZ_INDEX) + sizeof(Trailer) > (ULONGLONG)FileSize.QuadPart)
+                    error(0, L"Index of compressed image %s is missing, reading it sequentially", FileName);
+                else if ((Index = HeapAlloc(GetProcessHeap(), 0, Chunks * sizeof(IMGZ_INDEX))) == NULL)
+                    error(1, L"Unable to allocate memory");
+                else if (!read_at(hFile, Index, Chunks * sizeof(IMGZ_INDEX), Trailer.Index, &BytesRead) || BytesRead != Chunks * sizeof(IMGZ_INDEX) ||
+                    crc32c(0, Index, Chunks * sizeof(IMGZ_INDEX)) != Trailer.Crc) {
+                    error(0, L"Index of compressed image %s is damaged, reading it sequentially", FileName);
+                    HeapFree(GetProcessHeap(), 0, Index);
+                    Index = NULL;
+                }
+            }
+
+            if (!imgz_load())
+                error(1, L"Compressed image %s needs the Compression API of cabinet.dll, Windows 8 or later", FileName);
+
+            Compressed = TRUE;
+            PackSize = FileSize;
+            PackPos = sizeof(Image) + sizeof(Frame);
+            FileSize.QuadPart = Image.Length;
+            BufferSize = Image.ChunkSize;
+
+            wprintf(L"Compressed image %s, %s, %u byte chunks, %.1f MB (%llu bytes) packed, %s\n",
+                FileName,
+                imgz_name(Image.Algorithm),
+                Image.ChunkSize,
+                (float)PackSize.QuadPart / (float)(1 << 20),
+                PackSize.QuadPart,
+                (Index) ? L"indexed" : L"sequential"
+            );
+        }
+
+        // Delta, only its extents are written and the rest of the disk is left as it is
+        if (BytesRead == sizeof(Image) && memcmp(Image.Magic, DELTA_MAGIC, sizeof(Image.Magic)) == 0) {
+            if (!read_at(hFile, &Delta, sizeof(Delta), 0, &BytesRead) || BytesRead != sizeof(Delta) ||
+                Delta.Version != DELTA_VERSION || !Delta.Map || Delta.Map + (ULONGLONG)Delta.Count * sizeof(DELTA_EXTENT) > (ULONGLONG)FileSize.QuadPart)
+                error(1, L"File %s is an unsupported or incomplete delta", FileName);
+
+            if (Holes || Skip || Max)
+                error(1, L"Invalid options: --holes, --skip and --max do not apply to deltas");
+
+            if ((Extent = HeapAlloc(GetProcessHeap(), 0, max(Delta.Count, 1) * sizeof(DELTA_EXTENT))) == NULL)
+                error(1, L"Unable to allocate memory");
+
+            if (Delta.Count && (!read_at(hFile, Extent, Delta.Count * sizeof(DELTA_EXTENT), Delta.Map, &BytesRead) || BytesRead != Delta.Count * sizeof(DELTA_EXTENT)))
+                error(1, L"Error reading file");
+
+            for (i = 0, ReadPos = 0; i < Delta.Count; i++) {
+                if (Extent[i].Offset < (ULONGLONG)ReadPos || Extent[i].Offset + Extent[i].Length > Delta.Length || Extent[i].Data + Extent[i].Length > Delta.Map)
+                    error(1, L"Corrupt extent map in delta %s", FileName);
+
+                add_segment(&Segment, &Segments, ReadPos, Extent[i].Offset, TRUE, 0);
+                add_segment(&Segment, &Segments, Extent[i].Offset, Extent[i].Offset + Extent[i].Length, FALSE, Extent[i].Data);
+                ReadPos = Extent[i].Offset + Extent[i].Length;
+            }
+            add_segment(&Segment, &Segments, ReadPos, Delta.Length, TRUE, 0);
+
+            IsDelta = TRUE;
+            Holes = HOLES_SKIP;
+            FileSize.QuadPart = Delta.Length;
+
+            wprintf(L"Delta %s, %u extents over a %llu byte base %S\n",
+                FileName,
+                Delta.Count,
+                Delta.Length,
+                hash_hex(Delta.Base, hash_size(Delta.Hash), Hex)
+            );
+        }
+
+        // Virtual disk, only its allocated blocks are read and written, the rest reads as zeros
+        if (!Compressed && !IsDelta && !Stored && virt_probe(hFile, FileSize.QuadPart, &Virt)) {
+            if (!virt_map(hFile, FileSize.QuadPart, &Virt, &Extent, &n))
+                error(1, L"File %s is a damaged %s or uses features not supported (differencing, log to replay, backing file, encryption, compression)", FileName, virt_name(Virt.Format));
+
+            if (Skip || Max)
+                error(1, L"Invalid options: --skip and --max do not apply to virtual disks");
+
+            for (i = 0, ReadPos = 0; i < n; i++) {
+                add_segment(&Segment, &Segments, ReadPos, Extent[i].Offset, TRUE, 0);
+                add_segment(&Segment, &Segments, Extent[i].Offset, Extent[i].Offset + Extent[i].Length, FALSE, Extent[i].Data);
+                ReadPos = Extent[i].Offset + Extent[i].Length;
+            }
+            add_segment(&Segment, &Segments, ReadPos, Virt.Length, TRUE, 0);
+
+            if (!Holes)
+                Holes = HOLES_SKIP;
+            FileSize.QuadPart = Virt.Length;
+
+            wprintf(L"%s %s, %u of %u blocks of %u bytes allocated, %.1f MB (%llu bytes) disk\n",
+                virt_name(Virt.Format),
+                FileName,
+                Virt.Used,
+                Virt.Count,
+                Virt.Block,
+                (float)Virt.Length / (float)(1 << 20),
+                Virt.Length
+            );
+        }
+
+        // Restored range of the image
+        if (Skip >= FileSize.QuadPart && (Skip || FileSize.QuadPart))
+            error(1, L"Skip [%llu] is beyond end of file %s", Skip, FileName);
+
+        FileSize.QuadPart -= Skip;
+        if (Max && Max < FileSize.QuadPart)
+            FileSize.QuadPart = Max;
+
+        if (Skip || Max)
+            wprintf(L"Range: %.1f MB (%llu bytes) from image offset %llu (0x%llX)\n",
+                (float)FileSize.QuadPart / (float)(1 << 20),
+                FileSize.QuadPart,
+                Skip,
+                Skip
+            );
     }
     else {
-        FileSize.QuadPart = DiskLengthInfo.Length.QuadPart;
+        FileSize.QuadPart = DiskLengthInfo.Length.QuadPart - Offset.QuadPart;
     }
 
+    // Nul clears just the partition, an image larger than it would run into the next one
+    if (Part && NullFile)
+        FileSize.QuadPart = min(FileSize.QuadPart, Part->Length);
+    else if (Part && FileSize.QuadPart > Part->Length)
+        error(1, L"Image of %llu bytes does not fit partition %u of %llu bytes", FileSize.QuadPart, Part->Number, Part->Length);
+
     wprintf(L"File %s %.1f MB (%llu bytes) (0x%llx) Nul=%d\n", FileName, (float)FileSize.QuadPart / 1024.0 / 1024.0, FileSize.QuadPart, FileSize.QuadPart, NullFile);
 
-    if (FileSize.QuadPart + Offset.QuadPart > DiskLengthInfo.Length.QuadPart)
+    if (!IsFile && FileSize.QuadPart + Offset.QuadPart > DiskLengthInfo.Length.QuadPart)
         error(0, L"File size + offset is larger than disk size!\n%llu + %llu > %llu", FileSize.QuadPart, Offset.QuadPart, DiskLengthInfo.Length.QuadPart);
 
+    for (t = Target; t < Target + Targets; t++)
+        if (!t->Failed && !t->IsFile && FileSize.QuadPart + Offset.QuadPart > t->Length)
+            error(0, L"File size + offset is larger than size of %s!\n%llu + %llu > %llu", t->DevName, FileSize.QuadPart, Offset.QuadPart, t->Length);
+
+    // Nul file is one big hole that has to be written with zeros
+    if (NullFile)
+        add_segment(&Segment, &Segments, 0, FileSize.QuadPart, TRUE, 0);
+    else if (IsDelta || Virt.Format)
+        ;
+    else if (Holes)
+        Segments = map_holes(hFile, Skip, FileSize.QuadPart, &Segment);
+    else
+        add_segment(&Segment, &Segments, 0, FileSize.QuadPart, FALSE, Skip);
+
+    if (Holes) {
+        for (i = 0; i < Segments; i++)
+            if (Segment[i].Hole)
+                HoleBytes += Segment[i].End - Segment[i].Start;
+
+        wprintf(L"Allocated %.1f MB (%llu bytes) in %u segments, holes %.1f MB (%llu bytes)\n",
+            (float)(FileSize.QuadPart - HoleBytes) / (float)(1 << 20),
+            FileSize.QuadPart - HoleBytes,
+            Segments,
+            (float)HoleBytes / (float)(1 << 20),
+            HoleBytes
+        );
+        HoleBytes = 0;
+
+        if (Holes == HOLES_SKIP && !IsDelta && !(iswdigit(DiskNo[0]) && Offset.QuadPart == 0))
+            error(0, L"Holes are skipped, the disk keeps its previous contents there");
+    }
+
+    // Journaling is asked for, --resume alone looks for the default journal. It is named after
+    // the image and the disk, restores of one image to several disks keep their own.
+    if (NullFile && wcscmp(Journal.Name, L"*") == 0)
+        error(1, L"Invalid options: --journal of nul needs a name, --journal=J\n\n%s\n", USAGE);
+
+    if (wcscmp(Journal.Name, L"*") == 0 || (Resume && !Journal.Name[0] && !NullFile)) {
+        swprintf(Journal.Name, ARRAYSIZE(Journal.Name), L"%s.%s.restore.journal", FileName, DiskNo);
+        for (Val = Journal.Name + min(wcslen(FileName) + 1, wcslen(Journal.Name)); *Val; Val++)
+            if (wcschr(L"\\/:*?\"<>|", *Val))
+                *Val = L'_';
+    }
+
+    // Identity of the restore, a journal of anything else is not resumed
+
+    if (Journal.Name[0]) {
+        journal_key(&Journal, "job restore");
+        journal_key(&Journal, "device %S", DevName);
+        journal_key(&Journal, "serial %s", desc_str(desc_d, (desc_d) ? desc_d->SerialNumberOffset : 0));
+        journal_key(&Journal, "offset %llu", Offset.QuadPart);
+        journal_key(&Journal, "skip %llu", Skip);
+        journal_key(&Journal, "length %llu", FileSize.QuadPart);
+        journal_key(&Journal, "holes %d", Holes);
+        journal_key(&Journal, "delta %d", Compare);
+
+        if (Resume && (n = journal_load(&Journal)) != 1)
+            error(1, (n) ? L"Journal %s is for a different restore, the image, disk or options changed" : L"Nothing to resume, journal %s not found", Journal.Name);
+
+        if (Resume && Journal.Committed > FileSize.QuadPart)
+            error(1, L"Journal %s is damaged, committed offset %llu", Journal.Name, Journal.Committed);
+    }
+    else if (Resume) {
+        error(1, L"Invalid options: --resume of nul needs --journal\n\n%s\n", USAGE);
+    }
+
+    if (Resume)
+        wprintf(L"Resuming at %llu bytes (%.1f%%) from journal %s\n",
+            Journal.Committed,
+            (FileSize.QuadPart) ? (float)Journal.Committed * 100.0 / FileSize.QuadPart : 100.0,
+            Journal.Name
+        );
+
     wprintf(L"\nWARNING: you are about to overwrite your disk erasing all data?!\nThere is no going back after this, continue? (y/N) ?");
     if (getwchar() != L'y')
         error(1, L"\rAborting...\n");
 
-    // Floppy Disks don't support delete drive layout
-    if (iswdigit(DiskNo[0]) && Offset.QuadPart == 0) {
+    if (hDisk == INVALID_HANDLE_VALUE && (hDisk = CreateFileW(DevName, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL)) == INVALID_HANDLE_VALUE)
+        error(1, L"Cannot create %s", DevName);
+
+    for (t = Target; t < Target + Targets; t++)
+        if (!t->Failed && !create_target(t)) {
+            error(0, L"Cannot create %s, left out", t->DevName);
+            t->Failed = TRUE;
+        }
+
+    // Block size and depth for this disk model from the cache, or from write trials at the start of
+    // the region. With several disks the first one is tried and the ring keeps its size. A delta
+    // compares what is on the disk and a resume has written the region already, so those only read.
+    if (Tune && IsFile) {
+        error(0, L"Image files are not tuned, using block %u and depth %u", BufferSize, Depth);
+    }
+    else if (Tune) {
+        tune_model(Model, sizeof(Model), desc_str(desc_d, (desc_d) ? desc_d->VendorIdOffset : 0), desc_str(desc_d, (desc_d) ? desc_d->ProductIdOffset : 0));
+
+        // Compressed images keep their chunk size, only the depth is tried then
+        n = (BlockSet || Compressed || Stored) ? BufferSize : 0;
+        Trial = !Compare && !Resume;
+
+        if (!n && Tune == 1 && tune_load(Model, Trial, &Tuned)) {
+            wprintf(L"Tuned for %S before: block %u, depth %u, %.1f MB/s\n", Model, Tuned.Block, Tuned.Depth, Tuned.Speed);
+        }
+        else if (!tune_probe(hDisk, Offset.QuadPart, min(FileSize.QuadPart, DiskLengthInfo.Length.QuadPart - Offset.QuadPart), Trial, n, &Tuned)) {
+            error(0, L"Tuning trials failed, using block %u and depth %u", BufferSize, Depth);
+        }
+        else {
+            wprintf(L"Tuned for %S: block %u, depth %u, %.1f MB/s\n", Model, Tuned.Block, Tuned.Depth, Tuned.Speed);
+            if (!n && !tune_save(Model, Trial, &Tuned))
+                error(0, L"Unable to cache the tuning");
+        }
+
+        if (Tuned.Block) {
+            if (!n)
+                BufferSize = Tuned.Block;
+            if (!DepthSet)
+                Depth = Tuned.Depth;
+            if (!BuffersSet && !Targets)
+                Buffers = max(Buffers, Depth * 2);
+            if (Depth > Buffers)
+                Depth = Buffers;
+        }
+    }
+
+    // Unbuffered reads start on a sector of the volume holding the image and are whole sectors
+    // long. Headers and extent maps of the other formats are read at any offset.
+    if ((Direct || Map) && (NullFile || Compressed || IsDelta || Stored || Virt.Format))
+        error(1, L"Invalid options: --direct and --map read raw images only\n\n%s\n", USAGE);
+
+    if (Direct && Map)
+        error(1, L"Invalid options: --map reads through the file cache, not with --direct\n\n%s\n", USAGE);
+
+    if (Direct) {
+        Align = file_sector(FileName);
+        if (Skip % Align || BufferSize % Align)
+            error(1, L"Invalid options: skip=%lld and block=%u have to be multiples of the %u byte sectors of %s with --direct\n\n%s\n", Skip / 512, BufferSize, Align, FileName, USAGE);
+
+        CloseHandle(hFile);
+        if ((hFile = CreateFileW(FileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, NULL)) == INVALID_HANDLE_VALUE)
+            error(1, L"Unable to open file %s ", FileName);
+
+        wprintf(L"Direct I/O, %u byte sectors\n", Align);
+    }
+
+    // An empty file has nothing to map, it is read as usual then
+    if (Map && (hMap = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL) {
+        error(0, L"Unable to map file %s, reading it instead", FileName);
+        Map = FALSE;
+    }
+
+    // Floppy Disks don't support delete drive layout. A delta builds on the layout already there,
+    // a resumed restore has written it already.
+    if (!IsFile && !IsDelta && !Compare && !Resume && iswdigit(DiskNo[0]) && Offset.QuadPart == 0) {
         wprintf(L"Offset at sector 0, deleting disk partitions...\n");
-        if (!DeviceIoControl(hDisk, IOCTL_DISK_DELETE_DRIVE_LAYOUT, NULL, 0, NULL, 0, &BytesRet, NULL))
+        if (!ioctl(hDisk, IOCTL_DISK_DELETE_DRIVE_LAYOUT, NULL, 0, NULL, 0, &BytesRet))
             error(1, L"Error on DeviceIoControl IOCTL_DISK_DELETE_DRIVE_LAYOUT [%d] ", BytesRet);
 
         FlushFileBuffers(hDisk);
     }
 
+    for (t = Target; t < Target + Targets; t++) {
+        if (t->Failed || t->IsFile || IsDelta || !iswdigit(t->DiskNo[0]) || Offset.QuadPart != 0)
+            continue;
+
+        wprintf(L"Offset at sector 0, deleting partitions of %s...\n", t->DevName);
+        if (!ioctl(t->h, IOCTL_DISK_DELETE_DRIVE_LAYOUT, NULL, 0, NULL, 0, &BytesRet))
+            drop_target(t, Buffers, 0);
+
+        FlushFileBuffers(t->h);
+    }
 
     TotalBytesRead.QuadPart = 0;
     TotalBytesWritten.QuadPart = 0;
-    Buff = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, BUFFER_SIZE);
-    if (Buff == NULL)
+
+    Slot = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, Buffers * sizeof(SLOT));
+    if (Slot == NULL)
+        error(1, L"Unable to allocate memory");
+
+    // Zero fill writes all come out of one shared buffer
+    if ((Zero = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, BufferSize)) == NULL)
+        error(1, L"Unable to allocate memory");
+
+    // Buffers aligned to the sectors of the image file, or at least to pages
+    if (!pool_init(&Pool, Buffers, BufferSize, Align))
         error(1, L"Unable to allocate memory");
 
+    // The nul file writes only the zero buffer, its slots need their own only to read back into
+    for (i = 0; i < Buffers; i++) {
+        Slot[i].Own = (NullFile && !Verify.Percent) ? Zero : pool_get(&Pool, BufferSize);
+        Slot[i].Ovl.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (Slot[i].Own == NULL || Slot[i].Ovl.hEvent == NULL)
+            error(1, L"Unable to allocate memory");
+
+        if (Compare && (Slot[i].Old = HeapAlloc(GetProcessHeap(), 0, BufferSize)) == NULL)
+            error(1, L"Unable to allocate memory");
+
+        if (Compressed || Stored || Verify.Percent) {
+            Slot[i].Hash = (Verify.Percent != 0);
+            Slot[i].Store = StoreRoot;
+            Slot[i].Done = CreateEventW(NULL, TRUE, FALSE, NULL);
+            if (Slot[i].Done == NULL)
+                error(1, L"Unable to allocate memory");
+        }
+
+        if (Compressed) {
+            Slot[i].Pack = HeapAlloc(GetProcessHeap(), 0, BufferSize + sizeof(IMGZ_CHUNK));
+            if (Slot[i].Pack == NULL)
+                error(1, L"Unable to allocate memory");
+
+            if (!imgz_api.CreateDecompressor(Image.Algorithm | COMPRESS_RAW, NULL, &Slot[i].Codec))
+                error(1, L"Unable to create %s decompressor", imgz_name(Image.Algorithm));
+        }
+    }
+
+    QueryPerformanceFrequency(&pres);
     QueryPerformanceCounter(&pbegin);
+    ReadPos = 0;
 
-    do {
-        QueryPerformanceCounter(&pstart);
+    if (Journal.Name[0] && !journal_open(&Journal, Resume)) {
+        error(0, L"Unable to write journal %s, the restore cannot be resumed if interrupted", Journal.Name);
+        journal_close(&Journal, FALSE);
+        Journal.Name[0] = L'\0';
+    }
+
+    // Resumed restore starts at the last checkpoint
+    if (Resume) {
+        ReadPos = Journal.Committed;
+        TotalBytesRead.QuadPart = Journal.Committed;
+    }
+
+    // Image file into an image file, the clusters are shared if both are on one ReFS volume.
+    // An unaligned tail and anything the volume refused is copied as usual.
+    if (IsFile && !Targets && !NullFile && !Compressed && !Stored && !IsDelta && !Compare && !Verify.Percent && !Holes && ReadPos < FileSize.QuadPart) {
+        if ((Cloned = clone_range(hFile, Skip + ReadPos, hDisk, Offset.QuadPart + ReadPos, FileSize.QuadPart - ReadPos)) != 0)
+            wprintf(L"Cloned %.1f MB (%llu bytes) by block cloning\n", (float)Cloned / (float)(1 << 20), Cloned);
+
+        // Shared clusters count as written, the target holds them as much as copied ones
+        ReadPos += Cloned;
+        TotalBytesRead.QuadPart += Cloned;
+        TotalBytesWritten.QuadPart += Cloned;
+    }
+
+    // The segment at the start position is cut to start there, so a hole is cleared or skipped
+    // as a whole again and data is read from the right file offset. Compressed images find the
+    // chunk holding it like any other range.
+    if (ReadPos && !Compressed && !Stored && ReadPos < FileSize.QuadPart) {
+        while (Segment[Seg].End <= ReadPos)
+            Seg++;
 
-        if (NullFile) {
-            if (TotalBytesWritten.QuadPart + Offset.QuadPart + BUFFER_SIZE > DiskLengthInfo.Length.QuadPart)
-                BytesRead = DiskLengthInfo.Length.QuadPart - (TotalBytesWritten.QuadPart + Offset.QuadPart);
-            else
-                BytesRead = BUFFER_SIZE;
+        if (!Segment[Seg].Hole)
+            Segment[Seg].File += ReadPos - Segment[Seg].Start;
+        Segment[Seg].Start = ReadPos;
+    }
+
+    // Allocated ranges are whole clusters, a resumed restore may not have stopped on a sector
+    for (i = Seg; Direct && i < Segments; i++)
+        if (!Segment[i].Hole && Segment[i].File % Align)
+            error(1, L"Image offset %llu is not on a %u byte sector, restore without --direct", Segment[i].File, Align);
+
+    // The file is read ahead into every free buffer of the ring while up to Depth buffers
+    // are being written to the disk. Buffers go FREE -> READING -> READY -> WRITING in ring
+    // order. Holes (and the whole nul file) are not read, they are either cleared with
+    // a single command or their buffers point at the zero buffer and go straight to READY.
+    // Compressed chunks go through UNPACKING on the thread pool between READING and READY,
+    // chunks of a store are fetched there as a whole.
+    // With --verify every buffer does, to be hashed before it is written. Progress is printed
+    // by the reporter thread, the loop only counts.
+    Report.Verb = L'W';
+    Report.Tool = "diskrestore";
+    Report.ShowHoles = (Holes != HOLES_OFF);
+    Report.Source.Name = FileName;
+    Report.Sink.Name = DevName;
+    if (!report_start(&Report, FileSize.QuadPart, TotalBytesRead.QuadPart))
+        error(1, L"Unable to start the progress reporter");
+
+    for (;;) {
+        while (!Eof && ReadPos < FileSize.QuadPart && Slot[Next].State == SLOT_FREE) {
+            // A mapped view is let go when its slot comes round again
+            if (Slot[Next].View) {
+                UnmapViewOfFile(Slot[Next].View);
+                Slot[Next].View = NULL;
+            }
+
+            // Chunks of a store are fetched on the thread pool, as many at once as there are buffers
+            if (Stored) {
+                s = &Slot[Next];
+                Chunk = (DWORD)((Skip + ReadPos) / Recipe.ChunkSize);
+                Start = (LONGLONG)Chunk * Recipe.ChunkSize;
+
+                if (Chunk >= Recipe.Count)
+                    error(1, L"Recipe %s is short of chunk %u", RecipeName, Chunk);
+
+                s->Raw = (DWORD)min((LONGLONG)Recipe.ChunkSize, (LONGLONG)Recipe.Length - Start);
+                s->Cut = (DWORD)(Skip + ReadPos - Start);
+                s->Want = (DWORD)min(Start + s->Raw - Skip - ReadPos, FileSize.QuadPart - ReadPos);
+                s->Key = Recipe.Digest + Chunk * Recipe.Size;
+                s->Pos = ReadPos;
+                s->Seq = Filled++;
+                s->Failed = FALSE;
+
+                ResetEvent(s->Done);
+                if (!TrySubmitThreadpoolCallback(fetch, s, NULL))
+                    error(1, L"Unable to queue chunk fetch");
+
+                s->State = SLOT_UNPACKING;
+                ReadPos += s->Want;
+                Unpacking++;
+                Next = (Next + 1) % Buffers;
+                continue;
+            }
+
+            if (Compressed) {
+                s = &Slot[Next];
+
+                // Indexed image, only the chunks covering the range are read, as many at once as there are buffers
+                if (Index) {
+                    Chunk = (DWORD)((Skip + ReadPos) / Image.ChunkSize);
+                    Start = (LONGLONG)Chunk * Image.ChunkSize;
+
+                    if (!Index[Chunk].Packed || Index[Chunk].Packed > BufferSize)
+                        error(1, L"Corrupt index of compressed image at chunk %u", Chunk);
+
+                    PackPos = Index[Chunk].Offset;
+                    s->Raw = (DWORD)min((LONGLONG)Image.ChunkSize, (LONGLONG)Image.Length - Start);
+                    s->Packed = Index[Chunk].Packed;
+                    s->Crc = Index[Chunk].Crc;
+                    s->Check = TRUE;
+                    s->Payload = s->Pack + sizeof(IMGZ_CHUNK);
+                    s->Length = sizeof(IMGZ_CHUNK) + s->Packed;
+                }
+                // Otherwise chunks are read back to back, each read also brings in the header of the next one
+                else {
+                    if (Reading)
+                        break;
+
+                    if (!Frame.Length || Frame.Length > BufferSize || Frame.Packed > BufferSize || Frame.Length > Image.Length - ChunkPos)
+                        error(1, L"Corrupt compressed image at %llu", PackPos - sizeof(Frame));
+
+                    Start = ChunkPos;
+                    ChunkPos += Frame.Length;
+                    s->Raw = Frame.Length;
+                    s->Packed = Frame.Packed;
+                    s->Check = FALSE;
+                    s->Payload = s->Pack;
+                    s->Length = Frame.Packed + ((ChunkPos < (LONGLONG)Image.Length) ? sizeof(Frame) : 0);
+                }
+
+                // Chunks before the range are read for the next header but never unpacked
+                if (Start + s->Raw <= Skip + ReadPos) {
+                    s->Cut = 0;
+                    s->Want = 0;
+                }
+                else {
+                    s->Cut = (DWORD)(Skip + ReadPos - Start);
+                    s->Want = (DWORD)min(Start + s->Raw - Skip - ReadPos, FileSize.QuadPart - ReadPos);
+                }
+
+                s->Pos = ReadPos;
+                s->Buff = s->Pack;
+                s->Seq = Filled++;
+
+                if (!submit(hFile, s, s->Buff, s->Length, PackPos, FALSE))
+                    error(1, L"Error reading file");
+
+                s->State = SLOT_READING;
+                PackPos += s->Length;
+                ReadPos += s->Want;
+                Reading++;
+                Next = (Next + 1) % Buffers;
+                continue;
+            }
+
+            while (Segment[Seg].End <= ReadPos)
+                Seg++;
+            g = &Segment[Seg];
+
+            // Every target has to clear the hole, otherwise zeros are written to all of them
+            for (t = Target, Cleared = TRUE; g->Hole && ReadPos == g->Start && !NullFile && t < Target + Targets; t++)
+                if (!t->Failed && !clear_hole(t->h, Holes, t->IsFile, Offset.QuadPart + g->Start, g->End - g->Start))
+                    Cleared = FALSE;
+
+            if (g->Hole && ReadPos == g->Start && !NullFile && Cleared && (Dropped || clear_hole(hDisk, Holes, IsFile, Offset.QuadPart + g->Start, g->End - g->Start))) {
+                HoleBytes += g->End - g->Start;
+                TotalBytesRead.QuadPart += g->End - g->Start;
+                ReadPos = g->End;
+                continue;
+            }
+
+            s = &Slot[Next];
+            s->Pos = ReadPos;
+            s->Seq = Filled++;
+            s->Length = (DWORD)min((LONGLONG)BufferSize, g->End - ReadPos);
+
+            if (g->Hole) {
+                s->Buff = Zero;
+                s->State = SLOT_READY;
+
+                if (Sectors && s->Length % 512)
+                    s->Length += 512 - s->Length % 512;
+
+                if (Verify.Percent) {
+                    queue_digest(s);
+                    Unpacking++;
+                }
+            }
+            // Written straight from the pages of the file cache, a short tail still needs a
+            // buffer for its sector padding
+            else if (Map && !(Sectors && s->Length % 512) && (s->View = map_view(hMap, g->File + (s->Pos - g->Start), s->Length, &s->Buff)) != NULL) {
+                TotalBytesRead.QuadPart += s->Length;
+
+                if (Verify.Percent) {
+                    queue_digest(s);
+                    Unpacking++;
+                }
+                else {
+                    s->State = SLOT_READY;
+                }
+            }
+            else {
+                s->Buff = s->Own;
+
+                // Reads are collected from the oldest one, skipping holes and mapped slots between them
+                if (!Reading)
+                    ReadTail = Next;
+
+                // Unbuffered reads of a short tail are rounded up, anything past it is cut off again
+                if (!submit(hFile, s, s->Buff, (s->Length + Align - 1) / Align * Align, g->File + (s->Pos - g->Start), FALSE))
+                    error(1, L"Error reading file");
+                s->State = SLOT_READING;
+                Reading++;
+            }
+
+            ReadPos = min(ReadPos + s->Length, g->End);
+            Next = (Next + 1) % Buffers;
         }
-        else {
-            ZeroMemory(Buff, BUFFER_SIZE);
 
-            if (ReadFile(hFile, Buff, BUFFER_SIZE, &BytesRead, NULL) == 0)
+        // Collect finished reads, padding a short tail with zeros to a whole sector
+        while (Reading && (Slot[ReadTail].State != SLOT_READING || HasOverlappedIoCompleted(&Slot[ReadTail].Ovl))) {
+            s = &Slot[ReadTail];
+            BytesRead = 0;
+
+            if (s->State != SLOT_READING) {
+                ReadTail = (ReadTail + 1) % Buffers;
+                continue;
+            }
+
+            if (!GetOverlappedResult(hFile, &s->Ovl, &BytesRead, TRUE) && GetLastError() != ERROR_HANDLE_EOF)
                 error(1, L"Error reading file");
+            report_io(&Report.Source, s->Issued, BytesRead, Report.Freq);
+
+            if (Compressed) {
+                if (BytesRead != s->Length)
+                    error(1, L"Compressed image %s is truncated", FileName);
+
+                if (s->Check && (((IMGZ_CHUNK*)s->Pack)->Packed != s->Packed || ((IMGZ_CHUNK*)s->Pack)->Length != s->Raw))
+                    error(1, L"Compressed chunk at image offset %llu does not match the index", Skip + s->Pos - s->Cut);
+
+                if (!s->Check && s->Length > s->Packed)
+                    CopyMemory(&Frame, s->Pack + s->Packed, sizeof(Frame));
+
+                s->Failed = FALSE;
+                ResetEvent(s->Done);
+
+                if (!s->Want)
+                    SetEvent(s->Done);
+                else if (!TrySubmitThreadpoolCallback(unpack, s, NULL))
+                    error(1, L"Unable to queue decompression");
+
+                s->State = SLOT_UNPACKING;
+                Unpacking++;
+            }
+            else {
+                BytesRead = min(BytesRead, s->Length);
+                if (BytesRead < s->Length)
+                    Eof = TRUE;
+
+                s->Length = BytesRead;
+                TotalBytesRead.QuadPart += BytesRead;
+
+                if (Verify.Percent) {
+                    queue_digest(s);
+                    Unpacking++;
+                }
+                else {
+                    if (Sectors)
+                        pad_sector(s);
+
+                    s->State = SLOT_READY;
+                }
+            }
+
+            ReadTail = (ReadTail + 1) % Buffers;
+            Reading--;
         }
 
-        if (WriteFile(hDisk, Buff, BytesRead, &BytesWritten, NULL) == 0)
-            error(1, L"Error writing to disk");
+        // Collect unpacked and hashed buffers in order. Holes enter UNPACKING while earlier
+        // reads may still be in flight, so the oldest slot is not necessarily there yet.
+        while (Unpacking && Slot[UnpackTail].State == SLOT_UNPACKING && WaitForSingleObject(Slot[UnpackTail].Done, 0) == WAIT_OBJECT_0) {
+            s = &Slot[UnpackTail];
 
-        TotalBytesRead.QuadPart += BytesRead;
-        TotalBytesWritten.QuadPart += BytesWritten;
-        QueryPerformanceCounter(&pend);
-        QueryPerformanceFrequency(&pres);
+            if (s->Failed && Stored)
+                error(1, L"Chunk at image offset %llu is missing from the store or corrupt", Skip + s->Pos - s->Cut);
 
-        wprintf(L"W [%d] [%.1f MB] [%.1f%%] [%.1f MB/s]                \r",
-            BytesWritten,
-            (float)TotalBytesRead.QuadPart / (float) (1 << 20),
-            (float)TotalBytesRead.QuadPart * 100.0 / FileSize.QuadPart,
-            ((float)BytesWritten / (float) (1 << 20)) / ((float)(pend.QuadPart-pstart.QuadPart)/(float)(pres.QuadPart))
-        );
-        FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
-    } while (BytesRead);
+            if (s->Failed)
+                error(1, L"Corrupt compressed chunk at image offset %llu", Skip + s->Pos - s->Cut);
+
+            if (Compressed || Stored) {
+                s->Buff = s->Own + s->Cut;
+                s->Length = s->Want;
+                TotalBytesRead.QuadPart += s->Want;
+            }
+
+            // Digest covers the bytes of the image, not the sector padding
+            if (Verify.Percent && s->Length) {
+                if (Verify.Count == Verify.Max) {
+                    Verify.Max = (Verify.Max) ? Verify.Max * 2 : 4096;
+                    Verify.Chunk = (Verify.Chunk) ? HeapReAlloc(GetProcessHeap(), 0, Verify.Chunk, Verify.Max * sizeof(WRITTEN)) : HeapAlloc(GetProcessHeap(), 0, Verify.Max * sizeof(WRITTEN));
+                    if (Verify.Chunk == NULL)
+                        error(1, L"Unable to allocate memory");
+                }
 
+                v = &Verify.Chunk[Verify.Count++];
+                v->Pos = Offset.QuadPart + s->Pos;
+                v->Length = s->Length;
+                v->Digest = s->Digest;
+            }
+
+            if (Sectors)
+                pad_sector(s);
+
+            s->State = SLOT_READY;
+            UnpackTail = (UnpackTail + 1) % Buffers;
+            Unpacking--;
+        }
+
+        // Queue ready buffers to the disk up to the write depth, in delta mode the disk is read first
+        while (Writing < Depth && Slot[WriteNext].State == SLOT_READY) {
+            s = &Slot[WriteNext];
+            s->Same = FALSE;
+            s->Comparing = FALSE;
+
+            if (s->Buff == Zero) {
+                TotalBytesRead.QuadPart += s->Length;
+                HoleBytes += s->Length;
+            }
+
+            if (s->Length && Compare) {
+                if (!submit(hDisk, s, s->Old, s->Length, Offset.QuadPart + s->Pos, FALSE))
+                    error(1, L"Error reading disk");
+                s->Comparing = TRUE;
+            }
+            else if (s->Length && Dropped) {
+                s->Same = TRUE;
+            }
+            else if (s->Length) {
+                if (!submit(hDisk, s, s->Buff, s->Length, Offset.QuadPart + s->Pos, TRUE)) {
+                    if (!Targets)
+                        error(1, L"Error writing to disk");
+
+                    error(0, L"Writing to %s failed at %llu, dropped, the other disks carry on", DevName, Offset.QuadPart + s->Pos);
+                    Dropped = TRUE;
+                    s->Same = TRUE;
+                }
+                else if (Writes++ == 0) {
+                    QueryPerformanceCounter(&wstart);
+                }
+            }
+
+            s->State = SLOT_WRITING;
+            WriteNext = (WriteNext + 1) % Buffers;
+            Writing++;
+        }
+
+        // Fan-out targets write ready buffers in the same order, each up to the write depth.
+        // A slot is not freed until all of them have written it.
+        for (t = Target; t < Target + Targets; t++) {
+            while (!t->Failed && t->Writing < Depth && Slot[t->Next].Seq == t->Queued && (Slot[t->Next].State == SLOT_READY || Slot[t->Next].State == SLOT_WRITING)) {
+                s = &Slot[t->Next];
+
+                if (s->Length) {
+                    t->Ovl[t->Next].Internal = 0;
+                    t->Ovl[t->Next].InternalHigh = 0;
+                    t->Ovl[t->Next].Offset = (DWORD)(Offset.QuadPart + s->Pos);
+                    t->Ovl[t->Next].OffsetHigh = (DWORD)((Offset.QuadPart + s->Pos) >> 32);
+
+                    if (!WriteFile(t->h, s->Buff, s->Length, NULL, &t->Ovl[t->Next]) && GetLastError() != ERROR_IO_PENDING) {
+                        drop_target(t, Buffers, Offset.QuadPart + s->Pos);
+                        break;
+                    }
+                }
+
+                t->Pending[t->Next] = (s->Length != 0);
+                t->Next = (t->Next + 1) % Buffers;
+                t->Queued++;
+                t->Writing++;
+            }
+
+            while (!t->Failed && t->Writing && (!t->Pending[t->Tail] || HasOverlappedIoCompleted(&t->Ovl[t->Tail]))) {
+                s = &Slot[t->Tail];
+                BytesWritten = 0;
+
+                if (t->Pending[t->Tail]) {
+                    t->Pending[t->Tail] = FALSE;
+                    if (!GetOverlappedResult(t->h, &t->Ovl[t->Tail], &BytesWritten, TRUE) || BytesWritten < s->Length) {
+                        drop_target(t, Buffers, Offset.QuadPart + s->Pos);
+                        break;
+                    }
+                }
+
+                t->Written += BytesWritten;
+                QueryPerformanceCounter(&t->End);
+                t->Tail = (t->Tail + 1) % Buffers;
+                t->Retired++;
+                t->Writing--;
+            }
+        }
+
+        for (t = Target, Alive = !Dropped; Targets && t < Target + Targets; t++)
+            Alive = Alive || !t->Failed;
+        if (Targets && !Alive)
+            error(1, L"Writing failed on every disk");
+
+        // Compare every finished disk read, not just the oldest, so writes of differing buffers
+        // are queued as soon as possible. A short read past the end of the disk differs.
+        for (i = 0, n = WriteTail; Compare && i < Writing; i++, n = (n + 1) % Buffers) {
+            s = &Slot[n];
+            if (!s->Comparing || !HasOverlappedIoCompleted(&s->Ovl))
+                continue;
+
+            s->Comparing = FALSE;
+            BytesRead = 0;
+            Compared += s->Length;
+
+            if (GetOverlappedResult(hDisk, &s->Ovl, &BytesRead, TRUE) && BytesRead == s->Length && memcmp(s->Old, s->Buff, s->Length) == 0) {
+                s->Same = TRUE;
+                Unchanged += s->Length;
+                continue;
+            }
+
+            if (!submit(hDisk, s, s->Buff, s->Length, Offset.QuadPart + s->Pos, TRUE))
+                error(1, L"Error writing to disk");
+            if (Writes++ == 0)
+                QueryPerformanceCounter(&wstart);
+        }
+
+        // Retire finished writes
+        while (Writing && !Slot[WriteTail].Comparing && (!Slot[WriteTail].Length || Slot[WriteTail].Same || HasOverlappedIoCompleted(&Slot[WriteTail].Ovl)) &&
+            written_all(Target, Targets, Slot[WriteTail].Seq)) {
+            s = &Slot[WriteTail];
+            BytesWritten = 0;
+
+            // A short write fails the disk the same as an error, as it does for the other targets
+            if (s->Length && !s->Same) {
+                if (!GetOverlappedResult(hDisk, &s->Ovl, &BytesWritten, TRUE) || BytesWritten < s->Length) {
+                    if (!Targets)
+                        error(1, L"Error writing to disk");
+
+                    if (!Dropped)
+                        error(0, L"Writing to %s failed at %llu, dropped, the other disks carry on", DevName, Offset.QuadPart + s->Pos);
+                    Dropped = TRUE;
+                    BytesWritten = 0;
+                }
+                else {
+                    QueryPerformanceCounter(&DiskEnd);
+                    report_io(&Report.Sink, s->Issued, BytesWritten, Report.Freq);
+                }
+
+                // Time with at least one write in flight, for the write rate of the delta summary
+                if (--Writes == 0) {
+                    QueryPerformanceCounter(&wend);
+                    WriteBusy += wend.QuadPart - wstart.QuadPart;
+                }
+            }
+
+            TotalBytesWritten.QuadPart += BytesWritten;
+            Report.Last = BytesWritten;
+
+            s->State = SLOT_FREE;
+            WriteTail = (WriteTail + 1) % Buffers;
+            Writing--;
+
+            // Buffers retire in order, everything up to this one is on the disk once flushed
+            if (Journal.File && GetTickCount64() - Journal.Saved >= JOURNAL_PERIOD) {
+                Committed = min(s->Pos + s->Length, FileSize.QuadPart);
+
+                if (!FlushFileBuffers(hDisk))
+                    error(1, L"Error flushing disk");
+
+                if (!journal_commit(&Journal, Committed, NULL, 0))
+                    error(0, L"Error writing journal %s", Journal.Name);
+            }
+        }
+
+        // Sleep until the oldest read, chunk or write completes
+        n = 0;
+        if (Reading)
+            Wait[n++] = Slot[ReadTail].Ovl.hEvent;
+        if (Unpacking && Slot[UnpackTail].State == SLOT_UNPACKING)
+            Wait[n++] = Slot[UnpackTail].Done;
+        // Oldest write of the first disk may be done already and just waiting for the other disks
+        if (Writing && (!HasOverlappedIoCompleted(&Slot[WriteTail].Ovl) || written_all(Target, Targets, Slot[WriteTail].Seq)))
+            Wait[n++] = Slot[WriteTail].Ovl.hEvent;
+
+        for (t = Target; t < Target + Targets && n < MAXIMUM_WAIT_OBJECTS; t++)
+            if (!t->Failed && t->Writing && t->Pending[t->Tail])
+                Wait[n++] = t->Ovl[t->Tail].hEvent;
+
+        // Disk reads of the delta mode can finish in any order
+        for (i = 0; Compare && i < Writing && n < MAXIMUM_WAIT_OBJECTS; i++)
+            if (Slot[(WriteTail + i) % Buffers].Comparing && i)
+                Wait[n++] = Slot[(WriteTail + i) % Buffers].Ovl.hEvent;
+
+        // Holes and clones move on without a write, the count is taken once per pass
+        Report.Done = TotalBytesRead.QuadPart;
+        Report.Holes = HoleBytes;
+
+        // Reads or unpacking in flight with a free buffer to fill wait for the image, a full
+        // ring for the disk
+        if (n) {
+            QueryPerformanceCounter(&Slept);
+            WaitForMultipleObjects(n, Wait, FALSE, INFINITE);
+            report_stall(&Report, Slept.QuadPart, ((Reading || Unpacking) && Slot[Next].State == SLOT_FREE) ? &Report.Source : &Report.Sink);
+        }
+        else if (Eof || ReadPos >= FileSize.QuadPart)
+            break;
+    }
+
+    QueryPerformanceCounter(&pend);
     FlushFileBuffers(hDisk);
+    for (t = Target; t < Target + Targets; t++)
+        if (!t->Failed)
+            FlushFileBuffers(t->h);
+
+    if (Journal.Name[0])
+        journal_close(&Journal, !Eof || TotalBytesRead.QuadPart >= FileSize.QuadPart);
+
+    Report.Done = TotalBytesRead.QuadPart;
+    if (!report_stop(&Report, TotalBytesRead.QuadPart >= FileSize.QuadPart && !Dropped))
+        error(0, L"Error writing stats %s", Report.Stats);
 
     wprintf(L"\rDone! [%.1f MB] (%llu bytes) [%.1f%%] [%.1f MB/s]                  \n", 
         (float)TotalBytesRead.QuadPart / (float) (1 << 20), 
@@ -251,17 +1673,244 @@ int wmain(int argc, WCHAR* argv[]) {
         (float)TotalBytesWritten.QuadPart * 100.0 / FileSize.QuadPart,
         (float)(TotalBytesWritten.QuadPart / (1 << 20)) / ((float)(pend.QuadPart-pbegin.QuadPart)/(float)(pres.QuadPart))
    );
+    report_summary(&Report);
 
-    if (!DeviceIoControl(hDisk, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &BytesRet, NULL))
-        error(1, L"Error on DeviceIoControl FSCTL_UNLOCK_VOLUME [%d] ", BytesRet);
+    // Fan-out, every disk with its rate from the start to its last write
+    if (Targets) {
+        wprintf(L"%s: %.1f MB (%llu bytes) [%.1f MB/s] %s\n",
+            DevName,
+            (float)TotalBytesWritten.QuadPart / (float)(1 << 20),
+            TotalBytesWritten.QuadPart,
+            (DiskEnd.QuadPart > pbegin.QuadPart) ? ((float)TotalBytesWritten.QuadPart / (float)(1 << 20)) / ((float)(DiskEnd.QuadPart - pbegin.QuadPart) / (float)pres.QuadPart) : 0.0,
+            (Dropped) ? L"FAILED" : L"ok"
+        );
 
-    if (iswdigit(DiskNo[0]))
-        if (!DeviceIoControl(hDisk, IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0, &BytesRet, NULL))
-            error(1, L"Error on DeviceIoControl IOCTL_DISK_UPDATE_PROPERTIES [%d] ", BytesRet);
+        for (t = Target; t < Target + Targets; t++)
+            wprintf(L"%s: %.1f MB (%llu bytes) [%.1f MB/s] %s\n",
+                t->DevName,
+                (float)t->Written / (float)(1 << 20),
+                t->Written,
+                (t->End.QuadPart > pbegin.QuadPart) ? ((float)t->Written / (float)(1 << 20)) / ((float)(t->End.QuadPart - pbegin.QuadPart) / (float)pres.QuadPart) : 0.0,
+                (t->Failed) ? L"FAILED" : L"ok"
+            );
+    }
+
+    if (Compressed)
+        wprintf(L"Unpacked %llu bytes from %llu bytes (%.1f%%) compressed with %s\n",
+            TotalBytesRead.QuadPart,
+            PackSize.QuadPart,
+            (float)PackSize.QuadPart * 100.0 / Image.Length,
+            imgz_name(Image.Algorithm)
+        );
 
-    CloseHandle(hFile);
+    if (Holes)
+        wprintf(L"Data %.1f MB (%llu bytes), holes %.1f MB (%llu bytes) %s\n",
+            (float)(TotalBytesRead.QuadPart - HoleBytes) / (float)(1 << 20),
+            TotalBytesRead.QuadPart - HoleBytes,
+            (float)HoleBytes / (float)(1 << 20),
+            HoleBytes,
+            (Holes == HOLES_SKIP) ? L"skipped" : (Holes == HOLES_TRIM) ? L"trimmed or zeroed" : L"zeroed"
+        );
+
+    if (Compare)
+        wprintf(L"Delta: compared %.1f MB (%llu bytes), wrote %.1f MB (%llu bytes), skipped %.1f MB (%.1f%%) already on disk\n",
+            (float)Compared / (float)(1 << 20),
+            Compared,
+            (float)TotalBytesWritten.QuadPart / (float)(1 << 20),
+            TotalBytesWritten.QuadPart,
+            (float)Unchanged / (float)(1 << 20),
+            (Compared) ? (float)Unchanged * 100.0 / Compared : 0.0
+        );
+
+    // Estimate from the write rate measured while writes were in flight
+    if (Compare && TotalBytesWritten.QuadPart && WriteBusy)
+        wprintf(L"Delta: at %.1f MB/s writing the skipped blocks would have taken %.1f s more\n",
+            ((float)TotalBytesWritten.QuadPart / (float)(1 << 20)) / ((float)WriteBusy / (float)pres.QuadPart),
+            (float)Unchanged / (float)TotalBytesWritten.QuadPart * ((float)WriteBusy / (float)pres.QuadPart)
+        );
+
+    // Read back pass. Every buffer of the ring is kept reading, digests are taken on the thread
+    // pool and compared in order with the ones taken while writing. Holes that were cleared
+    // without writing have nothing to compare and are not read.
+    if (Verify.Percent) {
+        srand(GetTickCount());
+        for (i = 0; i < Verify.Count; i++)
+            Verify.Chunk[i].Check = (DWORD)(rand() % 100) < Verify.Percent;
+
+        wprintf(L"Verifying %u%% of %u blocks...\n", Verify.Percent, Verify.Count);
+
+        Next = ReadTail = UnpackTail = 0;
+        n = 0;
+        QueryPerformanceCounter(&pstart);
+        pend = pstart;
+
+        for (;;) {
+            while (n < Verify.Count && Slot[Next].State == SLOT_FREE) {
+                if (!Verify.Chunk[n].Check) {
+                    n++;
+                    continue;
+                }
+
+                s = &Slot[Next];
+                s->Entry = n++;
+                s->Buff = s->Own;
+                s->Length = Verify.Chunk[s->Entry].Length;
+
+                // Disks only read whole sectors
+                if (!IsFile && s->Length % 512)
+                    s->Length += 512 - s->Length % 512;
+
+                if (!submit(hDisk, s, s->Buff, s->Length, Verify.Chunk[s->Entry].Pos, FALSE))
+                    error(1, L"Error reading disk at %llu", Verify.Chunk[s->Entry].Pos);
+
+                s->State = SLOT_READING;
+                Reading++;
+                Next = (Next + 1) % Buffers;
+            }
+
+            // A failed or short read counts as a mismatch
+            while (Reading && HasOverlappedIoCompleted(&Slot[ReadTail].Ovl)) {
+                s = &Slot[ReadTail];
+                v = &Verify.Chunk[s->Entry];
+                BytesRead = 0;
+
+                s->Failed = !GetOverlappedResult(hDisk, &s->Ovl, &BytesRead, TRUE) || BytesRead < v->Length;
+                s->Length = v->Length;
+
+                if (s->Failed) {
+                    SetEvent(s->Done);
+                    s->State = SLOT_UNPACKING;
+                }
+                else {
+                    queue_digest(s);
+                }
+
+                ReadTail = (ReadTail + 1) % Buffers;
+                Reading--;
+                Unpacking++;
+            }
+
+            // Adjacent bad blocks are reported as one range of sectors
+            while (Unpacking && Slot[UnpackTail].State == SLOT_UNPACKING && WaitForSingleObject(Slot[UnpackTail].Done, 0) == WAIT_OBJECT_0) {
+                s = &Slot[UnpackTail];
+                v = &Verify.Chunk[s->Entry];
+
+                if (s->Failed || s->Digest != v->Digest) {
+                    if (Bad && BadEnd == v->Pos) {
+                        BadEnd += v->Length;
+                    }
+                    else {
+                        if (Bad)
+                            wprintf(L"\rMismatch: sectors %llu-%llu (%llu bytes at %llu)          \n", BadStart / 512, (BadEnd - 1) / 512, BadEnd - BadStart, BadStart);
+                        BadStart = v->Pos;
+                        BadEnd = v->Pos + v->Length;
+                    }
+                    Bad++;
+                }
+
+                Checked++;
+                CheckedBytes += v->Length;
+                QueryPerformanceCounter(&pend);
+
+                wprintf(L"V [%.1f MB] [%.1f%%] [%u bad]                \r",
+                    (float)CheckedBytes / (float)(1 << 20),
+                    (float)(s->Entry + 1) * 100.0 / Verify.Count,
+                    Bad
+                );
+                FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
+
+                s->State = SLOT_FREE;
+                UnpackTail = (UnpackTail + 1) % Buffers;
+                Unpacking--;
+            }
+
+            i = 0;
+            if (Reading)
+                Wait[i++] = Slot[ReadTail].Ovl.hEvent;
+            if (Unpacking && Slot[UnpackTail].State == SLOT_UNPACKING)
+                Wait[i++] = Slot[UnpackTail].Done;
+
+            if (i)
+                WaitForMultipleObjects(i, Wait, FALSE, INFINITE);
+            else if (n >= Verify.Count)
+                break;
+        }
+
+        if (Bad)
+            wprintf(L"\rMismatch: sectors %llu-%llu (%llu bytes at %llu)          \n", BadStart / 512, (BadEnd - 1) / 512, BadEnd - BadStart, BadStart);
+
+        wprintf(L"\rVerified %u of %u blocks, %.1f MB (%llu bytes) [%.1f MB/s], %u mismatched          \n",
+            Checked,
+            Verify.Count,
+            (float)CheckedBytes / (float)(1 << 20),
+            CheckedBytes,
+            (pend.QuadPart > pstart.QuadPart) ? ((float)CheckedBytes / (float)(1 << 20)) / ((float)(pend.QuadPart - pstart.QuadPart) / (float)pres.QuadPart) : 0.0,
+            Bad
+        );
+    }
+
+    if (!IsFile) {
+        if (!ioctl(hDisk, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &BytesRet))
+            error(1, L"Error on DeviceIoControl FSCTL_UNLOCK_VOLUME [%d] ", BytesRet);
+
+        if (iswdigit(DiskNo[0]))
+            if (!ioctl(hDisk, IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0, &BytesRet))
+                error(1, L"Error on DeviceIoControl IOCTL_DISK_UPDATE_PROPERTIES [%d] ", BytesRet);
+    }
+
+    for (t = Target; t < Target + Targets; t++) {
+        if (t->h == NULL || t->h == INVALID_HANDLE_VALUE)
+            continue;
+
+        if (!t->IsFile) {
+            ioctl(t->h, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &BytesRet);
+            if (iswdigit(t->DiskNo[0]))
+                ioctl(t->h, IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0, &BytesRet);
+        }
+
+        for (i = 0; t->Ovl && i < Buffers; i++)
+            CloseHandle(t->Ovl[i].hEvent);
+        if (t->Ovl)
+            HeapFree(GetProcessHeap(), 0, t->Ovl);
+        if (t->Pending)
+            HeapFree(GetProcessHeap(), 0, t->Pending);
+        CloseHandle(t->h);
+    }
+
+    if (hMap)
+        CloseHandle(hMap);
+    if (hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
     CloseHandle(hDisk);
-    HeapFree(GetProcessHeap(), 0, Buff);
+
+    for (i = 0; i < Buffers; i++) {
+        CloseHandle(Slot[i].Ovl.hEvent);
+        if (Slot[i].View)
+            UnmapViewOfFile(Slot[i].View);
+
+        if (Compressed || Stored || Verify.Percent)
+            CloseHandle(Slot[i].Done);
+
+        if (Compare)
+            HeapFree(GetProcessHeap(), 0, Slot[i].Old);
+
+        if (Compressed) {
+            imgz_api.CloseDecompressor(Slot[i].Codec);
+            HeapFree(GetProcessHeap(), 0, Slot[i].Pack);
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, Zero);
+    HeapFree(GetProcessHeap(), 0, Segment);
+    HeapFree(GetProcessHeap(), 0, Index);
+    HeapFree(GetProcessHeap(), 0, Recipe.Digest);
+    HeapFree(GetProcessHeap(), 0, Extent);
+    HeapFree(GetProcessHeap(), 0, Verify.Chunk);
+    HeapFree(GetProcessHeap(), 0, Slot);
+    pool_free(&Pool);
+
+    SetLastError(0);
+    if (Bad)
+        error(1, L"Verification failed, %u of %u blocks read back differ from what was written", Bad, Checked);
 
     return 0;
 }
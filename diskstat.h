@@ -0,0 +1,305 @@
+// Progress reporter and I/O telemetry shared by diskdump, diskrestore and diskbench
+//
+// The transfer loop only counts bytes and adds the latency of every request to a histogram
+// of its side, the source read from or the sink written to, one QueryPerformanceCounter per
+// request. The time the loop sleeps is charged to the side it waits for. A reporter thread
+// prints the progress line every REPORT_PERIOD ms with the throughput smoothed over the last
+// seconds and an ETA, and with --stats rewrites a JSON file every STATS_PERIOD ms and once
+// more at the end. The reporter reads the counters without a lock, a report may be one
+// request behind.
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#define REPORT_PERIOD 250       // ms between progress lines
+#define STATS_PERIOD 5000       // ms between rewrites of the stats file
+#define SMOOTHING 0.1           // weight of the last period in the smoothed throughput
+#define BUCKETS (64 * 16)       // latency histogram, 16 buckets per power of two microseconds
+
+// Histogram bucket of a latency, exact below 16 us and within 1/16 above
+DWORD bucket(ULONGLONG us) {
+    DWORD e;
+
+    if (us < 16)
+        return (DWORD)us;
+
+    for (e = 4; us >> (e + 1); e++)
+        ;
+    return (e - 3) * 16 + (DWORD)((us >> (e - 4)) & 15);
+}
+
+// Lowest latency that falls into a bucket
+ULONGLONG bucket_us(DWORD b) {
+    if (b < 16)
+        return b;
+
+    return (ULONGLONG)(16 | (b % 16)) << (b / 16 - 1);
+}
+
+// JSON string, device and file names may hold quotes and backslashes
+void json_str(FILE* f, WCHAR* s) {
+    char utf[MAX_PATH * 3], * p;
+
+    if (!WideCharToMultiByte(CP_UTF8, 0, s, -1, utf, sizeof(utf), NULL, NULL))
+        utf[0] = '\0';
+
+    fputc('"', f);
+    for (p = utf; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(f, "\\%c", *p);
+        else if ((BYTE)*p < 0x20)
+            fprintf(f, "\\u%04x", (BYTE)*p);
+        else
+            fputc(*p, f);
+    }
+    fputc('"', f);
+}
+
+// One side of the transfer
+typedef struct {
+    WCHAR*      Name;       // device or file
+    LONGLONG    Ops;
+    LONGLONG    Bytes;
+    ULONGLONG   MaxUs;
+    LONGLONG    Stall;      // ticks the loop waited for this side
+    LONGLONG    Hist[BUCKETS];
+} SIDE;
+
+typedef struct {
+    WCHAR       Verb;       // R or W, first letter of the progress line
+    char*       Tool;
+    LONGLONG    Total;      // bytes of the whole transfer
+    volatile LONGLONG Done; // bytes through, set by the transfer loop
+    volatile LONGLONG Holes;// of them not read, shown when ShowHoles is set
+    volatile DWORD Last;    // length of the last buffer through
+    BOOL        ShowHoles;
+    SIDE        Source;     // read from
+    SIDE        Sink;       // written to
+    LONGLONG    Waits;      // sleeps of the transfer loop
+    WCHAR*      Stats;      // JSON file, NULL for none
+    LARGE_INTEGER Freq;
+    LARGE_INTEGER Start;
+    double      Rate;       // smoothed bytes per second
+    double      QpcNs;      // cost of one QueryPerformanceCounter
+    double      CpuMs;      // reporter thread
+    HANDLE      Stop;
+    HANDLE      Thread;
+} REPORT;
+
+// Latency of a request issued at the given tick, taken when the loop collects it
+void report_io(SIDE* d, LONGLONG issued, DWORD bytes, LARGE_INTEGER freq) {
+    LARGE_INTEGER now;
+    ULONGLONG us;
+
+    QueryPerformanceCounter(&now);
+    us = (ULONGLONG)(now.QuadPart - issued) * 1000000 / freq.QuadPart;
+
+    d->Hist[bucket(us)]++;
+    d->Ops++;
+    d->Bytes += bytes;
+    if (us > d->MaxUs)
+        d->MaxUs = us;
+}
+
+// Time the loop slept since the given tick, charged to the side it waited for, if any
+void report_stall(REPORT* r, LONGLONG since, SIDE* d) {
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    r->Waits++;
+    if (d)
+        d->Stall += now.QuadPart - since;
+}
+
+// Latency that a given fraction of the requests did not exceed
+ULONGLONG side_percentile(SIDE* d, double p) {
+    LONGLONG seen = 0;
+    DWORD b;
+
+    for (b = 0; b < BUCKETS; b++) {
+        seen += d->Hist[b];
+        if (seen && seen >= d->Ops * p)
+            return bucket_us(b);
+    }
+
+    return d->MaxUs;
+}
+
+void side_json(FILE* f, char* key, SIDE* d, LARGE_INTEGER freq) {
+    fprintf(f, "  \"%s\": {\n    \"path\": ", key);
+    json_str(f, d->Name);
+    fprintf(f, ",\n    \"ops\": %lld,\n    \"bytes\": %lld,\n    \"p50_us\": %llu,\n    \"p99_us\": %llu,\n    \"p999_us\": %llu,\n    \"max_us\": %llu,\n    \"stall\": %.3f\n  },\n",
+        d->Ops,
+        d->Bytes,
+        side_percentile(d, 0.5),
+        side_percentile(d, 0.99),
+        side_percentile(d, 0.999),
+        d->MaxUs,
+        (double)d->Stall / (double)freq.QuadPart
+    );
+}
+
+// Estimated time the transfer loop spent on the counters, two ticks per request and per sleep
+double report_overhead(REPORT* r) {
+    return (double)(r->Source.Ops + r->Sink.Ops + r->Waits) * 2.0 * r->QpcNs / 1e9;
+}
+
+// Stats file is written aside and moved over the old one, readers never see half of it
+BOOL report_json(REPORT* r, char* state) {
+    WCHAR tmp[MAX_PATH];
+    LARGE_INTEGER now;
+    LONGLONG done = r->Done;
+    double elapsed;
+    FILE* f;
+
+    if (!r->Stats || _snwprintf(tmp, MAX_PATH - 1, L"%s.tmp", r->Stats) < 0 || (f = _wfopen(tmp, L"w")) == NULL)
+        return FALSE;
+
+    QueryPerformanceCounter(&now);
+    elapsed = (double)(now.QuadPart - r->Start.QuadPart) / (double)r->Freq.QuadPart;
+
+    fprintf(f, "{\n  \"tool\": \"%s\",\n  \"state\": \"%s\",\n  \"elapsed\": %.3f,\n  \"total\": %lld,\n  \"done\": %lld,\n  \"holes\": %lld,\n"
+        "  \"percent\": %.2f,\n  \"rate_mbs\": %.1f,\n  \"eta\": %.0f,\n",
+        r->Tool,
+        state,
+        elapsed,
+        r->Total,
+        done,
+        r->Holes,
+        (r->Total) ? (double)done * 100.0 / r->Total : 100.0,
+        r->Rate / (double)(1 << 20),
+        (r->Rate > 0 && r->Total > done) ? (double)(r->Total - done) / r->Rate : 0.0
+    );
+    side_json(f, "source", &r->Source, r->Freq);
+    side_json(f, "sink", &r->Sink, r->Freq);
+    fprintf(f, "  \"overhead\": {\n    \"reporter_cpu\": %.3f,\n    \"loop\": %.3f\n  }\n}\n", r->CpuMs / 1000.0, report_overhead(r));
+
+    if (fclose(f) != 0)
+        return FALSE;
+
+    return MoveFileExW(tmp, r->Stats, MOVEFILE_REPLACE_EXISTING);
+}
+
+DWORD WINAPI reporter(LPVOID ctx) {
+    REPORT* r = ctx;
+    LARGE_INTEGER last, now;
+    LONGLONG prev = r->Done, done;
+    ULONGLONG saved = GetTickCount64();
+    FILETIME c, e, k, u;
+    double rate, eta;
+
+    last = r->Start;
+
+    while (WaitForSingleObject(r->Stop, REPORT_PERIOD) == WAIT_TIMEOUT) {
+        QueryPerformanceCounter(&now);
+        done = r->Done;
+
+        // Smoothed over a couple of seconds, the first period sets it
+        rate = (double)(done - prev) * (double)r->Freq.QuadPart / (double)(now.QuadPart - last.QuadPart);
+        r->Rate = (r->Rate > 0) ? r->Rate + SMOOTHING * (rate - r->Rate) : rate;
+        eta = (r->Rate > 0 && r->Total > done) ? (double)(r->Total - done) / r->Rate : 0;
+        prev = done;
+        last = now;
+
+        if (r->ShowHoles)
+            wprintf(L"%c [%d] [%.1f MB data] [%.1f MB holes] [%.1f%%] [%.1f MB/s] [ETA %u:%02u:%02u]        \r",
+                r->Verb,
+                r->Last,
+                (float)(done - r->Holes) / (float)(1 << 20),
+                (float)r->Holes / (float)(1 << 20),
+                (r->Total) ? (float)done * 100 / r->Total : 100.0,
+                r->Rate / (double)(1 << 20),
+                (DWORD)eta / 3600, (DWORD)eta / 60 % 60, (DWORD)eta % 60
+            );
+        else
+            wprintf(L"%c [%d] [%.1f MB] [%.1f%%] [%.1f MB/s] [ETA %u:%02u:%02u]        \r",
+                r->Verb,
+                r->Last,
+                (float)done / (float)(1 << 20),
+                (r->Total) ? (float)done * 100 / r->Total : 100.0,
+                r->Rate / (double)(1 << 20),
+                (DWORD)eta / 3600, (DWORD)eta / 60 % 60, (DWORD)eta % 60
+            );
+        FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
+
+        if (GetThreadTimes(GetCurrentThread(), &c, &e, &k, &u))
+            r->CpuMs = (double)(((ULONGLONG)k.dwHighDateTime << 32 | k.dwLowDateTime) + ((ULONGLONG)u.dwHighDateTime << 32 | u.dwLowDateTime)) / 10000.0;
+
+        if (r->Stats && GetTickCount64() - saved >= STATS_PERIOD) {
+            report_json(r, "running");
+            saved = GetTickCount64();
+        }
+    }
+
+    return 0;
+}
+
+// Starts the reporter for a transfer of total bytes, done of them already (a resume)
+BOOL report_start(REPORT* r, LONGLONG total, LONGLONG done) {
+    LARGE_INTEGER t0, t1, t;
+    DWORD i;
+
+    QueryPerformanceFrequency(&r->Freq);
+
+    // Cost of the counter on this machine, for the overhead estimate
+    QueryPerformanceCounter(&t0);
+    for (i = 0; i < 1000; i++)
+        QueryPerformanceCounter(&t);
+    QueryPerformanceCounter(&t1);
+    r->QpcNs = (double)(t1.QuadPart - t0.QuadPart) * 1e9 / (double)r->Freq.QuadPart / 1000.0;
+
+    r->Total = total;
+    r->Done = done;
+    r->Rate = 0;
+    QueryPerformanceCounter(&r->Start);
+
+    if ((r->Stop = CreateEventW(NULL, TRUE, FALSE, NULL)) == NULL)
+        return FALSE;
+
+    if ((r->Thread = CreateThread(NULL, 0, reporter, r, 0, NULL)) == NULL) {
+        CloseHandle(r->Stop);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Stops the reporter and writes the stats file a last time, FALSE if that failed
+BOOL report_stop(REPORT* r, BOOL complete) {
+    if (!r->Thread)
+        return TRUE;
+
+    SetEvent(r->Stop);
+    WaitForSingleObject(r->Thread, INFINITE);
+    CloseHandle(r->Thread);
+    CloseHandle(r->Stop);
+    r->Thread = NULL;
+
+    return !r->Stats || report_json(r, (complete) ? "done" : "incomplete");
+}
+
+// Where the loop waited and what the counting cost
+void report_summary(REPORT* r) {
+    LARGE_INTEGER now;
+    double elapsed, cost;
+
+    QueryPerformanceCounter(&now);
+    elapsed = (double)(now.QuadPart - r->Start.QuadPart) / (double)r->Freq.QuadPart;
+    cost = report_overhead(r) + r->CpuMs / 1000.0;
+
+    wprintf(L"Latency p50/p99/max: read %llu/%llu/%llu us, write %llu/%llu/%llu us\n",
+        side_percentile(&r->Source, 0.5),
+        side_percentile(&r->Source, 0.99),
+        r->Source.MaxUs,
+        side_percentile(&r->Sink, 0.5),
+        side_percentile(&r->Sink, 0.99),
+        r->Sink.MaxUs
+    );
+    wprintf(L"Waited %.1f s for %s, %.1f s for %s, counting took %.1f ms (%.3f%%)\n",
+        (double)r->Source.Stall / (double)r->Freq.QuadPart,
+        r->Source.Name,
+        (double)r->Sink.Stall / (double)r->Freq.QuadPart,
+        r->Sink.Name,
+        cost * 1000.0,
+        (elapsed > 0) ? cost * 100.0 / elapsed : 0.0
+    );
+}
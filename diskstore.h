@@ -0,0 +1,255 @@
+// Content addressed chunk store shared by diskdump and diskrestore, include after diskdelta.h
+//
+// A store is a directory of chunks named by their SHA-256 digest, and of recipes which are the
+// manifests of the images dumped into it:
+//
+//   <store>\chunks\ab\ab12...ef        chunk bytes, the first two hex digits are the subdirectory
+//   <store>\recipes\<name>.manifest    manifest of image <name>, its chunk digests in order
+//
+// The chunk path is the index, a chunk already there is never written again however many
+// images hold it. New chunks go to a temporary name first and are renamed, so a dump that is
+// cut short leaves no partial chunk under a digest. Garbage collection removes the chunks no
+// recipe refers to, it must not run while a dump writes to the same store.
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#define STORE_HASH HASH_SHA256      // collisions would restore the wrong data, so no fast hash here
+
+// Path of a chunk, path holds MAX_PATH
+void store_chunk(WCHAR* root, BYTE* digest, WCHAR* path) {
+    char hex[2 * HASH_MAX + 1];
+
+    hash_hex(digest, hash_size(STORE_HASH), hex);
+    swprintf(path, MAX_PATH, L"%s\\chunks\\%.2S\\%S", root, hex, hex);
+}
+
+// Path of the recipe of an image, path holds MAX_PATH
+void store_recipe(WCHAR* root, WCHAR* name, WCHAR* path) {
+    swprintf(path, MAX_PATH, L"%s\\recipes\\%s.manifest", root, name);
+}
+
+BOOL store_mkdir(WCHAR* path) {
+    return CreateDirectoryW(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+// Creates the store directories if they are not there yet
+BOOL store_create(WCHAR* root) {
+    WCHAR path[MAX_PATH];
+
+    swprintf(path, MAX_PATH, L"%s\\chunks", root);
+    if (!store_mkdir(root) || !store_mkdir(path))
+        return FALSE;
+
+    swprintf(path, MAX_PATH, L"%s\\recipes", root);
+    return store_mkdir(path);
+}
+
+// Puts a chunk in the store, 1 if it was written, 0 if it was there already, -1 on error.
+// Safe to call from many threads at once, also for the same chunk.
+int store_put(WCHAR* root, BYTE* digest, BYTE* buff, DWORD len) {
+    WCHAR path[MAX_PATH], tmp[MAX_PATH];
+    DWORD ret, err;
+    HANDLE h;
+    BOOL ok;
+
+    store_chunk(root, digest, path);
+    if (GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES)
+        return 0;
+
+    wcsncpy(tmp, path, MAX_PATH);
+    *wcsrchr(tmp, L'\\') = L'\0';
+    if (!store_mkdir(tmp))
+        return -1;
+
+    swprintf(tmp, MAX_PATH, L"%s.%u.tmp", path, GetCurrentThreadId());
+    if ((h = CreateFileW(tmp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL)) == INVALID_HANDLE_VALUE)
+        return -1;
+
+    ok = WriteFile(h, buff, len, &ret, NULL) && ret == len;
+    ok = CloseHandle(h) && ok;
+
+    // Another thread or dump may have stored the same chunk in the meantime
+    if (ok && MoveFileExW(tmp, path, MOVEFILE_WRITE_THROUGH))
+        return 1;
+
+    err = GetLastError();
+    DeleteFileW(tmp);
+    return (ok && (err == ERROR_ALREADY_EXISTS || err == ERROR_FILE_EXISTS)) ? 0 : -1;
+}
+
+// Reads a whole chunk of exactly len bytes and checks its digest
+BOOL store_get(WCHAR* root, BYTE* digest, BYTE* buff, DWORD len) {
+    WCHAR path[MAX_PATH];
+    BYTE check[HASH_MAX];
+    LARGE_INTEGER size;
+    DWORD ret;
+    HANDLE h;
+    BOOL ok;
+
+    store_chunk(root, digest, path);
+    if ((h = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL)) == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    ok = GetFileSizeEx(h, &size) && size.QuadPart == len && ReadFile(h, buff, len, &ret, NULL) && ret == len;
+    CloseHandle(h);
+
+    return ok && hash(STORE_HASH, buff, len, check) && memcmp(check, digest, hash_size(STORE_HASH)) == 0;
+}
+
+// Set of digests, open addressing on the first bytes which are random already. An all zero
+// key marks a free entry, no real chunk has that digest.
+typedef struct {
+    BYTE*       Key;
+    DWORD       Size;       // digest bytes
+    DWORD       Count;
+    DWORD       Cap;        // power of two
+} DIGESTS;
+
+const BYTE digests_free[HASH_MAX] = { 0 };
+
+BOOL digests_add(DIGESTS* d, BYTE* key);
+
+BOOL digests_grow(DIGESTS* d) {
+    DIGESTS n = { NULL, d->Size, 0, (d->Cap) ? d->Cap * 2 : 65536 };
+    DWORD i;
+
+    if ((n.Key = VirtualAlloc(NULL, (SIZE_T)n.Cap * n.Size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        return FALSE;
+
+    for (i = 0; i < d->Cap; i++)
+        if (memcmp(d->Key + (SIZE_T)i * d->Size, digests_free, d->Size) != 0)
+            digests_add(&n, d->Key + (SIZE_T)i * d->Size);
+
+    if (d->Key)
+        VirtualFree(d->Key, 0, MEM_RELEASE);
+    *d = n;
+    return TRUE;
+}
+
+// Entry of a key, or the free entry it would go into
+BYTE* digests_slot(DIGESTS* d, BYTE* key) {
+    DWORD i = (key[0] | key[1] << 8 | key[2] << 16 | (DWORD)key[3] << 24) & (d->Cap - 1);
+    BYTE* e;
+
+    for (;; i = (i + 1) & (d->Cap - 1)) {
+        e = d->Key + (SIZE_T)i * d->Size;
+        if (memcmp(e, digests_free, d->Size) == 0 || memcmp(e, key, d->Size) == 0)
+            return e;
+    }
+}
+
+BOOL digests_add(DIGESTS* d, BYTE* key) {
+    BYTE* e;
+
+    if (memcmp(key, digests_free, d->Size) == 0)
+        return TRUE;
+    if (d->Count * 2 >= d->Cap && !digests_grow(d))
+        return FALSE;
+
+    e = digests_slot(d, key);
+    if (memcmp(e, digests_free, d->Size) == 0) {
+        CopyMemory(e, key, d->Size);
+        d->Count++;
+    }
+    return TRUE;
+}
+
+BOOL digests_has(DIGESTS* d, BYTE* key) {
+    return d->Cap && memcmp(key, digests_free, d->Size) != 0 && memcmp(digests_slot(d, key), digests_free, d->Size) != 0;
+}
+
+// Store wide figures from garbage collection
+typedef struct {
+    DWORD       Recipes;
+    ULONGLONG   Logical;    // bytes of all images
+    DWORD       Chunks;     // chunks kept
+    ULONGLONG   Bytes;      // their size
+    DWORD       Removed;    // chunks and leftover temporary files removed
+    ULONGLONG   Freed;
+} STORE_STATS;
+
+// Removes every chunk no recipe refers to and temporary files of interrupted dumps. With
+// remove FALSE only counts. FALSE if a recipe cannot be read, nothing is removed then.
+BOOL store_gc(WCHAR* root, BOOL remove, STORE_STATS* st) {
+    WIN32_FIND_DATAW fd, cd;
+    WCHAR path[MAX_PATH], dir[MAX_PATH];
+    DIGESTS live = { NULL, hash_size(STORE_HASH), 0, 0 };
+    BYTE digest[HASH_MAX];
+    ULONGLONG size;
+    MANIFEST m;
+    HANDLE f, c;
+    DWORD i;
+    BOOL ok = TRUE;
+
+    ZeroMemory(st, sizeof(STORE_STATS));
+
+    // Every chunk of every recipe is live
+    swprintf(path, MAX_PATH, L"%s\\recipes\\*.manifest", root);
+    if ((f = FindFirstFileW(path, &fd)) != INVALID_HANDLE_VALUE) {
+        do {
+            swprintf(path, MAX_PATH, L"%s\\recipes\\%s", root, fd.cFileName);
+            if (!load_manifest(path, &m) || m.Algorithm != STORE_HASH) {
+                ok = FALSE;
+                break;
+            }
+
+            for (i = 0; i < m.Count && ok; i++)
+                ok = digests_add(&live, m.Digest + i * m.Size);
+
+            st->Recipes++;
+            st->Logical += m.Length;
+            HeapFree(GetProcessHeap(), 0, m.Digest);
+        } while (ok && FindNextFileW(f, &fd));
+        FindClose(f);
+    }
+
+    if (!ok) {
+        if (live.Key)
+            VirtualFree(live.Key, 0, MEM_RELEASE);
+        return FALSE;
+    }
+
+    // Then the chunks, two levels down
+    swprintf(path, MAX_PATH, L"%s\\chunks\\*", root);
+    if ((f = FindFirstFileW(path, &fd)) != INVALID_HANDLE_VALUE) {
+        do {
+            if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || fd.cFileName[0] == L'.')
+                continue;
+
+            swprintf(dir, MAX_PATH, L"%s\\chunks\\%s", root, fd.cFileName);
+            swprintf(path, MAX_PATH, L"%s\\*", dir);
+            if ((c = FindFirstFileW(path, &cd)) == INVALID_HANDLE_VALUE)
+                continue;
+
+            do {
+                char name[2 * HASH_MAX + 8];
+
+                if (cd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                    continue;
+
+                size = (ULONGLONG)cd.nFileSizeHigh << 32 | cd.nFileSizeLow;
+                wcstombs(name, cd.cFileName, sizeof(name) - 1);
+                name[sizeof(name) - 1] = '\0';
+
+                // A chunk is named by its digest alone, <digest>.<thread>.tmp is left over from a dump
+                if (wcslen(cd.cFileName) == 2 * live.Size && hash_unhex(name, live.Size, digest) && digests_has(&live, digest)) {
+                    st->Chunks++;
+                    st->Bytes += size;
+                    continue;
+                }
+
+                swprintf(path, MAX_PATH, L"%s\\%s", dir, cd.cFileName);
+                if (!remove || DeleteFileW(path)) {
+                    st->Removed++;
+                    st->Freed += size;
+                }
+            } while (FindNextFileW(c, &cd));
+            FindClose(c);
+        } while (FindNextFileW(f, &fd));
+        FindClose(f);
+    }
+
+    if (live.Key)
+        VirtualFree(live.Key, 0, MEM_RELEASE);
+    return TRUE;
+}
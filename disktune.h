@@ -0,0 +1,284 @@
+// Block size and queue depth autotuner shared by diskdump and diskrestore
+//
+// Before the transfer a short trial is run for every block size and number of requests in
+// flight, each reading (or for a restore writing) the start of the region for a fraction of
+// a second. The fastest combination wins, a smaller one within 5% of it is preferred as it
+// needs less memory. Results are cached per device model in %LOCALAPPDATA%\disktune.txt:
+//
+//   read|write <block> <depth> <MB/s> <vendor product>
+//
+// Write trials put back what was read there first, the disk is left as it was.
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#define TUNE_TRIAL 250          // ms per combination
+#define TUNE_WINDOW (64 << 20)  // trial buffer, write trials stay within this much of the region
+#define TUNE_DEPTH 16           // most requests in flight tried
+
+const DWORD tune_blocks[] = { 64 << 10, 256 << 10, 1 << 20, 4 << 20 };
+const DWORD tune_depths[] = { 1, 2, 4, 8, 16 };
+
+typedef struct {
+    DWORD       Block;      // 0 when not tuned
+    DWORD       Depth;
+    float       Speed;      // MB/s of the trial
+} TUNE;
+
+// Cache key, vendor and product as reported by the device without the padding
+char* tune_model(char* out, size_t len, const char* vendor, const char* product) {
+    char* p;
+
+    while (*vendor == ' ')
+        vendor++;
+    while (*product == ' ')
+        product++;
+
+    _snprintf(out, len - 1, "%s %s", vendor, product);
+    out[len - 1] = '\0';
+
+    for (p = out + strlen(out); p > out && (p[-1] == ' ' || p[-1] == '\n'); p--)
+        p[-1] = '\0';
+
+    return out;
+}
+
+// Cache file in the local application data, FALSE if there is none
+BOOL tune_path(WCHAR* path) {
+    DWORD n = GetEnvironmentVariableW(L"LOCALAPPDATA", path, MAX_PATH - 16);
+
+    if (!n || n >= MAX_PATH - 16)
+        return FALSE;
+
+    wcscat(path, L"\\disktune.txt");
+    return TRUE;
+}
+
+// Cached result for a model, FALSE if it was never tuned
+BOOL tune_load(const char* model, BOOL write, TUNE* t) {
+    WCHAR path[MAX_PATH];
+    char line[512], dir[8];
+    FILE* f;
+    int n;
+    BOOL found = FALSE;
+
+    if (!tune_path(path) || (f = _wfopen(path, L"r")) == NULL)
+        return FALSE;
+
+    while (!found && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (sscanf(line, "%7s %u %u %f %n", dir, &t->Block, &t->Depth, &t->Speed, &n) == 4 &&
+            strcmp(dir, (write) ? "write" : "read") == 0 && strcmp(line + n, model) == 0)
+            found = t->Block >= 512 && t->Block % 512 == 0 && t->Depth >= 1;
+    }
+
+    fclose(f);
+    return found;
+}
+
+// Replaces the cached result for a model
+BOOL tune_save(const char* model, BOOL write, TUNE* t) {
+    WCHAR path[MAX_PATH];
+    char line[512], dir[8], * keep;
+    size_t len = 0, room = 1 << 16;
+    FILE* f;
+    int n;
+    DWORD b, d;
+    float s;
+
+    if (!tune_path(path) || (keep = HeapAlloc(GetProcessHeap(), 0, room)) == NULL)
+        return FALSE;
+
+    // Every other line is kept as it is
+    if ((f = _wfopen(path, L"r")) != NULL) {
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "%7s %u %u %f %n", dir, &b, &d, &s, &n) == 4 && strcmp(dir, (write) ? "write" : "read") == 0 &&
+                strncmp(line + n, model, strlen(model)) == 0 && strcspn(line + n, "\r\n") == strlen(model))
+                continue;
+            if (len + strlen(line) < room) {
+                strcpy(keep + len, line);
+                len += strlen(line);
+            }
+        }
+        fclose(f);
+    }
+
+    if ((f = _wfopen(path, L"w")) == NULL) {
+        HeapFree(GetProcessHeap(), 0, keep);
+        return FALSE;
+    }
+
+    fwrite(keep, 1, len, f);
+    fprintf(f, "%s %u %u %.1f %s\n", (write) ? "write" : "read", t->Block, t->Depth, t->Speed, model);
+
+    HeapFree(GetProcessHeap(), 0, keep);
+    return fclose(f) == 0;
+}
+
+// One trial, depth requests of block bytes kept in flight for TUNE_TRIAL ms. Reads go on through
+// the region from where the last trial stopped, so the device cache does not help. Writes cycle
+// through the window holding what is on the disk there. MB/s, 0 on error.
+float tune_trial(HANDLE h, BYTE* buff, LONGLONG offset, LONGLONG span, DWORD block, DWORD depth, BOOL write, LONGLONG* cursor) {
+    OVERLAPPED ovl[TUNE_DEPTH];
+    LARGE_INTEGER freq, start, last, now;
+    LONGLONG done = 0, pos;
+    DWORD head = 0, tail = 0, busy = 0, ret, i;
+    BOOL ok, more = TRUE, failed = FALSE;
+
+    ZeroMemory(ovl, sizeof(ovl));
+    for (i = 0; i < depth; i++)
+        if ((ovl[i].hEvent = CreateEventW(NULL, TRUE, FALSE, NULL)) == NULL)
+            failed = TRUE, more = FALSE;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    last = start;
+
+    for (;;) {
+        while (more && busy < depth) {
+            if (*cursor + block > span)
+                *cursor = 0;
+            pos = offset + *cursor;
+
+            ovl[head].Internal = 0;
+            ovl[head].InternalHigh = 0;
+            ovl[head].Offset = (DWORD)pos;
+            ovl[head].OffsetHigh = (DWORD)(pos >> 32);
+
+            if (write)
+                ok = WriteFile(h, buff + *cursor, block, NULL, &ovl[head]);
+            else
+                ok = ReadFile(h, buff + head * block, block, NULL, &ovl[head]);
+
+            if (!ok && GetLastError() != ERROR_IO_PENDING) {
+                failed = TRUE;
+                more = FALSE;
+                break;
+            }
+
+            *cursor += block;
+            head = (head + 1) % depth;
+            busy++;
+        }
+
+        if (!busy)
+            break;
+
+        // The oldest request is waited for, the rest keep the device busy meanwhile
+        ok = GetOverlappedResult(h, &ovl[tail], &ret, TRUE);
+        QueryPerformanceCounter(&now);
+
+        if (more && (!ok || ret != block)) {
+            failed = TRUE;
+            more = FALSE;
+        }
+        else if (more) {
+            done += ret;
+            last = now;
+        }
+
+        tail = (tail + 1) % depth;
+        busy--;
+
+        // Time is up, whatever is still in flight does not count
+        if (more && (now.QuadPart - start.QuadPart) * 1000 >= TUNE_TRIAL * freq.QuadPart) {
+            more = FALSE;
+            for (i = 0; i < depth; i++)
+                CancelIoEx(h, &ovl[i]);
+        }
+    }
+
+    for (i = 0; i < depth; i++)
+        if (ovl[i].hEvent)
+            CloseHandle(ovl[i].hEvent);
+
+    if (failed || last.QuadPart == start.QuadPart)
+        return 0;
+
+    return ((float)done / (float)(1 << 20)) / ((float)(last.QuadPart - start.QuadPart) / (float)freq.QuadPart);
+}
+
+// Runs the trials on an overlapped handle and prints the curve, block sizes down and depths
+// across. A block given by the caller is kept and only depths are tried. FALSE if no trial worked.
+BOOL tune_probe(HANDLE h, LONGLONG offset, LONGLONG length, BOOL write, DWORD block, TUNE* best) {
+    OVERLAPPED ovl = { 0 };
+    TUNE trial[ARRAYSIZE(tune_blocks)][ARRAYSIZE(tune_depths)];
+    LONGLONG span, cursor = 0;
+    DWORD window = max(TUNE_WINDOW, block), size, ret, b, d, blocks;
+    BYTE* buff;
+    float top = 0;
+
+    ZeroMemory(trial, sizeof(trial));
+    ZeroMemory(best, sizeof(TUNE));
+
+    if ((buff = VirtualAlloc(NULL, window, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        return FALSE;
+
+    // Write trials put back what is there, so that is read first. Nothing is written unless all of
+    // it was read.
+    span = (write) ? min(length, (LONGLONG)window) : length;
+    if (write) {
+        span -= span % 512;
+        if ((ovl.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL)) == NULL) {
+            VirtualFree(buff, 0, MEM_RELEASE);
+            return FALSE;
+        }
+
+        for (cursor = 0; cursor < span; cursor += size) {
+            size = (DWORD)min((LONGLONG)(1 << 20), span - cursor);
+            ovl.Offset = (DWORD)(offset + cursor);
+            ovl.OffsetHigh = (DWORD)((offset + cursor) >> 32);
+
+            if ((!ReadFile(h, buff + cursor, size, NULL, &ovl) && GetLastError() != ERROR_IO_PENDING) ||
+                !GetOverlappedResult(h, &ovl, &ret, TRUE) || ret != size)
+                break;
+        }
+
+        CloseHandle(ovl.hEvent);
+        if (cursor < span) {
+            VirtualFree(buff, 0, MEM_RELEASE);
+            return FALSE;
+        }
+        cursor = 0;
+    }
+
+    blocks = (block) ? 1 : ARRAYSIZE(tune_blocks);
+
+    wprintf(L"%s trials, MB/s by block size and requests in flight:\n       ", (write) ? L"Write" : L"Read");
+    for (d = 0; d < ARRAYSIZE(tune_depths); d++)
+        wprintf(L" %7u", tune_depths[d]);
+    wprintf(L"\n");
+
+    for (b = 0; b < blocks; b++) {
+        size = (block) ? block : tune_blocks[b];
+        wprintf(L"%5u KB", size >> 10);
+
+        for (d = 0; d < ARRAYSIZE(tune_depths); d++) {
+            trial[b][d].Block = size;
+            trial[b][d].Depth = tune_depths[d];
+
+            // Read buffers come out of the window as well
+            if (span < size || (!write && (LONGLONG)size * tune_depths[d] > window)) {
+                wprintf(L"       -");
+                continue;
+            }
+
+            trial[b][d].Speed = tune_trial(h, buff, offset, span, size, tune_depths[d], write, &cursor);
+            top = max(top, trial[b][d].Speed);
+
+            wprintf(L" %7.1f", trial[b][d].Speed);
+            FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
+        }
+        wprintf(L"\n");
+    }
+
+    // Least memory within 5% of the fastest
+    for (b = 0; b < blocks; b++)
+        for (d = 0; d < ARRAYSIZE(tune_depths); d++)
+            if (trial[b][d].Speed && trial[b][d].Speed >= top * 0.95 &&
+                (!best->Block || (ULONGLONG)trial[b][d].Block * trial[b][d].Depth < (ULONGLONG)best->Block * best->Depth))
+                *best = trial[b][d];
+
+    VirtualFree(buff, 0, MEM_RELEASE);
+    return best->Block != 0;
+}
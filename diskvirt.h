@@ -0,0 +1,777 @@
+// Dynamic VHD, VHDX and qcow2 virtual disks shared by diskdump and diskrestore, include after
+// diskdelta.h and diskpart.h
+//
+// diskdump writes them block by block as the dump goes. A block of zeros is left unallocated,
+// any other is appended where the file ends. The tables that say where each block went, the
+// headers and the footer are written once the dump is done. All three get 2 MB blocks (qcow2
+// clusters), a block is allocated or not as a whole:
+//
+//   VHD     footer copy, dynamic header, BAT, blocks each behind a sector bitmap, footer
+//   VHDX    file identifier, two headers, two region tables, empty log, metadata, BAT, blocks
+//   qcow2   header, L1 table, L2 tables and clusters as they come, refcount table and blocks
+//
+// diskrestore reads them into extents of allocated data, the rest of the disk reads as zeros.
+// Differencing disks, a VHDX with a log to replay and qcow2 with a backing file, encryption or
+// compressed clusters are not read.
+//
+// Copyright (c) 2019-2022 by Google LLC
+// License: Apache 2.0
+#define VIRT_BLOCK (2 << 20)        // bytes per block written
+#define VIRT_MAX (64LL << 40)       // largest disk, the VHDX limit
+#define VIRT_TABLE (256 << 20)      // largest table read
+#define VHD_MAX (2040LL << 30)      // largest VHD, its BAT holds 32 bit sector numbers
+#define QCOW2_MAGIC 0x514649FB      // "QFI\xfb"
+
+#define VHDX_BAT "2DC27766-F623-4200-9D64-115E9BFD4A08"
+#define VHDX_METADATA "8B7CA206-4790-4B9A-B8FE-575F050F886E"
+#define VHDX_FILE_PARAMETERS "CAA16737-FA36-4D43-B3B6-33F0AA44E76B"
+#define VHDX_DISK_SIZE "2FA54224-CD1B-4876-B211-5DBED83BF4B8"
+#define VHDX_PAGE83 "BECA12AB-B2E6-4523-93EF-C309E000C746"
+#define VHDX_LOGICAL_SECTOR "8141BF1D-A96F-4709-BA47-F233A8FAAB5F"
+#define VHDX_PHYSICAL_SECTOR "CDA348C7-445D-4471-9CC9-E9885251C556"
+
+enum { VIRT_NONE, VIRT_VHD, VIRT_VHDX, VIRT_QCOW2 };
+
+typedef struct {
+    int         Format;     // VIRT_NONE for a raw image
+    DWORD       Block;      // bytes per block or cluster
+    LONGLONG    Length;     // of the virtual disk
+    DWORD       Count;      // blocks
+    DWORD       Used;       // blocks allocated
+    LONGLONG*   Map;        // writer: file offset of the data of every block, 0 if not allocated
+    LONGLONG*   Table;      // writer: file offset of every qcow2 L2 table, 0 if not allocated
+    DWORD       Tables;     // qcow2 L1 entries
+    LONGLONG    Pos;        // writer: end of the file, where the next block goes
+} VIRT;
+
+WCHAR* virt_name(int format) {
+    WCHAR* name[] = { L"raw", L"VHD", L"VHDX", L"qcow2" };
+
+    return name[format];
+}
+
+int virt_format(WCHAR* name) {
+    if (_wcsicmp(name, L"vhd") == 0)
+        return VIRT_VHD;
+    if (_wcsicmp(name, L"vhdx") == 0)
+        return VIRT_VHDX;
+    if (_wcsicmp(name, L"qcow2") == 0)
+        return VIRT_QCOW2;
+    return VIRT_NONE;
+}
+
+// VHD and qcow2 are big endian, VHDX little endian
+DWORD be32(BYTE* p) {
+    return (DWORD)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+ULONGLONG be64(BYTE* p) {
+    return (ULONGLONG)be32(p) << 32 | be32(p + 4);
+}
+
+void put_be(BYTE* p, ULONGLONG v, int bytes) {
+    while (bytes--) {
+        p[bytes] = (BYTE)v;
+        v >>= 8;
+    }
+}
+
+void put_le(BYTE* p, ULONGLONG v, int bytes) {
+    while (bytes--) {
+        *p++ = (BYTE)v;
+        v >>= 8;
+    }
+}
+
+// Mixed endian GUID as it is written out
+void virt_guid(BYTE* p, char* text) {
+    unsigned a, b, c, d[8], i;
+
+    sscanf(text, "%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x", &a, &b, &c, &d[0], &d[1], &d[2], &d[3], &d[4], &d[5], &d[6], &d[7]);
+    put_le(p, a, 4);
+    put_le(p + 4, b, 2);
+    put_le(p + 6, c, 2);
+    for (i = 0; i < 8; i++)
+        p[8 + i] = (BYTE)d[i];
+}
+
+BOOL virt_guid_is(BYTE* p, char* text) {
+    BYTE g[16];
+
+    virt_guid(g, text);
+    return memcmp(p, g, 16) == 0;
+}
+
+// Random (version 4) GUID
+void virt_random(BYTE* p) {
+    if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, p, 16, BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+        put_le(p, GetTickCount64() ^ (ULONGLONG)GetCurrentProcessId() << 32, 8);
+
+    p[7] = (p[7] & 0x0F) | 0x40;
+    p[8] = (p[8] & 0x3F) | 0x80;
+}
+
+// Table read into a zeroed buffer of its own, NULL if it does not fit in the file of size bytes.
+// Freed with VirtualFree.
+BYTE* virt_read(HANDLE h, ULONGLONG offset, DWORD len, LONGLONG size) {
+    BYTE* b;
+    DWORD ret;
+
+    if (!len || len > VIRT_TABLE || offset + len > (ULONGLONG)size || (b = VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        return NULL;
+
+    if (!read_at(h, b, len, offset, &ret) || ret != len) {
+        VirtualFree(b, 0, MEM_RELEASE);
+        return NULL;
+    }
+
+    return b;
+}
+
+// Appends an extent of data, joined to the last one when it follows on in the disk and the file
+BOOL virt_extent(DELTA_EXTENT** list, DWORD* count, DWORD* max, ULONGLONG offset, ULONGLONG data, ULONGLONG length) {
+    DELTA_EXTENT* x = (*count) ? &(*list)[*count - 1] : NULL;
+
+    if (x && x->Offset + x->Length == offset && x->Data + x->Length == data) {
+        x->Length += length;
+        return TRUE;
+    }
+
+    if (*count == *max) {
+        *max = (*max) ? *max * 2 : 1024;
+        x = (*list) ? HeapReAlloc(GetProcessHeap(), 0, *list, *max * sizeof(DELTA_EXTENT)) : HeapAlloc(GetProcessHeap(), 0, *max * sizeof(DELTA_EXTENT));
+        if (x == NULL)
+            return FALSE;
+        *list = x;
+    }
+
+    x = &(*list)[(*count)++];
+    x->Offset = offset;
+    x->Data = data;
+    x->Length = length;
+    return TRUE;
+}
+
+// VHDX dynamic disks keep a sector bitmap entry in the BAT after every chunk of blocks
+DWORD vhdx_ratio(DWORD block, DWORD sector) {
+    return (DWORD)(((ULONGLONG)1 << 23) * sector / block);
+}
+
+// Writer for a disk of length bytes, nothing goes into the file yet. FALSE if the disk is too
+// large for the format.
+BOOL virt_init(VIRT* v, int format, LONGLONG length) {
+    ZeroMemory(v, sizeof(VIRT));
+    v->Format = format;
+    v->Block = VIRT_BLOCK;
+    v->Length = length;
+    v->Count = (DWORD)((length + v->Block - 1) / v->Block);
+
+    if (length <= 0 || length > VIRT_MAX || (format == VIRT_VHD && length > VHD_MAX))
+        return FALSE;
+
+    if ((v->Map = VirtualAlloc(NULL, (SIZE_T)v->Count * sizeof(LONGLONG), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        return FALSE;
+
+    // Blocks start after the metadata
+    if (format == VIRT_VHD) {
+        v->Pos = 1536 + (((LONGLONG)v->Count * 4 + 511) & ~511LL);
+    }
+    else if (format == VIRT_VHDX) {
+        v->Pos = (3 << 20) + (((LONGLONG)(v->Count + (v->Count - 1) / vhdx_ratio(v->Block, 512)) * 8 + (1 << 20) - 1) & ~((1LL << 20) - 1));
+    }
+    else {
+        v->Tables = (v->Count + v->Block / 8 - 1) / (v->Block / 8);
+        if ((v->Table = VirtualAlloc(NULL, (SIZE_T)v->Tables * sizeof(LONGLONG), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+            return FALSE;
+        v->Pos = v->Block + ((LONGLONG)v->Tables * 8 + v->Block - 1) / v->Block * v->Block;
+    }
+
+    return TRUE;
+}
+
+// File offset for the data of block i, allocated at the end of the file the first time
+LONGLONG virt_alloc(VIRT* v, DWORD i) {
+    DWORD t = i / (v->Block / 8);
+
+    if (v->Map[i])
+        return v->Map[i];
+
+    // Sector bitmap in front of a VHD block, written with the tables
+    if (v->Format == VIRT_VHD)
+        v->Pos += 512;
+
+    // qcow2 L2 table for the next 512 GB when the first cluster there is written
+    if (v->Format == VIRT_QCOW2 && !v->Table[t]) {
+        v->Table[t] = v->Pos;
+        v->Pos += v->Block;
+    }
+
+    v->Map[i] = v->Pos;
+    v->Pos += v->Block;
+    v->Used++;
+    return v->Map[i];
+}
+
+// One's complement of the byte sum, the checksum field itself is zero while it is taken
+DWORD vhd_checksum(BYTE* p, DWORD len) {
+    DWORD sum = 0, i;
+
+    for (i = 0; i < len; i++)
+        sum += p[i];
+
+    return ~sum;
+}
+
+void vhd_footer(VIRT* v, BYTE* f) {
+    ULONGLONG sectors = min(v->Length / 512, 65535ULL * 16 * 255), cth;
+    DWORD spt, heads;
+    FILETIME now;
+
+    // CHS geometry as the VHD specification computes it
+    if (sectors >= 65535ULL * 16 * 63) {
+        spt = 255;
+        heads = 16;
+        cth = sectors / spt;
+    }
+    else {
+        spt = 17;
+        cth = sectors / spt;
+        heads = max((DWORD)((cth + 1023) / 1024), 4);
+        if (cth >= heads * 1024 || heads > 16) {
+            spt = 31;
+            heads = 16;
+            cth = sectors / spt;
+        }
+        if (cth >= heads * 1024) {
+            spt = 63;
+            heads = 16;
+            cth = sectors / spt;
+        }
+    }
+
+    // Seconds since January 1, 2000
+    GetSystemTimeAsFileTime(&now);
+
+    memcpy(f, "conectix", 8);
+    put_be(f + 8, 2, 4);
+    put_be(f + 12, 0x00010000, 4);
+    put_be(f + 16, 512, 8);
+    put_be(f + 24, ((ULONGLONG)now.dwHighDateTime << 32 | now.dwLowDateTime) / 10000000 - 12591158400ULL, 4);
+    memcpy(f + 28, "dskd", 4);
+    put_be(f + 32, 0x00010003, 4);
+    memcpy(f + 36, "Wi2k", 4);
+    put_be(f + 40, v->Length, 8);
+    put_be(f + 48, v->Length, 8);
+    put_be(f + 56, cth / heads, 2);
+    f[58] = (BYTE)heads;
+    f[59] = (BYTE)spt;
+    put_be(f + 60, 3, 4);
+    virt_random(f + 68);
+    put_be(f + 64, vhd_checksum(f, 512), 4);
+}
+
+BOOL vhd_finish(HANDLE h, VIRT* v) {
+    DWORD bat = (v->Count * 4 + 511) & ~511, i;
+    BYTE bitmap[512];
+    BYTE* b;
+    BOOL ok;
+
+    if ((b = VirtualAlloc(NULL, 1536 + bat, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        return FALSE;
+
+    // Footer copy, dynamic header and BAT back to back from the start of the file
+    vhd_footer(v, b);
+
+    memcpy(b + 512, "cxsparse", 8);
+    put_be(b + 520, ~0ULL, 8);
+    put_be(b + 528, 1536, 8);
+    put_be(b + 536, 0x00010000, 4);
+    put_be(b + 540, v->Count, 4);
+    put_be(b + 544, v->Block, 4);
+    put_be(b + 548, vhd_checksum(b + 512, 1024), 4);
+
+    for (i = 0; i < bat / 4; i++)
+        put_be(b + 1536 + i * 4, (i < v->Count && v->Map[i]) ? (v->Map[i] - 512) / 512 : 0xFFFFFFFF, 4);
+
+    ok = write_at(h, b, 1536 + bat, 0) && write_at(h, b, 512, v->Pos);
+
+    // Every sector of an allocated block holds data
+    memset(bitmap, 0xFF, sizeof(bitmap));
+    for (i = 0; i < v->Count && ok; i++)
+        if (v->Map[i])
+            ok = write_at(h, bitmap, sizeof(bitmap), v->Map[i] - 512);
+
+    VirtualFree(b, 0, MEM_RELEASE);
+    return ok;
+}
+
+BOOL vhdx_finish(HANDLE h, VIRT* v) {
+    DWORD ratio = vhdx_ratio(v->Block, 512), entries = v->Count + (v->Count - 1) / ratio, bat, i;
+    BYTE fwg[16], dwg[16];
+    BYTE* b;
+    BYTE* e;
+    BOOL ok;
+
+    bat = (entries * 8 + (1 << 20) - 1) & ~((1 << 20) - 1);
+    if ((b = VirtualAlloc(NULL, max(bat, 128 << 10), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        return FALSE;
+
+    // File type identifier with the creator
+    memcpy(b, "vhdxfile", 8);
+    for (i = 0; i < 8; i++)
+        put_le(b + 8 + i * 2, "diskdump"[i], 2);
+    ok = write_at(h, b, 64 << 10, 0);
+
+    // Two headers, the one with the higher sequence number is current. No log to replay.
+    virt_random(fwg);
+    virt_random(dwg);
+    for (i = 0; i < 2 && ok; i++) {
+        ZeroMemory(b, 4096);
+        memcpy(b, "head", 4);
+        put_le(b + 8, i + 1, 8);
+        memcpy(b + 16, fwg, 16);
+        memcpy(b + 32, dwg, 16);
+        put_le(b + 66, 1, 2);
+        put_le(b + 68, 1 << 20, 4);
+        put_le(b + 72, 1 << 20, 8);
+        put_le(b + 4, crc32c(0, b, 4096), 4);
+        ok = write_at(h, b, 4096, (64 << 10) * (i + 1));
+    }
+
+    // Region table and its copy, metadata at 2 MB and the BAT at 3 MB
+    ZeroMemory(b, 64 << 10);
+    memcpy(b, "regi", 4);
+    put_le(b + 8, 2, 4);
+    virt_guid(b + 16, VHDX_BAT);
+    put_le(b + 32, 3 << 20, 8);
+    put_le(b + 40, bat, 4);
+    put_le(b + 44, 1, 4);
+    virt_guid(b + 48, VHDX_METADATA);
+    put_le(b + 64, 2 << 20, 8);
+    put_le(b + 72, 1 << 20, 4);
+    put_le(b + 76, 1, 4);
+    put_le(b + 4, crc32c(0, b, 64 << 10), 4);
+    ok = ok && write_at(h, b, 64 << 10, 192 << 10) && write_at(h, b, 64 << 10, 256 << 10);
+
+    // Metadata table, the items follow 64 KB in
+    ZeroMemory(b, 128 << 10);
+    memcpy(b, "metadata", 8);
+    put_le(b + 10, 5, 2);
+
+    e = b + 32;
+    virt_guid(e, VHDX_FILE_PARAMETERS);
+    put_le(e + 16, 65536, 4), put_le(e + 20, 8, 4), put_le(e + 24, 4, 4);
+    virt_guid(e += 32, VHDX_DISK_SIZE);
+    put_le(e + 16, 65544, 4), put_le(e + 20, 8, 4), put_le(e + 24, 6, 4);
+    virt_guid(e += 32, VHDX_PAGE83);
+    put_le(e + 16, 65552, 4), put_le(e + 20, 16, 4), put_le(e + 24, 6, 4);
+    virt_guid(e += 32, VHDX_LOGICAL_SECTOR);
+    put_le(e + 16, 65568, 4), put_le(e + 20, 4, 4), put_le(e + 24, 6, 4);
+    virt_guid(e += 32, VHDX_PHYSICAL_SECTOR);
+    put_le(e + 16, 65572, 4), put_le(e + 20, 4, 4), put_le(e + 24, 6, 4);
+
+    put_le(b + 65536, v->Block, 4);
+    put_le(b + 65544, v->Length, 8);
+    virt_random(b + 65552);
+    put_le(b + 65568, 512, 4);
+    put_le(b + 65572, 512, 4);
+    ok = ok && write_at(h, b, 128 << 10, 2 << 20);
+
+    // Fully present blocks by their offset in MB, sector bitmap entries stay not present
+    ZeroMemory(b, bat);
+    for (i = 0; i < v->Count; i++)
+        if (v->Map[i])
+            put_le(b + (i + i / ratio) * 8, v->Map[i] | 6, 8);
+    ok = ok && write_at(h, b, bat, 3 << 20);
+
+    VirtualFree(b, 0, MEM_RELEASE);
+    return ok;
+}
+
+BOOL qcow2_finish(HANDLE h, VIRT* v) {
+    DWORD per = v->Block / 8, refs = v->Block / 2, bits, t, j;
+    LONGLONG clusters = v->Pos / v->Block, blocks = 0, tables = 0, total, k, n;
+    BYTE* b;
+    BOOL ok = TRUE;
+
+    if ((b = VirtualAlloc(NULL, v->Block, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        return FALSE;
+
+    // L2 tables, then the L1 table in the second cluster. Every cluster is used once, so all
+    // entries carry the copied flag.
+    for (t = 0; t < v->Tables && ok; t++) {
+        if (!v->Table[t])
+            continue;
+
+        ZeroMemory(b, v->Block);
+        for (j = 0; j < per && (ULONGLONG)t * per + j < v->Count; j++)
+            if (v->Map[t * per + j])
+                put_be(b + j * 8, v->Map[t * per + j] | 1ULL << 63, 8);
+        ok = write_at(h, b, v->Block, v->Table[t]);
+    }
+
+    ZeroMemory(b, v->Block);
+    for (t = 0; t < v->Tables; t++)
+        if (v->Table[t])
+            put_be(b + t * 8, v->Table[t] | 1ULL << 63, 8);
+    ok = ok && write_at(h, b, v->Block, v->Block);
+
+    // Refcount table and blocks go at the end and count themselves as well
+    do {
+        total = clusters + blocks + tables;
+        n = blocks;
+        blocks = (total + refs - 1) / refs;
+        tables = (blocks * 8 + v->Block - 1) / v->Block;
+    } while (blocks != n || clusters + blocks + tables != total);
+
+    for (k = 0; k < tables && ok; k++) {
+        ZeroMemory(b, v->Block);
+        for (j = 0; j < per && k * per + j < blocks; j++)
+            put_be(b + j * 8, v->Pos + (tables + k * per + j) * v->Block, 8);
+        ok = write_at(h, b, v->Block, v->Pos + k * v->Block);
+    }
+
+    for (k = 0; k < blocks && ok; k++) {
+        ZeroMemory(b, v->Block);
+        for (j = 0; j < refs && k * refs + j < total; j++)
+            put_be(b + j * 2, 1, 2);
+        ok = write_at(h, b, v->Block, v->Pos + (tables + k) * v->Block);
+    }
+
+    // Version 3 header, last
+    for (bits = 9; (1UL << bits) < v->Block; bits++)
+        ;
+
+    ZeroMemory(b, 4096);
+    put_be(b, QCOW2_MAGIC, 4);
+    put_be(b + 4, 3, 4);
+    put_be(b + 20, bits, 4);
+    put_be(b + 24, v->Length, 8);
+    put_be(b + 36, v->Tables, 4);
+    put_be(b + 40, v->Block, 8);
+    put_be(b + 48, v->Pos, 8);
+    put_be(b + 56, tables, 4);
+    put_be(b + 96, 4, 4);
+    put_be(b + 100, 104, 4);
+    ok = ok && write_at(h, b, 4096, 0);
+
+    VirtualFree(b, 0, MEM_RELEASE);
+    return ok;
+}
+
+// Writes the tables, headers and footer once every block is in, and frees the writer
+BOOL virt_finish(HANDLE h, VIRT* v) {
+    BOOL ok;
+
+    if (v->Format == VIRT_VHD)
+        ok = vhd_finish(h, v);
+    else if (v->Format == VIRT_VHDX)
+        ok = vhdx_finish(h, v);
+    else
+        ok = qcow2_finish(h, v);
+
+    VirtualFree(v->Map, 0, MEM_RELEASE);
+    if (v->Table)
+        VirtualFree(v->Table, 0, MEM_RELEASE);
+    v->Map = v->Table = NULL;
+    return ok;
+}
+
+// Format of an image file by its signature, FALSE for anything else
+BOOL virt_probe(HANDLE h, LONGLONG size, VIRT* v) {
+    BYTE b[512];
+    DWORD ret;
+
+    ZeroMemory(v, sizeof(VIRT));
+    if (size < 512)
+        return FALSE;
+
+    if (read_at(h, b, 512, 0, &ret) && ret == 512) {
+        if (memcmp(b, "vhdxfile", 8) == 0)
+            v->Format = VIRT_VHDX;
+        else if (be32(b) == QCOW2_MAGIC)
+            v->Format = VIRT_QCOW2;
+    }
+
+    // Fixed and dynamic VHD both end in the footer
+    if (!v->Format && read_at(h, b, 512, size - 512, &ret) && ret == 512 && memcmp(b, "conectix", 8) == 0)
+        v->Format = VIRT_VHD;
+
+    return v->Format != VIRT_NONE;
+}
+
+BOOL vhd_map(HANDLE h, LONGLONG size, VIRT* v, DELTA_EXTENT** out, DWORD* count) {
+    BYTE* f = NULL;
+    BYTE* d = NULL;
+    BYTE* bat = NULL;
+    BYTE* bitmap = NULL;
+    DWORD max = 0, bytes, sectors, i, j, k, e;
+    ULONGLONG start, end;
+    BOOL ok = FALSE;
+
+    if ((f = virt_read(h, size - 512, 512, size)) == NULL)
+        goto done;
+
+    v->Length = be64(f + 48);
+
+    // Fixed disk, the data is the file up to the footer
+    if (be32(f + 60) == 2) {
+        v->Block = 512;
+        v->Count = v->Used = (DWORD)min(v->Length / 512, 0xFFFFFFFFULL);
+        ok = v->Length <= (ULONGLONG)size - 512 && (!v->Length || virt_extent(out, count, &max, 0, 0, v->Length));
+        goto done;
+    }
+
+    // Anything else than dynamic is a differencing disk
+    if (be32(f + 60) != 3 || (d = virt_read(h, be64(f + 16), 1024, size)) == NULL || memcmp(d, "cxsparse", 8) != 0)
+        goto done;
+
+    v->Count = be32(d + 28);
+    v->Block = be32(d + 32);
+    if (!v->Block || v->Block % 512 || v->Block > (256 << 20) || (ULONGLONG)v->Count * v->Block < (ULONGLONG)v->Length)
+        goto done;
+
+    sectors = v->Block / 512;
+    bytes = ((sectors + 7) / 8 + 511) & ~511;
+
+    if (v->Count > VIRT_TABLE / 4 || (bat = virt_read(h, be64(d + 16), max(v->Count * 4, 1), size)) == NULL)
+        goto done;
+    if ((bitmap = VirtualAlloc(NULL, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        goto done;
+
+    for (i = 0; i < v->Count && (ULONGLONG)i * v->Block < (ULONGLONG)v->Length; i++) {
+        if ((e = be32(bat + i * 4)) == 0xFFFFFFFF)
+            continue;
+
+        v->Used++;
+        if (!read_at(h, bitmap, bytes, (ULONGLONG)e * 512, &j) || j != bytes)
+            goto done;
+
+        // Runs of sectors the bitmap marks as written, the others read as zeros
+        for (j = 0; j < sectors; j = k) {
+            while (j < sectors && !(bitmap[j / 8] & (0x80 >> (j % 8))))
+                j++;
+            for (k = j; k < sectors && (bitmap[k / 8] & (0x80 >> (k % 8))); k++)
+                ;
+
+            start = (ULONGLONG)i * v->Block + j * 512ULL;
+            end = min((ULONGLONG)i * v->Block + k * 512ULL, (ULONGLONG)v->Length);
+            if (end <= start)
+                continue;
+
+            if ((ULONGLONG)e * 512 + bytes + j * 512ULL + (end - start) > (ULONGLONG)size ||
+                !virt_extent(out, count, &max, start, (ULONGLONG)e * 512 + bytes + j * 512ULL, end - start))
+                goto done;
+        }
+    }
+    ok = TRUE;
+
+done:
+    if (f)
+        VirtualFree(f, 0, MEM_RELEASE);
+    if (d)
+        VirtualFree(d, 0, MEM_RELEASE);
+    if (bat)
+        VirtualFree(bat, 0, MEM_RELEASE);
+    if (bitmap)
+        VirtualFree(bitmap, 0, MEM_RELEASE);
+    return ok;
+}
+
+BOOL vhdx_map(HANDLE h, LONGLONG size, VIRT* v, DELTA_EXTENT** out, DWORD* count) {
+    BYTE* b = NULL;
+    BYTE* m = NULL;
+    BYTE* bat = NULL;
+    BYTE* hd = NULL;
+    BYTE* r = NULL;
+    BYTE* p;
+    BYTE none[16] = { 0 };
+    ULONGLONG batpos = 0, metapos = 0, e, start, len;
+    DWORD batlen = 0, metalen = 0, sector = 0, flags = 0, ratio, entries, max = 0, crc, i, n;
+    BOOL ok = FALSE;
+
+    // Identifier, both headers and both region tables are in the first 320 KB
+    if ((b = virt_read(h, 0, 320 << 10, size)) == NULL)
+        goto done;
+
+    for (i = 0; i < 2; i++) {
+        p = b + (64 << 10) * (i + 1);
+        crc = le32(p + 4);
+        put_le(p + 4, 0, 4);
+        if (memcmp(p, "head", 4) == 0 && crc32c(0, p, 4096) == crc && (!hd || le64(p + 8) > le64(hd + 8)))
+            hd = p;
+    }
+
+    // A log still to be replayed means the metadata may not be current
+    if (!hd || memcmp(hd + 48, none, 16) != 0)
+        goto done;
+
+    for (i = 0; i < 2 && !r; i++) {
+        p = b + (192 << 10) + (64 << 10) * i;
+        crc = le32(p + 4);
+        put_le(p + 4, 0, 4);
+        if (memcmp(p, "regi", 4) == 0 && crc32c(0, p, 64 << 10) == crc && le32(p + 8) <= 2047)
+            r = p;
+    }
+    if (!r)
+        goto done;
+
+    for (i = 0, n = le32(r + 8); i < n; i++) {
+        p = r + 16 + i * 32;
+        if (virt_guid_is(p, VHDX_BAT))
+            batpos = le64(p + 16), batlen = le32(p + 24);
+        else if (virt_guid_is(p, VHDX_METADATA))
+            metapos = le64(p + 16), metalen = le32(p + 24);
+    }
+
+    if ((m = virt_read(h, metapos, metalen, size)) == NULL || metalen < (64 << 10) || memcmp(m, "metadata", 8) != 0)
+        goto done;
+
+    for (i = 0, n = m[10] | m[11] << 8; i < n && i < 2047; i++) {
+        p = m + 32 + i * 32;
+        if (le32(p + 16) + (ULONGLONG)le32(p + 20) > metalen || le32(p + 20) < 4)
+            goto done;
+
+        if (virt_guid_is(p, VHDX_FILE_PARAMETERS) && le32(p + 20) >= 8)
+            v->Block = le32(m + le32(p + 16)), flags = le32(m + le32(p + 16) + 4);
+        else if (virt_guid_is(p, VHDX_DISK_SIZE) && le32(p + 20) >= 8)
+            v->Length = le64(m + le32(p + 16));
+        else if (virt_guid_is(p, VHDX_LOGICAL_SECTOR))
+            sector = le32(m + le32(p + 16));
+    }
+
+    // Differencing disks have a parent
+    if (v->Block < (1 << 20) || v->Block > (256 << 20) || (v->Block & (v->Block - 1)) || (sector != 512 && sector != 4096) ||
+        (flags & 2) || v->Length <= 0 || v->Length > VIRT_MAX)
+        goto done;
+
+    ratio = vhdx_ratio(v->Block, sector);
+    v->Count = (DWORD)((v->Length + v->Block - 1) / v->Block);
+    entries = v->Count + (v->Count - 1) / ratio;
+    if ((ULONGLONG)entries * 8 > batlen || (bat = virt_read(h, batpos, entries * 8, size)) == NULL)
+        goto done;
+
+    for (i = 0; i < v->Count; i++) {
+        e = le64(bat + ((ULONGLONG)i + i / ratio) * 8);
+        start = (ULONGLONG)i * v->Block;
+        len = min((ULONGLONG)v->Block, (ULONGLONG)v->Length - start);
+
+        // Partially present blocks only exist in differencing disks, the other states read as zeros
+        if ((e & 7) == 7)
+            goto done;
+        if ((e & 7) != 6)
+            continue;
+
+        v->Used++;
+        if ((e & ~0xFFFFFULL) + len > (ULONGLONG)size || !virt_extent(out, count, &max, start, e & ~0xFFFFFULL, len))
+            goto done;
+    }
+    ok = TRUE;
+
+done:
+    if (b)
+        VirtualFree(b, 0, MEM_RELEASE);
+    if (m)
+        VirtualFree(m, 0, MEM_RELEASE);
+    if (bat)
+        VirtualFree(bat, 0, MEM_RELEASE);
+    return ok;
+}
+
+BOOL qcow2_map(HANDLE h, LONGLONG size, VIRT* v, DELTA_EXTENT** out, DWORD* count) {
+    ULONGLONG mask = 0x00FFFFFFFFFFFE00ULL, e, start, len, blocks;
+    DWORD version, bits, l1, per, max = 0, t, j, i;
+    BYTE* b = NULL;
+    BYTE* l1t = NULL;
+    BYTE* l2 = NULL;
+    BOOL ok = FALSE;
+
+    if ((b = virt_read(h, 0, 512, size)) == NULL)
+        goto done;
+
+    version = be32(b + 4);
+    bits = be32(b + 20);
+    v->Length = be64(b + 24);
+    l1 = be32(b + 36);
+
+    // No backing file or encryption. Of the version 3 incompatible features only the dirty
+    // flag and the compression type are harmless to a reader that takes no compressed clusters.
+    if (version < 2 || version > 3 || be64(b + 8) || be32(b + 32) || bits < 9 || bits > 21 ||
+        (version == 3 && (be64(b + 72) & ~9ULL)) || v->Length <= 0 || v->Length > VIRT_MAX)
+        goto done;
+
+    // Small clusters on a large disk are more blocks than are counted, and the L1 table is
+    // capped before its size is taken
+    v->Block = 1 << bits;
+    blocks = ((ULONGLONG)v->Length + v->Block - 1) / v->Block;
+    per = v->Block / 8;
+    if (blocks > 0xFFFFFFFFULL || l1 > VIRT_TABLE / 8 || (ULONGLONG)l1 * per < blocks)
+        goto done;
+
+    v->Count = (DWORD)blocks;
+    if ((l1t = virt_read(h, be64(b + 40), l1 * 8, size)) == NULL)
+        goto done;
+    if ((l2 = VirtualAlloc(NULL, v->Block, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+        goto done;
+
+    for (t = 0; t < l1 && (ULONGLONG)t * per < v->Count; t++) {
+        if ((e = be64(l1t + t * 8) & mask) == 0)
+            continue;
+        if (e + v->Block > (ULONGLONG)size || !read_at(h, l2, v->Block, e, &j) || j != v->Block)
+            goto done;
+
+        for (j = 0; j < per && (i = t * per + j) < v->Count; j++) {
+            e = be64(l2 + j * 8);
+            if (e & (1ULL << 62))
+                goto done;
+
+            // Unallocated and zero clusters read as zeros
+            if ((e & mask) == 0 || (version == 3 && (e & 1)))
+                continue;
+
+            // The last cluster may end short of the file, the rest of it is zeros
+            start = (ULONGLONG)i * v->Block;
+            len = min((ULONGLONG)v->Block, (ULONGLONG)v->Length - start);
+            if ((e & mask) >= (ULONGLONG)size)
+                goto done;
+            len = min(len, (ULONGLONG)size - (e & mask));
+
+            v->Used++;
+            if (!virt_extent(out, count, &max, start, e & mask, len))
+                goto done;
+        }
+    }
+    ok = TRUE;
+
+done:
+    if (b)
+        VirtualFree(b, 0, MEM_RELEASE);
+    if (l1t)
+        VirtualFree(l1t, 0, MEM_RELEASE);
+    if (l2)
+        VirtualFree(l2, 0, MEM_RELEASE);
+    return ok;
+}
+
+// Extents of allocated data of an image found by virt_probe, sorted by disk offset. The list is
+// freed with HeapFree. FALSE if the image is damaged or uses a feature that is not read.
+BOOL virt_map(HANDLE h, LONGLONG size, VIRT* v, DELTA_EXTENT** out, DWORD* count) {
+    BOOL ok;
+
+    *out = NULL;
+    *count = 0;
+
+    if (v->Format == VIRT_VHD)
+        ok = vhd_map(h, size, v, out, count);
+    else if (v->Format == VIRT_VHDX)
+        ok = vhdx_map(h, size, v, out, count);
+    else
+        ok = qcow2_map(h, size, v, out, count);
+
+    if (!ok && *out) {
+        HeapFree(GetProcessHeap(), 0, *out);
+        *out = NULL;
+        *count = 0;
+    }
+    return ok;
+}